@@ -12,6 +12,13 @@
 #include "tzx.h"
 
 #include "spectrum.h"
+#include "snapshot.h"
+
+#include "stats.h"
+#include "listing.h"
+#include "sourcemap.h"
+
+#include "relobj.h"
 
 #include <iostream>
 #include <fstream>
@@ -20,6 +27,7 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <bitset>
 #include <stack>
 #include <memory>
 #include <iterator>
@@ -74,6 +82,10 @@ enum Defined
     PreDefined, DefinedPass1, DefinedPass2
 };
 
+// Bank of the symbols that are not labels of code generated
+// after .BANK.
+const int nobank = -1;
+
 class VarData
 {
     size_t lpos;
@@ -81,11 +93,13 @@ class VarData
     Defined defined;
     bool local;
     bool used;
+    int bank;
 public:
     VarData(size_t linepos, bool makelocal = false);
-    VarData(size_t linepos, address valuen, Defined definedn);
+    VarData(size_t linepos, address valuen, Defined definedn,
+        int bankn = nobank);
     ~VarData();
-    void set(address valuen, Defined definedn);
+    void set(address valuen, Defined definedn, int bankn = nobank);
     void setLine(size_t linepos);
     void setUsed();
     void clear();
@@ -94,7 +108,9 @@ public:
     Defined def() const;
     bool islocal() const;
     bool is_used() const;
+    int getbank() const;
     size_t getLine() const;
+    bool operator == (const VarData & vd) const;
 };
 
 } // namespace pasmo_impl
@@ -127,7 +143,6 @@ logic_error MACROLostENDM("Unexpected MACRO without ENDM");
 
 // Errors in the code being assembled.
 
-runtime_error ErrorReadingINCBIN("Error reading INCBIN file");
 runtime_error ErrorOutput("Error writing object file");
 
 runtime_error InvalidPredefine("Can't predefine invalid identifier");
@@ -169,6 +184,28 @@ AsmError ShiftOutsideMacro(size_t posline)
 
 runtime_error OutOfSyncPRL("PRL generation failed: out of sync");
 
+runtime_error OutOfSyncObj("Relocatable object generation failed: "
+    "the code depends on its address");
+
+class InvalidRelocation : public runtime_error
+{
+public:
+    InvalidRelocation(address offset) :
+        runtime_error("Relocatable object generation failed: "
+            "invalid use of relocatable symbols at offset " +
+            hex4str(offset) + 'H')
+    { }
+};
+
+class PublicNotRelocatable : public runtime_error
+{
+public:
+    PublicNotRelocatable(const std::string & name) :
+        runtime_error("Public symbol " + name +
+            " is not absolute or relative to the module")
+    { }
+};
+
 class PhaseError : public runtime_error
 {
 public:
@@ -185,6 +222,11 @@ public:
     { }
 };
 
+// End of the assembly in collect errors mode.
+struct ErrorsCollected
+{
+};
+
 void checktoken(TypeToken ttexpected, const Token & tok, size_t linepos)
 {
     if (tok.type() != ttexpected)
@@ -207,6 +249,10 @@ enum GenCodeMode { gen80, gen86 };
 const address addrTRUE = 0xFFFF;
 const address addrFALSE = 0;
 
+// Macro expansions that process less lines than this
+// are not included in the --trace output.
+const size_t tracemacrolines = 64;
+
 // Register codes used in some instructions.
 
 enum regwCode
@@ -464,19 +510,117 @@ std::string getregbname(regbCode rb, prefix_t prefix = NoPrefix,
 }
 
 
-std::string tablabel(std::string str)
+// Line of the symbol tables.
+
+// The pasmo format can be assembled, the others are the ones of
+// sjasmplus and of the no$ debuggers, used by other tools, and
+// include the bank of the labels defined after .BANK.
+
+void appendsymbol(TextBuffer & text, const std::string & name, address value,
+    int bank, Asm::SymbolFormat format)
 {
-    const std::string::size_type l = str.size();
-    if (l < 8)
-        str+= "\t\t";
-    else
-        if (l < 16)
-            str+= '\t';
-        else
-            str+= ' ';
-    return str;
+    static const char equ [] = "EQU 0";
+    static const char sjasmequ [] = ": EQU 0x00";
+    const byte page = bank == pasmo_impl::nobank ? 0 : byte(bank);
+    char * p = text.reserve(name.size() + 2 + sizeof(sjasmequ) + 6 + 2);
+    switch (format)
+    {
+    case Asm::SymbolPasmo:
+        p = puttablabel(p, name);
+        p = std::copy(equ, equ + sizeof(equ) - 1, p);
+        p = puthex4(p, value);
+        * p++ = 'H';
+        break;
+    case Asm::SymbolSjasm:
+        p = std::copy(name.begin(), name.end(), p);
+        p = std::copy(sjasmequ, sjasmequ + sizeof(sjasmequ) - 1, p);
+        p = puthex2(p, page);
+        p = puthex4(p, value);
+        break;
+    case Asm::SymbolNocash:
+        p = puthex2(p, page);
+        * p++ = ':';
+        p = puthex4(p, value);
+        * p++ = ' ';
+        p = std::copy(name.begin(), name.end(), p);
+        break;
+    }
+    * p++ = '\n';
+    text.commit(p);
 }
 
+//***********************************************
+//        Memory map
+//***********************************************
+
+// Contiguous block of generated code, in the main memory or in
+// a bank.
+
+struct MemBlock
+{
+    address start;
+    address end;
+    size_t line;
+    size_t overwritten;
+    int bank;
+    MemBlock(address startn, size_t linen,
+        int bankn = pasmo_impl::nobank);
+};
+
+MemBlock::MemBlock(address startn, size_t linen, int bankn) :
+    start(startn),
+    end(startn),
+    line(linen),
+    overwritten(0),
+    bank(bankn)
+{ }
+
+// Memory region declared with .REGION
+
+struct MemRegion
+{
+    std::string name;
+    address start;
+    address end;
+    size_t line;
+    MemRegion(const std::string & namen, address startn, address endn,
+            size_t linen);
+};
+
+MemRegion::MemRegion(const std::string & namen,
+        address startn, address endn, size_t linen) :
+    name(namen),
+    start(startn),
+    end(endn),
+    line(linen)
+{ }
+
+// Unit of code for unused code elimination: a top level PROC.
+// fallsinto is the unit that follows it if the execution can
+// continue from its end into that unit.
+
+struct CodeUnit
+{
+    size_t line;
+    address start;
+    address end;
+    size_t size;
+    bool keep;
+    size_t fallsinto;
+    std::set <std::string> refs;
+    std::vector <std::string> defs;
+    CodeUnit(size_t linen, address startn, bool keepn);
+};
+
+CodeUnit::CodeUnit(size_t linen, address startn, bool keepn) :
+    line(linen),
+    start(startn),
+    end(startn),
+    size(0),
+    keep(keepn),
+    fallsinto(size_t(-1) )
+{ }
+
 //***********************************************
 //        Auxiliary tables
 //***********************************************
@@ -566,27 +710,31 @@ VarData::VarData(size_t linepos, bool makelocal) :
     value(0),
     defined(NoDefined),
     local(makelocal),
-    used(false)
+    used(false),
+    bank(nobank)
 {
 }
 
-VarData::VarData(size_t linepos, address valuen, Defined definedn) :
+VarData::VarData(size_t linepos, address valuen, Defined definedn,
+        int bankn) :
     lpos(linepos),
     value(valuen),
     defined(definedn),
     local(false),
-    used(false)
+    used(false),
+    bank(bankn)
 { }
 
 VarData::~VarData()
 {
 }
 
-void VarData::set(address valuen, Defined definedn)
+void VarData::set(address valuen, Defined definedn, int bankn)
 {
     TRVAR("VarData.set" << (islocal() ? " local" : "") << '\n');
     value = valuen;
     defined = definedn;
+    bank = bankn;
 }
 
 void VarData::setLine(size_t linepos)
@@ -603,6 +751,7 @@ void VarData::clear()
 {
     value = 0;
     defined = NoDefined;
+    bank = nobank;
 }
 
 address VarData::getvalue()
@@ -635,11 +784,22 @@ bool VarData::is_used() const
     return used;
 }
 
+int VarData::getbank() const
+{
+    return bank;
+}
+
 size_t VarData::getLine() const
 {
     return lpos;
 }
 
+bool VarData::operator == (const VarData & vd) const
+{
+    return lpos == vd.lpos && value == vd.value && defined == vd.defined &&
+        local == vd.local && used == vd.used && bank == vd.bank;
+}
+
 //--------------------------------------------------------------
 
 class mapvar_t : private std::map <std::string, VarData>
@@ -651,6 +811,11 @@ public:
     using parent::const_iterator;
     using parent::erase;
 
+    mapvar_t();
+    // The copies do not record the lookups.
+    mapvar_t(const mapvar_t & mv);
+    mapvar_t & operator = (const mapvar_t & mv);
+
     iterator begin() { return parent::begin(); }
     iterator end() { return parent::end(); }
     const_iterator begin() const { return parent::begin(); }
@@ -664,14 +829,78 @@ public:
     address getvalue(const std::string & varname, size_t linepos,
             bool required, bool ignored, int pass);
     void setvar(const std::string & varname, size_t linepos,
-            address value, Defined definedn);
+            address value, Defined definedn, int bank);
 
     void clearDefl();
+
+    // Find without counting or recording the lookup.
+    const VarData * peek(const std::string & varname) const;
+
+    // Record in the map pointed the names looked up, with the stamp
+    // in use the first time each one is searched.
+    typedef std::map <std::string, size_t> lookedup_t;
+    void recordlookups(lookedup_t * plookedup_n);
+    void setstamp(size_t stamp_n);
+
+    size_t getlookups() const { return lookups; }
+    size_t getinserts() const { return inserts; }
+private:
+    void lookedup(const std::string & varname) const;
+
+    mutable size_t lookups;
+    size_t inserts;
+    lookedup_t * plookedup;
+    size_t stamp;
 };
 
+mapvar_t::mapvar_t() :
+    lookups(0),
+    inserts(0),
+    plookedup(0),
+    stamp(0)
+{ }
+
+mapvar_t::mapvar_t(const mapvar_t & mv) :
+    parent(mv),
+    lookups(0),
+    inserts(0),
+    plookedup(0),
+    stamp(0)
+{ }
+
+mapvar_t & mapvar_t::operator = (const mapvar_t & mv)
+{
+    parent::operator = (mv);
+    return * this;
+}
+
+const VarData * mapvar_t::peek(const std::string & varname) const
+{
+    auto const it = parent::find(varname);
+    return it == parent::end() ? 0 : & it->second;
+}
+
+void mapvar_t::recordlookups(lookedup_t * plookedup_n)
+{
+    plookedup = plookedup_n;
+}
+
+void mapvar_t::setstamp(size_t stamp_n)
+{
+    stamp = stamp_n;
+}
+
+inline void mapvar_t::lookedup(const std::string & varname) const
+{
+    if (plookedup != 0)
+        plookedup->insert(make_pair(varname, stamp) );
+}
+
 mapvar_t::iterator mapvar_t::find(const std::string & varname)
 {
     TRVAR("mapvar find " << varname << '?');
+    ++lookups;
+    lookedup(varname);
     auto const result = parent::find(varname);
     TRVAR((result != parent::end() ? " YES" : "NO") << '\n');
     return result;
@@ -683,6 +912,7 @@ VarData & mapvar_t::operator [] (const std::string & varname)
     if (it == end())
     {
         TRVAR("mapvar [] insert " << varname << '\n');
+        ++inserts;
         it = parent::insert(make_pair(varname,
             VarData(0, 0, NoDefined))).first;
     }
@@ -691,12 +921,16 @@ VarData & mapvar_t::operator [] (const std::string & varname)
 
 bool mapvar_t::exists(const std::string & varname) const
 {
+    ++lookups;
+    lookedup(varname);
     return parent::find(varname) != parent::end();
 }
 
 bool mapvar_t::isdefined(const std::string & varname, int pass)
 {
     bool result = false;
+    ++lookups;
+    lookedup(varname);
     auto const it = parent::find(varname);
     if (it != parent::end())
     {
@@ -766,9 +1000,11 @@ address mapvar_t::getvalue(const std::string & varname, size_t linepos,
 }
 
 void mapvar_t::setvar(const std::string & varname, size_t linepos,
-        address value, Defined defined)
+        address value, Defined defined, int bank)
 {
-    parent::insert(make_pair(varname, VarData(linepos, value, defined) ) );
+    ++inserts;
+    parent::insert(make_pair(varname,
+        VarData(linepos, value, defined, bank) ) );
 }
 
 //--------------------------------------------------------------
@@ -840,6 +1076,7 @@ using pasmo_impl::DefinedDEFL;
 using pasmo_impl::PreDefined;
 using pasmo_impl::DefinedPass1;
 using pasmo_impl::DefinedPass2;
+using pasmo_impl::nobank;
 
 using pasmo_impl::VarData;
 using pasmo_impl::LocalLevel;
@@ -865,6 +1102,7 @@ public:
     void verbose();
     void setdebugtype(DebugType type);
     void errtostdout();
+    void setwarnstream(std::ostream & out);
     void setbase(address addr);
     void caseinsensitive();
     void autolocal();
@@ -873,14 +1111,29 @@ public:
     void set86();
     void setpass3();
     void setwerror();
+    void relax();
+    void dropunused();
+    void compress();
+    bool iscompress() const;
+    void setmaxerrors(size_t n);
+    void setspeed(const std::string & speedn);
+    const std::string & getspeed() const;
+    void setsnapbase(const std::string & filename);
 
     void addpredef(const std::string & predef);
     const std::string & getheadername() const;
     void setheadername(const std::string & headername_n);
 
     void parseline(Tokenizer & tz);
+    void parselinecode(Tokenizer & tz);
+    void parselinelisted(Tokenizer & tz);
     void loadfile(const std::string & filename);
     void processfile();
+    bool assemble(const std::string & filename);
+
+    void incremental(size_t interval);
+    void reloadfile(const std::string & filename);
+    size_t getresumeline(int npass) const;
 
     void setpass(int npass);
     int currentpass() const;
@@ -892,7 +1145,13 @@ public:
     address getentrypoint() const;
 
     void message_emit(const std::string & type) const;
+    void message_compress(const spectrum::CompressedCode & code) const;
+    void message_loadtime(double seconds) const;
     void writebincode(std::ostream & out) const;
+    void appendcode(ByteBuffer & image) const;
+    void setsnapshot(snapshot::Machine & machine) const;
+    std::vector <BankCode> getbanks() const;
+    void checknobanks(const std::string & format) const;
 
     void emithex(std::ostream & out);
 
@@ -900,10 +1159,29 @@ public:
     void emitcmd(std::ostream & out);
 
     void emitsdrel(std::ostream & out);
+    void emitrelobj(std::ostream & out);
 
     void emitmsx(std::ostream & out);
     void dumppublic(std::ostream & out);
     void dumpsymbol(std::ostream & out);
+    void dumpmap(std::ostream & out);
+
+    void trace();
+    void listing();
+    void dumplisting(std::ostream & out);
+    void sourcemap();
+    void dumpsourcemap(std::ostream & out);
+    void dumpsourceindex(std::ostream & out);
+    void setsymbolformat(SymbolFormat format);
+    void beginphase(const std::string & name, const std::string & file);
+    void beginspan(const std::string & name, size_t line);
+    void endphase();
+    void cancelphase();
+    void addemitted(size_t size);
+    void dumpstats(std::ostream & out, bool json);
+    void dumptrace(std::ostream & out);
+    double phasetime(const std::string & name) const;
+    void resetstats();
 
     const byte * getmem() const;
     byte peekbyte(address addr) const;
@@ -917,7 +1195,12 @@ private:
     void checkendline(Tokenizer & tz);
 
     void gendata(byte data);
+    void genbankdata(byte data);
     void gendataword(address dataword);
+    // The len bytes generated from addr, in the bank selected or
+    // in the main memory, copied to codebytes.
+    std::vector <byte> codebytes;
+    const byte * getcode(address addr, size_t len);
 
     void showcode(const std::string & instruction);
     void gencode(byte code);
@@ -928,9 +1211,11 @@ private:
     void gencodeword(address value);
 
     bool setvar(const std::string & varname,
-        address value, Defined defined);
+        address value, Defined defined, int bank = nobank);
     address getvalue(const std::string & var,
         bool required, bool ignored);
+    address getbank(const std::string & var,
+        bool required, bool ignored);
 
     // Expression evaluation.
 
@@ -982,7 +1267,15 @@ private:
     void parseELSE(Tokenizer & tz);
     void parseENDIF(Tokenizer & tz);
 
-    void dopass();
+    void dopass(size_t resume);
+    void dorelaxpasses();
+    void doallpasses();
+    void clearstate();
+
+    // Collect errors mode.
+    void parselinecollect(Tokenizer & tz);
+    void recorderror(const AsmError & err);
+    void reporterrors();
 
     bool parsesimple(Tokenizer & tz, Token tok);
     void parsegeneric(Tokenizer & tz, Token tok);
@@ -995,7 +1288,8 @@ private:
     void parseEQU(Tokenizer & tz, const std::string & label);
     void parseDEFL(Tokenizer & tz, const std::string & label);
 
-    bool setequorlabel(const std::string & name, address value);
+    bool setequorlabel(const std::string & name, address value,
+        int bank = nobank);
     bool setdefl(const std::string & name, address value);
     void setlabel(const std::string & name);
     void parselabel(Tokenizer & tz, const std::string & name);
@@ -1079,6 +1373,7 @@ private:
     void parseJP_ (Tokenizer & tz, bool bracket);
     void parseJP(Tokenizer & tz);
     byte getrelative(address addr, address off);
+    bool relaxbranch(address addr, address off);
     void parserelative(Tokenizer & tz, Token tok, byte code,
         const std::string instrname);
     void parseJR(Tokenizer & tz);
@@ -1105,6 +1400,7 @@ private:
     void parseDEFS(Tokenizer & tz);
     void parseINCBIN(Tokenizer & tz);
     void parsePUBLIC(Tokenizer & tz);
+    void parseEXTRN(Tokenizer & tz);
     void parseEND(Tokenizer & tz);
     void parseLOCAL(Tokenizer & tz);
     void parsePROC(Tokenizer & tz);
@@ -1114,21 +1410,31 @@ private:
     void parse_Z80(Tokenizer & tz);
     void parse_ERROR(Tokenizer & tz);
     void parse_WARNING(Tokenizer & tz);
+    void parse_REGION(Tokenizer & tz);
+    void parse_BANK(Tokenizer & tz);
+    void parse_PAGE(Tokenizer & tz);
 
     // Variables.
 
     std::string headername;
+    std::string speed;
+    std::string snapbase;
 
     bool nocase;
     bool autolocalmode;
     bool bracketonlymode;
     bool warn8080mode;
     bool werror;
+    bool relaxmode;
+    bool dropunusedmode;
+    bool compressmode;
+    // Number of errors reported before stopping, 0 for no limit.
+    size_t maxerrors;
     GenCodeMode genmode;
     bool mode86;
     DebugType debugtype;
 
-    byte mem [65536];
+    MemImage mem;
     address base;
     address current;
     address currentinstruction;
@@ -1139,6 +1445,77 @@ private:
     int pass;
     int lastpass;
 
+    // ********* Branch relaxation **********
+
+    // One entry for each JR or DJNZ in order of appearance in a
+    // pass, true when it must be generated in the long form.
+    std::vector <bool> relaxlong;
+    size_t relaxindex;
+    bool relaxchanged;
+    size_t nrelaxshort;
+    size_t nrelaxlong;
+
+    // ********* Memory map **********
+
+    typedef std::vector <MemBlock> memblocks_t;
+    memblocks_t memblocks;
+    std::bitset <65536> memwritten;
+    typedef std::vector <MemRegion> memregions_t;
+    memregions_t memregions;
+    typedef std::vector <std::pair <address, std::string> > maplabels_t;
+    maplabels_t maplabels;
+
+    void checkmemmap();
+
+    // ********* Banked memory **********
+
+    // Pages of 16KB where the code goes after .BANK n, mapped at
+    // the address set with .PAGE. A page is allocated when the
+    // first byte is generated in it.
+    static const address banksize = 0x4000;
+    // The code of a bank is always seen in the same page.
+    struct Bank
+    {
+        std::vector <byte> data;
+        address minused;
+        address maxused;
+        address window;
+        // Offsets written in the current pass.
+        std::bitset <banksize> written;
+        Bank();
+    };
+    typedef std::map <int, Bank> banks_t;
+    banks_t banks;
+    int currentbank;
+    address bankwindow;
+    // .BANK has been used, the checkpoints do not keep the banks.
+    bool bankmode;
+
+    // ********* Unused code elimination **********
+
+    static const size_t nounit = size_t(-1);
+    typedef std::vector <CodeUnit> codeunits_t;
+    codeunits_t codeunits;
+    size_t currentunit;
+    size_t procdepth;
+    std::set <std::string> rootrefs;
+    std::vector <bool> unitdropped;
+    // Labels outside the PROCs at the current address, the ones
+    // just before a PROC belong to its unit.
+    std::vector <std::string> prelabels;
+    address prelabeladdr;
+    // End of the last code generated and its unit, and if the
+    // execution can continue after it: false after RET, JP and
+    // JR without condition.
+    address codeend;
+    size_t codeendunit;
+    bool codefalls;
+
+    void addref(const std::string & varname);
+    void adddef(const std::string & varname, bool islocal);
+    void skipPROC();
+    bool removeunused();
+
     // iflevel is needed to control IF and MACRO interactions
     size_t iflevel;
     std::vector <size_t> ifstack;
@@ -1150,10 +1527,33 @@ private:
 
     typedef std::set <std::string> setpublic_t;
     setpublic_t setpublic;
+    setpublic_t setextern;
+
+    // Errors found in collect errors mode, at most one for each
+    // line, and labels of the lines that failed, whose uses are
+    // not reported as undefined.
+    struct LineError
+    {
+        size_t line;
+        std::string message;
+    };
+    std::vector <LineError> lineerrors;
+    std::set <size_t> errorlines;
+    setpublic_t failedlabels;
+    // Bytes generated by each line in pass 1, a line that fails
+    // only in a later pass keeps his size to not move the labels
+    // that follow it.
+    typedef std::map <size_t, address> linesizes_t;
+    linesizes_t linesizes;
+    // Values given to the EXTRN symbols, 0 if not in it.
+    typedef std::map <std::string, address> externvalues_t;
+    externvalues_t externvalues;
 
     // ********* Information streams ********
 
     Nullostream nullout;
+    // Buffer reused by showcode.
+    TextBuffer codetext;
     std::ostream * pout;
     std::ostream * perr;
     std::ostream * pverb;
@@ -1194,6 +1594,100 @@ private:
     pasmo_impl::MacroFrameBase * getmframe() const;
     void setmframe(pasmo_impl::MacroFrameBase * pnew);
 
+    // ********* Incremental assembly **********
+
+    // State at the start of a line in a pass, taken only out of
+    // macros, IF and local blocks. The symbols and the memory are
+    // stored as the changes since the previous checkpoint, the
+    // vectors that only grow during a pass by their size.
+    struct Checkpoint
+    {
+        size_t line;
+        address current;
+        address entrypoint;
+        bool entrypointdefined;
+        size_t localcount;
+        mapmacro_t macros;
+        size_t nmemblocks;
+        MemBlock lastmemblock;
+        size_t nmemregions;
+        size_t nmaplabels;
+        setpublic_t publics;
+        setpublic_t externs;
+        std::vector <std::pair <address, byte> > memchanged;
+        std::vector <std::pair <std::string, VarData> > varchanged;
+        std::vector <std::string> varerased;
+        Checkpoint();
+    };
+    typedef std::vector <Checkpoint> checkpoints_t;
+
+    static const size_t nocheckpoint = size_t(-1);
+
+    // Lines between checkpoints, 0 when not in incremental mode.
+    size_t ckinterval;
+    // The checkpoints are from the last successful assembly.
+    bool ckvalid;
+    // First line changed by the last reloadfile.
+    size_t changedline;
+    checkpoints_t checkpoints [2];
+    size_t resumeline [2];
+    // Symbols at the last checkpoint.
+    mapvar_t ckvars;
+    // Symbols at the start of pass 2, and the symbols looked up
+    // in that pass with the number of checkpoints taken before.
+    mapvar_t pass2vars;
+    mapvar_t::lookedup_t lookedup;
+    std::bitset <65536> memchanged;
+    // Files included with INCBIN in pass 1, with the first line
+    // that includes each one and its content.
+    typedef std::map <std::string, std::pair <size_t, std::string> >
+        incbins_t;
+    incbins_t incbins;
+
+    bool isincremental() const;
+    void checkpoint(const Tokenizer & tz);
+    size_t findcheckpoint() const;
+    void restorecheckpoint(size_t resume);
+    bool samesymbols(size_t resume) const;
+
+    // ********* Statistics **********
+
+    Stats stats;
+    bool tracemode;
+    size_t traceincludes;
+    size_t nlines;
+    size_t ntokens;
+    size_t nmacroexpansions;
+    size_t nmacrolines;
+    size_t nskippedlines;
+    size_t nemitted;
+
+    // Listing of the last pass. The lines that contain others, such
+    // as macro expansions, are listed before them without code,
+    // the rest after being processed.
+    bool listmode;
+    size_t ncodebytes;
+    Listing listbuffer;
+    struct ListEntry
+    {
+        size_t line;
+        address addr;
+        size_t ncodebytes;
+        bool listed;
+        std::string text;
+    };
+    std::vector <ListEntry> liststack;
+    std::string listfilename;
+    void listentry(const ListEntry & entry, size_t len);
+
+    // Source line of the code of the last pass.
+    bool srcmapmode;
+    SourceMap srcmap;
+    void getsourceranges(std::vector <SourceRange> & ranges,
+        std::vector <std::string> & files) const;
+
+    SymbolFormat symbolformat;
+
     // gencode control.
 
     bool firstcode;
@@ -1216,7 +1710,7 @@ typedef std::vector <MacroArgument> MacroArgumentList;
 class MacroFrameBase
 {
 protected:
-    MacroFrameBase(Asm::In & asmin_n,
+    MacroFrameBase(Asm::In & asmin_n, const std::string & name,
         const MacroBase & macro_n, const MacroArgumentList & arguments_n);
 public:
     virtual ~MacroFrameBase();
@@ -1231,6 +1725,7 @@ protected:
 private:
     const size_t expandline;
     const size_t previflevel;
+    const size_t prevlines;
     const MacroBase & macro;
 protected:
     MacroArgumentList arguments;
@@ -1243,7 +1738,7 @@ private:
 class MacroFrameChild : public MacroFrameBase
 {
 protected:
-    MacroFrameChild(Asm::In & asmin_n,
+    MacroFrameChild(Asm::In & asmin_n, const std::string & name,
         const MacroBase & macro_n, const MacroArgumentList & arguments_n);
 public:
     //void shift(size_t linepos);
@@ -1281,7 +1776,7 @@ public:
 class MacroFrameMacro : public MacroFrameBase
 {
 public:
-    MacroFrameMacro(Asm::In & asmin_n,
+    MacroFrameMacro(Asm::In & asmin_n, const std::string & name,
         const Macro & macro_n, const MacroArgumentList & arguments_n);
     void shift(size_t linepos);
     Tokenizer substparams(Tokenizer & tz);
@@ -1449,6 +1944,10 @@ Asm::In::In() :
     bracketonlymode(false),
     warn8080mode(false),
     werror(false),
+    relaxmode(false),
+    dropunusedmode(false),
+    compressmode(false),
+    maxerrors(1),
     genmode(gen80),
     mode86(false),
     debugtype(NoDebug),
@@ -1461,22 +1960,57 @@ Asm::In::In() :
     entrypointdefined(false),
     pass(0),
     lastpass(2),
+    relaxindex(0),
+    relaxchanged(false),
+    nrelaxshort(0),
+    nrelaxlong(0),
+    currentbank(nobank),
+    bankwindow(0xC000),
+    bankmode(false),
+    currentunit(nounit),
+    procdepth(0),
+    prelabeladdr(0),
+    codeend(0),
+    codeendunit(nounit),
+    codefalls(false),
     pout(& cout),
     perr(& cerr),
     pverb(& nullout),
     pwarn(& cerr),
     localcount(0),
-    pcurrentmframe(0)
-{
+    pcurrentmframe(0),
+    ckinterval(0),
+    ckvalid(false),
+    changedline(0),
+    tracemode(false),
+    traceincludes(0),
+    nlines(0),
+    ntokens(0),
+    nmacroexpansions(0),
+    nmacrolines(0),
+    nskippedlines(0),
+    nemitted(0),
+    listmode(false),
+    ncodebytes(0),
+    srcmapmode(false),
+    symbolformat(SymbolPasmo)
+{
+    resumeline [0] = resumeline [1] = 0;
 }
 
 Asm::In::In(const Asm::In & in) :
     AsmFile(in),
     headername(in.headername),
+    speed(in.speed),
+    snapbase(in.snapbase),
     nocase(in.nocase),
     autolocalmode(in.autolocalmode),
     bracketonlymode(in.bracketonlymode),
     warn8080mode(in.warn8080mode),
+    relaxmode(in.relaxmode),
+    dropunusedmode(in.dropunusedmode),
+    compressmode(in.compressmode),
+    maxerrors(in.maxerrors),
     genmode(in.genmode),
     mode86(in.mode86),
     debugtype(in.debugtype),
@@ -1486,19 +2020,58 @@ Asm::In::In(const Asm::In & in) :
     minused(65535),
     maxused(0),
     entrypointdefined(false),
+    relaxindex(0),
+    relaxchanged(false),
+    nrelaxshort(0),
+    nrelaxlong(0),
+    currentbank(nobank),
+    bankwindow(0xC000),
+    bankmode(false),
+    currentunit(nounit),
+    procdepth(0),
+    prelabeladdr(0),
+    codeend(0),
+    codeendunit(nounit),
+    codefalls(false),
     pout(& cout),
     perr(in.perr),
     pverb(in.pverb),
     pwarn(in.pwarn),
     localcount(0),
-    pcurrentmframe(0)
-{
+    pcurrentmframe(0),
+    ckinterval(0),
+    ckvalid(false),
+    changedline(0),
+    tracemode(false),
+    traceincludes(0),
+    nlines(0),
+    ntokens(0),
+    nmacroexpansions(0),
+    nmacrolines(0),
+    nskippedlines(0),
+    nemitted(0),
+    listmode(false),
+    ncodebytes(0),
+    srcmapmode(false),
+    symbolformat(in.symbolformat)
+{
+    resumeline [0] = resumeline [1] = 0;
+    // Assembling again with the same base usually generates the
+    // same code, the pages are copied only where it is different.
+    mem.share(in.mem, 0);
 }
 
 Asm::In::~In()
 {
 }
 
+Asm::In::Bank::Bank() :
+    data(banksize, 0),
+    minused(0xFFFF),
+    maxused(0),
+    window(0)
+{ }
+
 const std::string & Asm::In::getheadername() const
 {
     return headername;
@@ -1524,6 +2097,11 @@ void Asm::In::errtostdout()
     perr = & cout;
 }
 
+void Asm::In::setwarnstream(std::ostream & out)
+{
+    pwarn = & out;
+}
+
 void Asm::In::setbase(address addr)
 {
     #if DEBUG_PRL
@@ -1570,6 +2148,48 @@ void Asm::In::setwerror()
     werror = true;
 }
 
+void Asm::In::relax()
+{
+    relaxmode = true;
+}
+
+void Asm::In::dropunused()
+{
+    dropunusedmode = true;
+}
+
+void Asm::In::compress()
+{
+    compressmode = true;
+}
+
+bool Asm::In::iscompress() const
+{
+    return compressmode;
+}
+
+void Asm::In::setmaxerrors(size_t n)
+{
+    maxerrors = n;
+}
+
+void Asm::In::setspeed(const std::string & speedn)
+{
+    if (! tzx::isspeed(speedn) )
+        throw runtime_error("Invalid speed profile: " + speedn);
+    speed = speedn;
+}
+
+const std::string & Asm::In::getspeed() const
+{
+    return speed;
+}
+
+void Asm::In::setsnapbase(const std::string & filename)
+{
+    snapbase = filename;
+}
+
 void Asm::In::addpredef(const std::string & predef)
 {
 
@@ -1625,7 +2245,7 @@ void Asm::In::checkendline(Tokenizer & tz)
 
 const byte * Asm::In::getmem() const
 {
-    return mem;
+    return mem.data();
 }
 
 byte Asm::In::peekbyte(address addr) const
@@ -1640,12 +2260,92 @@ address Asm::In::peekword(address addr) const
 
 void Asm::In::gendata(byte data)
 {
+    if (currentunit != nounit)
+        ++codeunits [currentunit].size;
+    codeend = current + 1;
+    codeendunit = currentunit;
+    codefalls = true;
+
+    if (currentbank != nobank)
+    {
+        genbankdata(data);
+        return;
+    }
+
     if (current < minused)
         minused = current;
     if (current > maxused)
         maxused = current;
-    mem [current] = data;
+
+    if (memblocks.empty() || memblocks.back().bank != nobank ||
+            current != static_cast <address> (memblocks.back().end + 1) )
+        memblocks.push_back(MemBlock(current, getline() ) );
+    MemBlock & block = memblocks.back();
+    block.end = current;
+    if (memwritten [current] )
+        ++block.overwritten;
+    memwritten.set(current);
+    memchanged.set(current);
+
+    if (srcmapmode)
+        srcmap.add(current, getline() );
+
+    mem.set(current, data);
+    ++current;
+    ++ncodebytes;
+}
+
+// The memory map and the source map are only for the main memory,
+// the addresses of the banks are in the same space. The blocks of
+// the banks are checked for overwrites and against the regions.
+
+void Asm::In::genbankdata(byte data)
+{
+    const address offset = current - bankwindow;
+    if (current < bankwindow || offset >= banksize)
+        throw AsmError(getline(), "Code out of the page of the bank");
+
+    Bank & bank = banks [currentbank];
+    if (bank.minused <= bank.maxused && bank.window != bankwindow)
+        throw AsmError(getline(), "Code of the bank in other page, "
+            "it was in " + hex4str(bank.window) + "H");
+    bank.window = bankwindow;
+    if (current < bank.minused)
+        bank.minused = current;
+    if (current > bank.maxused)
+        bank.maxused = current;
+
+    if (memblocks.empty() || memblocks.back().bank != currentbank ||
+            current != static_cast <address> (memblocks.back().end + 1) )
+        memblocks.push_back(MemBlock(current, getline(), currentbank) );
+    MemBlock & block = memblocks.back();
+    block.end = current;
+    if (bank.written [offset] )
+        ++block.overwritten;
+    bank.written.set(offset);
+
+    bank.data [offset] = data;
     ++current;
+    ++ncodebytes;
+}
+
+const byte * Asm::In::getcode(address addr, size_t len)
+{
+    const Bank * bank = 0;
+    if (currentbank != nobank)
+    {
+        const banks_t::const_iterator it = banks.find(currentbank);
+        if (it != banks.end() )
+            bank = & it->second;
+    }
+    codebytes.resize(len);
+    for (size_t i = 0; i < len; ++i)
+    {
+        const address pos = address(addr + i);
+        codebytes [i] = bank ?
+            bank->data [address(pos - bankwindow)] : mem [pos];
+    }
+    return codebytes.data();
 }
 
 void Asm::In::gendataword(address dataword)
@@ -1660,31 +2360,44 @@ void Asm::In::showcode(const std::string & instruction)
 
     address pos = currentinstruction;
     const address posend = current;
-    bool instshowed = false;
-    for (address i = 0; pos != posend; ++i, ++pos)
+
+    // Nothing to format when the debug output is not shown.
+    if (pout != & nullout)
     {
-        if ( (i % bytesperline) == 0)
+        const byte * const code =
+            getcode(pos, address(posend - pos) );
+        TextBuffer & text = codetext;
+        text.clear();
+        bool instshowed = false;
+        for (address i = 0; pos != posend; ++i, ++pos)
         {
-            if (i != 0)
+            if ( (i % bytesperline) == 0)
             {
-                if (! instshowed)
+                if (i != 0)
                 {
-                    * pout << '\t' << instruction;
-                    instshowed = true;
+                    if (! instshowed)
+                    {
+                        text.append('\t');
+                        text.append(instruction);
+                        instshowed = true;
+                    }
+                    text.append('\n');
                 }
-                * pout << '\n';
+                text.appendhex4(pos);
+                text.append(':');
             }
-            * pout << hex4(pos) << ':';
+            text.appendhex2(code [i] );
         }
-        * pout << hex2(mem [pos] );
-    }
-    if (! instshowed)
-    {
-        if (posend == currentinstruction + 1)
-            * pout << '\t';
-        * pout << '\t' << instruction;
+        if (! instshowed)
+        {
+            if (posend == currentinstruction + 1)
+                text.append('\t');
+            text.append('\t');
+            text.append(instruction);
+        }
+        text.append('\n');
+        text.write(* pout);
     }
-    * pout << '\n';
 
     // Check that the 64KB limit has not been exceeded in the
     // middle of an instruction.
@@ -1731,7 +2444,7 @@ void Asm::In::gencodeword(address value)
 }
 
 bool Asm::In::setvar(const std::string & varname,
-    address value, Defined defined)
+    address value, Defined defined, int bank)
 {
     TRVAR("Set '" << varname << "' to " << value << '\n');
     checkautolocal(varname);
@@ -1769,12 +2482,12 @@ bool Asm::In::setvar(const std::string & varname,
         default:
             /* Nothing */;
         }
-        data.set(value, defined);
+        data.set(value, defined, bank);
         data.setLine(getline());
 
         #else
 
-        data.set(value, defined);
+        data.set(value, defined, bank);
         data.setLine(getline());
 
         #endif
@@ -1782,7 +2495,7 @@ bool Asm::In::setvar(const std::string & varname,
     }
     else
     {
-        mapvar.setvar(varname, getline(), value, defined);
+        mapvar.setvar(varname, getline(), value, defined, bank);
         return false;
     }
 }
@@ -1792,6 +2505,7 @@ address Asm::In::getvalue(const std::string & varname,
 {
     TRVAR("getvalue " << varname << '\n');
     checkautolocal(varname);
+    addref(varname);
 
     return mapvar.getvalue(varname, getline(), required, ignored, pass);
 }
@@ -1801,10 +2515,31 @@ address Asm::In::getvalue(const std::string & varname)
     return getvalue(varname, true, false);
 }
 
+// Bank of a label defined after .BANK, after the first pass it is
+// an error if it is not in a bank.
+
+address Asm::In::getbank(const std::string & varname,
+    bool required, bool ignored)
+{
+    getvalue(varname, required, ignored);
+    const VarData * const pvar = mapvar.peek(varname);
+    if (pvar == 0 || pvar->def() == NoDefined)
+        return 0;
+    const int bank = pvar->getbank();
+    if (bank == nobank)
+    {
+        if (pass > 1 && ! ignored)
+            throw AsmError(getline(), "'" + varname + "' is not in a bank");
+        return 0;
+    }
+    return static_cast <address> (bank);
+}
+
 bool Asm::In::isdefined(const std::string & varname)
 {
     TRVAR("isdefined " << varname << "? ");
     checkautolocal(varname);
+    addref(varname);
     const bool result = mapvar.isdefined(varname, pass);
     TRVAR((result ? "YES" : "NO") << '\n');
     return result;
@@ -1860,6 +2595,11 @@ void Asm::In::parsevalue(Tokenizer & tz, address & result,
         checkidentifier(tok);
         result = isdefined(tok.str() ) ? addrTRUE : addrFALSE;
         break;
+    case Type_BANK:
+        tok = tz.gettoken();
+        checkidentifier(tok);
+        result = getbank(tok.str(), required, ignored);
+        break;
     default:
         throw ValueExpected(getline(), tok);
     }
@@ -2280,7 +3020,8 @@ void Asm::In::condition_false()
     int level = 1;
     while (nextline() )
     {
-        Tokenizer & tz(getcurrentline() );
+        ++nskippedlines;
+        Tokenizer tz(getcurrentline() );
 
         Token tok = tz.gettoken();
         TypeToken tt = tok.type();
@@ -2403,7 +3144,8 @@ void Asm::In::parseELSE(Tokenizer & tz)
     int level = 1;
     while (nextline() )
     {
-        Tokenizer & tz(getcurrentline() );
+        ++nskippedlines;
+        Tokenizer tz(getcurrentline() );
 
         Token tok = tz.gettoken();
         TypeToken tt = tok.type();
@@ -2463,6 +3205,76 @@ void Asm::In::parseENDIF(Tokenizer & tz)
 
 void Asm::In::parseline(Tokenizer & tz)
 {
+    if (listmode && pass > 1)
+        parselinelisted(tz);
+    else
+        parselinecode(tz);
+}
+
+void Asm::In::parselinelisted(Tokenizer & tz)
+{
+    // The end of include mark is not a line of the source.
+    const bool endinclude = tz.gettoken().type() == TypeEndOfInclude;
+    tz.ungettoken();
+    if (endinclude)
+    {
+        parselinecode(tz);
+        return;
+    }
+
+    for (size_t i = 0; i < liststack.size(); ++i)
+    {
+        ListEntry & outer = liststack [i];
+        if (! outer.listed)
+        {
+            listentry(outer, 0);
+            outer.listed = true;
+        }
+    }
+    liststack.push_back(ListEntry() );
+    {
+        ListEntry & entry = liststack.back();
+        entry.line = getline();
+        entry.addr = current;
+        entry.ncodebytes = ncodebytes;
+        entry.listed = false;
+        entry.text = getcurrenttext();
+    }
+    try
+    {
+        parselinecode(tz);
+    }
+    catch (...)
+    {
+        liststack.pop_back();
+        throw;
+    }
+    const ListEntry & entry = liststack.back();
+    if (! entry.listed)
+        listentry(entry, ncodebytes - entry.ncodebytes);
+    liststack.pop_back();
+}
+
+void Asm::In::listentry(const ListEntry & entry, size_t len)
+{
+    size_t numline = 0;
+    getlineinfo(entry.line, listfilename, numline);
+    const byte * const code = getcode(entry.addr, len);
+    listbuffer.addline(listfilename, numline, code, entry.addr, entry.addr,
+        len, entry.text);
+}
+
+void Asm::In::parselinecode(Tokenizer & tz)
+{
+    ++nlines;
+    if (pcurrentmframe != 0)
+    {
+        // Lines from the source are counted when loaded,
+        // these are generated by the macro expansion.
+        ++nmacrolines;
+        ntokens += tz.size();
+    }
+
     Token tok = tz.gettoken();
 
     currentinstruction = current;
@@ -2498,6 +3310,9 @@ void Asm::In::parseline(Tokenizer & tz)
     case TypePUBLIC:
         parsePUBLIC(tz);
         break;
+    case TypeEXTRN:
+        parseEXTRN(tz);
+        break;
     case TypeMACRO:
         // Style: MACRO identifier, params
         tok = tz.gettoken();
@@ -2577,9 +3392,12 @@ void Asm::In::checkautolocal(const std::string & varname)
     }
 }
 
-void Asm::In::dopass()
+void Asm::In::dopass(size_t resume)
 {
     * pverb << "Entering pass " << pass << '\n';
+    beginphase("pass " + std::to_string(pass), std::string() );
+    traceincludes = 0;
+    mapvar.recordlookups(0);
 
     // Pass initializition.
 
@@ -2589,16 +3407,101 @@ void Asm::In::dopass()
     mapvar.clearDefl();
 
     current = base;
+    entrypointdefined = false;
     iflevel = 0;
     ifstack.resize(0);
 
+    relaxindex = 0;
+    nrelaxshort = 0;
+    nrelaxlong = 0;
+
+    memwritten.reset();
+    for (banks_t::iterator it = banks.begin(); it != banks.end(); ++it)
+        it->second.written.reset();
+    currentbank = nobank;
+    bankwindow = 0xC000;
+
+    codeunits.clear();
+    currentunit = nounit;
+    codeend = 0;
+    codeendunit = nounit;
+    codefalls = false;
+    procdepth = 0;
+    rootrefs.clear();
+    prelabels.clear();
+
+    listbuffer.clear();
+    liststack.clear();
+    srcmap.clear();
+
+    const bool incremental = isincremental() && pass <= 2;
+    if (incremental)
+    {
+        if (pass == 2)
+        {
+            if (resume != nocheckpoint && ! samesymbols(resume) )
+                resume = nocheckpoint;
+            pass2vars = mapvar;
+        }
+        if (resume != nocheckpoint)
+            restorecheckpoint(resume);
+        else
+        {
+            checkpoints [pass - 1].clear();
+            lookedup.clear();
+        }
+        if (pass == 1)
+        {
+            const size_t from = resume == nocheckpoint ?
+                0 : checkpoints [0] [resume].line;
+            for (incbins_t::iterator it = incbins.begin();
+                it != incbins.end(); )
+            {
+                if (it->second.first >= from)
+                    incbins.erase(it++);
+                else
+                    ++it;
+            }
+        }
+        ckvars = mapvar;
+        memchanged.reset();
+        resumeline [pass - 1] = resume == nocheckpoint ?
+            0 : checkpoints [pass - 1] [resume].line;
+        mapvar.setstamp(checkpoints [pass - 1].size() );
+        if (pass == 2)
+            mapvar.recordlookups(& lookedup);
+    }
+    if (resume == nocheckpoint)
+    {
+        memblocks.clear();
+        memregions.clear();
+        maplabels.clear();
+    }
+
     // Main loop.
 
-    for (beginline(); nextline(); )
+    bool more;
+    if (resume == nocheckpoint)
     {
-        Tokenizer & tz(getcurrentline() );
-        parseline(tz);
+        beginline();
+        more = nextline();
+    }
+    else
+    {
+        setline(resumeline [pass - 1] );
+        more = getvalidline();
+    }
+    for ( ; more; more = nextline() )
+    {
+        Tokenizer tz(getcurrentline() );
+        if (incremental)
+            checkpoint(tz);
+        if (maxerrors == 1)
+            parseline(tz);
+        else
+            parselinecollect(tz);
     }
+    mapvar.recordlookups(0);
 
     // Pass finalization.
 
@@ -2617,6 +3520,7 @@ void Asm::In::dopass()
     }
 
     * pverb << "Pass " << pass << " finished\n";
+    endphase();
 }
 
 void Asm::In::setpass(int npass)
@@ -2626,56 +3530,653 @@ void Asm::In::setpass(int npass)
 
 void Asm::In::loadfile(const std::string & filename)
 {
+    beginphase("load", filename);
     AsmFile::loadfile(size_t(-1), filename, nocase, * pverb, * perr);
+    endphase();
 }
 
-void Asm::In::processfile()
+void Asm::In::doallpasses()
 {
-    try
+    // After a reload resume each pass from the last checkpoint
+    // before the first line changed, or else start again from
+    // a clean state if this is not the first assembly.
+    size_t resume = nocheckpoint;
+    if (ckvalid)
     {
         setpass(1);
-        if (debugtype == DebugAll)
-            pout = & cout;
-        else
-            pout = & nullout;
-        dopass();
+        resume = findcheckpoint();
+    }
+    else if (isincremental() )
+    {
+        clearstate();
+        setpublic.clear();
+        setextern.clear();
+    }
+    ckvalid = false;
 
-        setpass(2);
-        if (debugtype != NoDebug)
-            pout = & cout;
-        else
-            pout = & nullout;
-        dopass();
+    setpass(1);
+    if (debugtype == DebugAll)
+        pout = & cout;
+    else
+        pout = & nullout;
+    dopass(resume);
+
+    setpass(2);
+    if (debugtype != NoDebug)
+        pout = & cout;
+    else
+        pout = & nullout;
+    if (relaxmode)
+        dorelaxpasses();
+    else
+    {
+        if (resume != nocheckpoint)
+            resume = findcheckpoint();
+        dopass(resume);
 
         // Testing third pass
         if (lastpass > 2)
         {
             setpass(3);
-            dopass();
+            dopass(nocheckpoint);
         }
-        check();
+    }
+    ckvalid = isincremental();
+}
 
-        // Keep pout pointing to something valid.
-        pout = & cout;
+void Asm::In::parselinecollect(Tokenizer & tz)
+{
+    const size_t linepos = getline();
+    const address start = current;
+    try
+    {
+        parseline(tz);
+        if (pass == 1)
+            linesizes [linepos] = current - start;
+        return;
+    }
+    catch (UndefinedVar & err)
+    {
+        if (failedlabels.find(err.getname() ) == failedlabels.end() )
+            recorderror(err);
     }
     catch (AsmError & err)
     {
-        showerrorinfo(* perr, err.getline(), err.message());
-        throw ErrorAlreadyReported();
+        recorderror(err);
     }
-    catch (...)
+
+    const address generated = current - start;
+    if (pass == 1)
+        linesizes [linepos] = generated;
+    else
     {
-        /*
-        * perr << "ERROR";
-        showcurrentlineinfo(* perr);
-        * perr << '\n';
-        */
-        showerrorinfo(* perr, getline(), "Caught unexpected exception");
-        throw;
+        const linesizes_t::const_iterator it = linesizes.find(linepos);
+        if (it != linesizes.end() && it->second > generated)
+            current += it->second - generated;
+    }
+
+    // Continue after the line, a failed IF is taken as true
+    // to avoid errors in his ELSE and ENDIF.
+    setline(linepos);
+    Tokenizer tzline(getcurrentline() );
+    Token tok = tzline.gettoken();
+    if (tok.type() == TypeIdentifier)
+    {
+        // Only the lines that define a label, not the
+        // definitions and expansions of macros.
+        const std::string name = tok.str();
+        tok = tzline.gettoken();
+        if (tok.type() == TypeColon ||
+                (tok.type() != TypeMACRO && getmacro(name) == 0) )
+            failedlabels.insert(name);
+    }
+    switch (tok.type() )
+    {
+    case TypeIF:
+    case TypeIFDEF:
+    case TypeIFNDEF:
+        ++iflevel;
+        ifstack.push_back(linepos);
+        break;
+    default:
+        break;
     }
 }
 
-int Asm::In::currentpass() const
+void Asm::In::recorderror(const AsmError & err)
+{
+    // The errors of pass 1 are usually found again in pass 2.
+    if (! errorlines.insert(err.getline() ).second)
+        return;
+    LineError lineerror;
+    lineerror.line = err.getline();
+    lineerror.message = err.message();
+    lineerrors.push_back(lineerror);
+    if (lineerrors.size() == maxerrors)
+        throw ErrorsCollected();
+}
+
+void Asm::In::reporterrors()
+{
+    // Sort by file and line, the included files are placed in
+    // the line numbers of the assembler after his includer.
+    typedef std::pair <std::pair <std::string, size_t>, size_t> errorpos_t;
+    std::vector <errorpos_t> sorted;
+    for (size_t i = 0; i < lineerrors.size(); ++i)
+    {
+        std::string filename;
+        size_t numline = 0;
+        getlineinfo(lineerrors [i].line, filename, numline);
+        sorted.push_back(errorpos_t(std::make_pair(filename, numline), i) );
+    }
+    std::sort(sorted.begin(), sorted.end() );
+    for (size_t i = 0; i < sorted.size(); ++i)
+    {
+        const LineError & lineerror = lineerrors [sorted [i].second];
+        showerrorinfo(* perr, lineerror.line, lineerror.message);
+    }
+    if (maxerrors != 0 && lineerrors.size() >= maxerrors)
+        * perr << "Too many errors, assembly stopped\n";
+    * perr << lineerrors.size() <<
+        (lineerrors.size() == 1 ? " error\n" : " errors\n");
+}
+
+void Asm::In::processfile()
+{
+    lineerrors.clear();
+    errorlines.clear();
+    failedlabels.clear();
+    linesizes.clear();
+    try
+    {
+        unitdropped.clear();
+        doallpasses();
+        if (! lineerrors.empty() )
+            throw ErrorsCollected();
+        if (dropunusedmode && removeunused() )
+            doallpasses();
+        check();
+        changedline = 0;
+
+        // Keep pout pointing to something valid.
+        pout = & cout;
+    }
+    catch (ErrorsCollected &)
+    {
+        reporterrors();
+        throw ErrorAlreadyReported();
+    }
+    catch (AsmError & err)
+    {
+        if (! lineerrors.empty() )
+        {
+            // Errors of the pass finalization.
+            try
+            {
+                recorderror(err);
+            }
+            catch (ErrorsCollected &)
+            {
+            }
+            reporterrors();
+        }
+        else
+            showerrorinfo(* perr, err.getline(), err.message());
+        throw ErrorAlreadyReported();
+    }
+    catch (...)
+    {
+        // Other errors are likely caused by the previous ones.
+        if (! lineerrors.empty() )
+        {
+            reporterrors();
+            throw ErrorAlreadyReported();
+        }
+        /*
+        * perr << "ERROR";
+        showcurrentlineinfo(* perr);
+        * perr << '\n';
+        */
+        showerrorinfo(* perr, getline(), "Caught unexpected exception");
+        throw;
+    }
+}
+
+bool Asm::In::assemble(const std::string & filename)
+{
+    try
+    {
+        loadfile(filename);
+        processfile();
+        return true;
+    }
+    catch (ErrorAlreadyReported &)
+    {
+    }
+    catch (AsmError & err)
+    {
+        showerrorinfo(* perr, err.getline(), err.message() );
+    }
+    catch (std::exception & e)
+    {
+        showerror(* perr, e.what() );
+    }
+    return false;
+}
+
+//--------------------------------------------------------------
+//        Incremental assembly.
+//--------------------------------------------------------------
+
+Asm::In::Checkpoint::Checkpoint() :
+    line(0),
+    current(0),
+    entrypoint(0),
+    entrypointdefined(false),
+    localcount(0),
+    nmemblocks(0),
+    lastmemblock(0, 0),
+    nmemregions(0),
+    nmaplabels(0)
+{ }
+
+void Asm::In::incremental(size_t interval)
+{
+    ckinterval = interval;
+    ckvalid = false;
+}
+
+bool Asm::In::isincremental() const
+{
+    // Branch relaxation, unused code elimination, the listing and
+    // the source map need the results of full passes, and the
+    // checkpoints do not keep the code of the banks.
+    return ckinterval != 0 && ! relaxmode && ! dropunusedmode &&
+        ! listmode && ! srcmapmode && ! bankmode && lastpass == 2;
+}
+
+void Asm::In::reloadfile(const std::string & filename)
+{
+    // Load the files again and find the first line that is
+    // not the same as in the previous load.
+    const AsmFile previous(* this);
+    clearfiles();
+    loadfile(filename);
+    changedline = firstchange(previous);
+
+    // The binary files included are not part of the lines.
+    for (incbins_t::const_iterator it = incbins.begin();
+        it != incbins.end(); ++it)
+    {
+        const size_t line = it->second.first;
+        if (line >= changedline)
+            continue;
+        std::string content;
+        if (! readpath(it->first, content, std::ios::in | std::ios::binary) ||
+                content != it->second.second)
+            changedline = line;
+    }
+    * pverb << "First line changed: " << changedline << '\n';
+}
+
+size_t Asm::In::getresumeline(int npass) const
+{
+    if (npass < 1 || npass > 2)
+        return 0;
+    return resumeline [npass - 1];
+}
+
+void Asm::In::checkpoint(const Tokenizer & tz)
+{
+    if (iflevel != 0 || ! localstack.empty() )
+        return;
+
+    checkpoints_t & cks = checkpoints [pass - 1];
+    const size_t line = getline();
+    if (! cks.empty() )
+    {
+        if (line == cks.back().line)
+            return;
+        const TypeToken tt = tz.begin() == tz.end() ?
+            TypeEndLine : tz.begin()->type();
+        if (line < cks.back().line + ckinterval &&
+                tt != TypeINCLUDE && tt != TypeEndOfInclude)
+            return;
+    }
+
+    cks.push_back(Checkpoint() );
+    Checkpoint & ck = cks.back();
+    ck.line = line;
+    ck.current = current;
+    ck.entrypoint = entrypoint;
+    ck.entrypointdefined = entrypointdefined;
+    ck.localcount = localcount;
+    ck.macros = mapmacro;
+    ck.nmemblocks = memblocks.size();
+    if (! memblocks.empty() )
+        ck.lastmemblock = memblocks.back();
+    ck.nmemregions = memregions.size();
+    ck.nmaplabels = maplabels.size();
+    ck.publics = setpublic;
+    ck.externs = setextern;
+
+    for (size_t i = 0; i < memchanged.size(); ++i)
+        if (memchanged [i] )
+            ck.memchanged.push_back(std::make_pair(address(i), mem [i] ) );
+    memchanged.reset();
+
+    // Both tables are ordered by name, compare them side by side
+    // and update the copy with the differences.
+    mapvar_t::const_iterator it = mapvar.begin();
+    mapvar_t::const_iterator itck = ckvars.begin();
+    while (it != mapvar.end() || itck != ckvars.end() )
+    {
+        if (itck == ckvars.end() ||
+            (it != mapvar.end() && it->first < itck->first) )
+        {
+            ck.varchanged.push_back(* it);
+            ++it;
+        }
+        else if (it == mapvar.end() || itck->first < it->first)
+        {
+            ck.varerased.push_back(itck->first);
+            ++itck;
+        }
+        else
+        {
+            if (! (it->second == itck->second) )
+                ck.varchanged.push_back(* it);
+            ++it;
+            ++itck;
+        }
+    }
+    for (size_t i = 0; i < ck.varchanged.size(); ++i)
+        ckvars [ck.varchanged [i].first] = ck.varchanged [i].second;
+    for (size_t i = 0; i < ck.varerased.size(); ++i)
+        ckvars.erase(ck.varerased [i] );
+
+    mapvar.setstamp(cks.size() );
+}
+
+size_t Asm::In::findcheckpoint() const
+{
+    // Last checkpoint not after the first line changed.
+    const checkpoints_t & cks = checkpoints [pass - 1];
+    size_t resume = nocheckpoint;
+    for (size_t i = 0; i < cks.size() && cks [i].line <= changedline; ++i)
+        resume = i;
+    return resume;
+}
+
+bool Asm::In::samesymbols(size_t resume) const
+{
+    // The lines before the checkpoint assemble the same way in
+    // pass 2 if all the symbols they looked up have the same
+    // state than in the previous assembly.
+    for (mapvar_t::lookedup_t::const_iterator it = lookedup.begin();
+        it != lookedup.end(); ++it)
+    {
+        if (it->second > resume)
+            continue;
+        const VarData * const prev = pass2vars.peek(it->first);
+        const VarData * const now = mapvar.peek(it->first);
+        if (prev == 0 || now == 0)
+        {
+            if (prev != now)
+                return false;
+            continue;
+        }
+        VarData vprev(* prev);
+        VarData vnow(* now);
+        if (vprev.def() != vnow.def() || vprev.islocal() != vnow.islocal() ||
+                vprev.getvalue() != vnow.getvalue() )
+            return false;
+    }
+    return true;
+}
+
+void Asm::In::restorecheckpoint(size_t resume)
+{
+    // The symbols and memory are restored starting from the clean
+    // state in pass 1 and from the result of pass 1 in pass 2.
+    checkpoints_t & cks = checkpoints [pass - 1];
+    * pverb << "Resuming pass " << pass << " from line " <<
+        cks [resume].line << '\n';
+
+    if (pass == 1)
+        clearstate();
+    for (size_t n = 0; n <= resume; ++n)
+    {
+        const Checkpoint & ck = cks [n];
+        for (size_t i = 0; i < ck.memchanged.size(); ++i)
+        {
+            const address addr = ck.memchanged [i].first;
+            mem.set(addr, ck.memchanged [i].second);
+            memwritten.set(addr);
+            if (addr < minused)
+                minused = addr;
+            if (addr > maxused)
+                maxused = addr;
+        }
+        for (size_t i = 0; i < ck.varchanged.size(); ++i)
+            mapvar [ck.varchanged [i].first] = ck.varchanged [i].second;
+        for (size_t i = 0; i < ck.varerased.size(); ++i)
+            mapvar.erase(ck.varerased [i] );
+    }
+
+    const Checkpoint & ck = cks [resume];
+    current = ck.current;
+    entrypoint = ck.entrypoint;
+    entrypointdefined = ck.entrypointdefined;
+    localcount = ck.localcount;
+    mapmacro = ck.macros;
+    if (pass == 1)
+    {
+        setpublic = ck.publics;
+        setextern = ck.externs;
+    }
+
+    // The prefix of these vectors is the same in both passes,
+    // and in pass 2 they have the content of pass 1.
+    memblocks.erase(memblocks.begin() + ck.nmemblocks, memblocks.end() );
+    if (! memblocks.empty() )
+        memblocks.back() = ck.lastmemblock;
+    memregions.erase(memregions.begin() + ck.nmemregions, memregions.end() );
+    maplabels.erase(maplabels.begin() + ck.nmaplabels, maplabels.end() );
+
+    for (mapvar_t::lookedup_t::iterator it = lookedup.begin();
+        it != lookedup.end(); )
+    {
+        if (it->second > resume)
+            lookedup.erase(it++);
+        else
+            ++it;
+    }
+    cks.resize(resume + 1);
+}
+
+void Asm::In::dorelaxpasses()
+{
+    // Repeat passes until no more branches need to be widened.
+    // Branches never shrink, so this always finishes. Phase
+    // errors are expected meanwhile and are not checked until
+    // the last pass, that uses the final layout.
+
+    std::ostream * const poutlast = pout;
+    pout = & nullout;
+    lastpass = 0;
+    do
+    {
+        relaxchanged = false;
+        dopass(nocheckpoint);
+        setpass(3);
+    } while (relaxchanged);
+
+    lastpass = 3;
+    pout = poutlast;
+    dopass(nocheckpoint);
+
+    * pverb << "Relaxed branches: " << nrelaxshort << " short, " <<
+        nrelaxlong << " long\n";
+}
+
+void Asm::In::addref(const std::string & varname)
+{
+    // Record references to non local symbols, used to determine
+    // which PROC are reachable.
+
+    if (! dropunusedmode)
+        return;
+    mapvar_t::iterator it = mapvar.find(varname);
+    if (it != mapvar.end() && it->second.islocal() )
+        return;
+    if (currentunit == nounit)
+        rootrefs.insert(varname);
+    else
+        codeunits [currentunit].refs.insert(varname);
+}
+
+void Asm::In::adddef(const std::string & varname, bool islocal)
+{
+    if (dropunusedmode && currentunit != nounit && ! islocal)
+        codeunits [currentunit].defs.push_back(varname);
+}
+
+void Asm::In::skipPROC()
+{
+    // Skip the body of an unused PROC until its ENDP.
+
+    const size_t procline = getline();
+    size_t level = 1;
+    while (nextline() )
+    {
+        Tokenizer tz(getcurrentline() );
+
+        Token tok = tz.gettoken();
+        TypeToken tt = tok.type();
+        if (tt == TypeIdentifier)
+        {
+            tok = tz.gettoken();
+            tt = tok.type();
+        }
+        if (tt == TypePROC)
+            ++level;
+        else if (tt == TypeENDP)
+        {
+            if (--level == 0)
+                break;
+        }
+        else if (ismacrodirective(tt) )
+            gotoENDM();
+    }
+    if (passeof() )
+        throw UnbalancedPROC(procline);
+    * pout << "\t\tPROC removed\n";
+}
+
+bool Asm::In::removeunused()
+{
+    // Mark as dropped the PROCs not reachable from the entry
+    // point, the PUBLIC symbols or the code outside PROCs, directly
+    // or continuing the execution from the code before them, and
+    // prepare the state to assemble again without them.
+
+    std::map <std::string, size_t> defunit;
+    for (size_t i = 0; i < codeunits.size(); ++i)
+    {
+        const CodeUnit & unit = codeunits [i];
+        for (size_t j = 0; j < unit.defs.size(); ++j)
+            defunit [unit.defs [j] ] = i;
+    }
+
+    std::vector <bool> reached(codeunits.size(), false);
+    std::vector <size_t> pending;
+    std::set <std::string> roots(rootrefs);
+    roots.insert(setpublic.begin(), setpublic.end() );
+    for (std::set <std::string>::const_iterator it = roots.begin();
+        it != roots.end();
+        ++it)
+    {
+        std::map <std::string, size_t>::const_iterator
+            dit = defunit.find(* it);
+        if (dit != defunit.end() )
+            pending.push_back(dit->second);
+    }
+    for (size_t i = 0; i < codeunits.size(); ++i)
+    {
+        const CodeUnit & unit = codeunits [i];
+        if (unit.keep || (hasentrypoint() &&
+                entrypoint >= unit.start && entrypoint < unit.end) )
+            pending.push_back(i);
+    }
+
+    while (! pending.empty() )
+    {
+        const size_t n = pending.back();
+        pending.pop_back();
+        if (reached [n] )
+            continue;
+        reached [n] = true;
+        const CodeUnit & unit = codeunits [n];
+        for (std::set <std::string>::const_iterator it = unit.refs.begin();
+            it != unit.refs.end();
+            ++it)
+        {
+            std::map <std::string, size_t>::const_iterator
+                dit = defunit.find(* it);
+            if (dit != defunit.end() && ! reached [dit->second] )
+                pending.push_back(dit->second);
+        }
+        if (unit.fallsinto != nounit)
+            pending.push_back(unit.fallsinto);
+    }
+
+    size_t ndropped = 0;
+    size_t saved = 0;
+    unitdropped.assign(codeunits.size(), false);
+    for (size_t i = 0; i < codeunits.size(); ++i)
+    {
+        if (reached [i] )
+            continue;
+        const CodeUnit & unit = codeunits [i];
+        unitdropped [i] = true;
+        ++ndropped;
+        saved += unit.size;
+        * pverb << "Removing unused PROC";
+        std::string filename;
+        size_t numline;
+        if (getlineinfo(unit.line, filename, numline) )
+            * pverb << " on line " << numline << " of file " << filename;
+        * pverb << ", " << unit.size << " bytes\n";
+    }
+    * pverb << "Unused code elimination: " << ndropped <<
+        " PROC removed, " << saved << " bytes saved\n";
+    if (ndropped == 0)
+        return false;
+
+    clearstate();
+    return true;
+}
+
+void Asm::In::clearstate()
+{
+    // Start again from a clean state, keeping only the
+    // predefined symbols.
+    for (mapvar_t::iterator it = mapvar.begin(); it != mapvar.end(); )
+    {
+        if (it->second.def() == PreDefined)
+            ++it;
+        else
+            mapvar.erase(it++);
+    }
+    mem.clear();
+    minused = 65535;
+    maxused = 0;
+    banks.clear();
+    relaxlong.clear();
+}
+
+int Asm::In::currentpass() const
 {
     return pass;
 }
@@ -2700,6 +4201,57 @@ void Asm::In::check()
             }
         }
     }
+    checkmemmap();
+}
+
+void Asm::In::checkmemmap()
+{
+    for (memblocks_t::const_iterator it = memblocks.begin();
+        it != memblocks.end();
+        ++it)
+    {
+        if (it->overwritten > 0)
+        {
+            ostringstream oss;
+            oss << "Code at " << hex4(it->start);
+            if (it->bank != nobank)
+                oss << " of bank " << it->bank;
+            oss << " overwrites " <<
+                it->overwritten << " previously generated bytes";
+            emitwarning(oss.str(), it->line);
+        }
+    }
+
+    // A block that overlaps a region must be inside it: a block
+    // that begins inside goes beyond its end overflows it, and
+    // one that begins before runs into it.
+    for (memregions_t::const_iterator rit = memregions.begin();
+        rit != memregions.end();
+        ++rit)
+    {
+        for (memblocks_t::const_iterator it = memblocks.begin();
+            it != memblocks.end();
+            ++it)
+        {
+            const address end = it->end < it->start ? 0xFFFF : it->end;
+            if (end < rit->start || it->start > rit->end)
+                continue;
+            if (it->start < rit->start)
+            {
+                ostringstream oss;
+                oss << "Code at " << hex4(it->start) <<
+                    " runs into region " << rit->name;
+                throw AsmError(it->line, oss.str() );
+            }
+            if (end > rit->end)
+            {
+                ostringstream oss;
+                oss << "Region " << rit->name << " overflowed by " <<
+                    end - rit->end << " bytes";
+                throw AsmError(rit->line, oss.str() );
+            }
+        }
+    }
 }
 
 bool Asm::In::parsesimple(Tokenizer & tz, Token tok)
@@ -2795,6 +4347,15 @@ void Asm::In::parsegeneric(Tokenizer & tz, Token tok)
     case Type_WARNING:
         parse_WARNING(tz);
         break;
+    case Type_REGION:
+        parse_REGION(tz);
+        break;
+    case Type_BANK:
+        parse_BANK(tz);
+        break;
+    case Type_PAGE:
+        parse_PAGE(tz);
+        break;
     case Type_8080:
         parse_8080(tz);
         break;
@@ -2933,11 +4494,23 @@ void Asm::In::parseINCLUDE(Tokenizer & tz)
 {
     std::string filename = tz.gettoken().str();
     * pout << "\t\tINCLUDE " << filename << '\n';
+    if (tracemode)
+    {
+        beginspan("include " + filename, getline() );
+        ++traceincludes;
+    }
 }
 
 void Asm::In::parseEndOfInclude(Tokenizer & /*tz*/)
 {
     * pout << "\t\tEnd of INCLUDE\n";
+    // The INCLUDE may have been skipped by a false IF
+    // ended inside the included file.
+    if (traceincludes > 0)
+    {
+        endphase();
+        --traceincludes;
+    }
 }
 
 void Asm::In::parseORG(Tokenizer & tz, const std::string & label)
@@ -2976,6 +4549,39 @@ void Asm::In::parseDEFL(Tokenizer & tz, const std::string & label)
     * pout << hex4(value) << '\n';
 }
 
+void Asm::In::parseEXTRN(Tokenizer & tz)
+{
+    std::vector <std::string> varname;
+    for (;;)
+    {
+        Token tok = tz.gettoken();
+        checkidentifier(tok);
+
+        std::string name = tok.str();
+        if (isautolocalname(name) )
+            throw InvalidInAutolocal(getline());
+
+        // The value is given by the linker, here it is the
+        // one used to generate the relocatable object.
+        externvalues_t::const_iterator it = externvalues.find(name);
+        setequorlabel(name, it == externvalues.end() ? 0 : it->second);
+        setextern.insert(name);
+        varname.push_back(name);
+        tok = tz.gettoken();
+        if (tok.type() == TypeEndLine)
+            break;
+        checktoken(TypeComma, tok, getline());
+    }
+    * pout << "\t\tEXTRN ";
+    for (size_t i = 0, l = varname.size(); i < l; ++i)
+    {
+        * pout << varname [i];
+        if (i < l - 1)
+            * pout << ", ";
+    }
+    * pout << '\n';
+}
+
 void Asm::In::parsePUBLIC(Tokenizer & tz)
 {
     std::vector <std::string> varname;
@@ -3060,6 +4666,37 @@ void Asm::In::parsePROC(Tokenizer & tz)
         finishautolocal();
 
     checkendline(tz);
+
+    if (dropunusedmode && procdepth == 0)
+    {
+        // Start of a unit for unused code elimination. The
+        // labels in the PROC line or in the lines before it
+        // without code between, if any, belong to it. PROCs
+        // generated by macros are always kept.
+        const size_t n = codeunits.size();
+        if (n < unitdropped.size() && unitdropped [n] )
+        {
+            codeunits.push_back(CodeUnit(getline(), current, false) );
+            prelabels.clear();
+            skipPROC();
+            return;
+        }
+        // A PROC entered from the code before it is reachable if
+        // that code is: always if it is outside the PROCs.
+        const bool falls = codefalls && codeend == current;
+        codeunits.push_back(CodeUnit(getline(), current,
+            pcurrentmframe != nullptr ||
+            (falls && codeendunit == nounit) ) );
+        if (falls && codeendunit != nounit)
+            codeunits [codeendunit].fallsinto = n;
+        currentunit = n;
+        if (prelabeladdr == current)
+            codeunits [n].defs.insert(codeunits [n].defs.end(),
+                prelabels.begin(), prelabels.end() );
+        prelabels.clear();
+    }
+    ++procdepth;
+
     ProcLevel * const pproc = new ProcLevel(* this);
     localstack.push(pproc);
 
@@ -3084,6 +4721,12 @@ void Asm::In::parseENDP(Tokenizer & tz)
         throw UnbalancedENDP(getline());
     localstack.pop();
 
+    if (procdepth > 0 && --procdepth == 0 && currentunit != nounit)
+    {
+        codeunits [currentunit].end = current;
+        currentunit = nounit;
+    }
+
     * pout << "\t\tENDP\n";
 }
 
@@ -3099,6 +4742,61 @@ void Asm::In::parse_WARNING(Tokenizer & tz)
     emitwarning(tok.str() );
 }
 
+void Asm::In::parse_REGION(Tokenizer & tz)
+{
+    Token tok = tz.gettoken();
+    checkidentifier(tok);
+    const std::string name = tok.str();
+    expectcomma(tz);
+    tok = tz.gettoken();
+    const address start = parseexpr(true, tok, tz);
+    expectcomma(tz);
+    tok = tz.gettoken();
+    const address end = parseexpr(true, tok, tz);
+    checkendline(tz);
+    if (end < start)
+        throw AsmError(getline(), "Invalid region, end before start");
+
+    memregions.push_back(MemRegion(name, start, end, getline() ) );
+
+    * pout << "\t\t.REGION " << name << ' ' <<
+        hex4(start) << '-' << hex4(end) << '\n';
+}
+
+void Asm::In::parse_BANK(Tokenizer & tz)
+{
+    Token tok = tz.gettoken();
+    if (tok.type() == TypeEndLine)
+    {
+        currentbank = nobank;
+        * pout << "\t\t.BANK\n";
+        return;
+    }
+    const address n = parseexpr(true, tok, tz);
+    checkendline(tz);
+    if (n > 255)
+        throw AsmError(getline(), "Invalid bank number");
+
+    currentbank = n;
+    bankmode = true;
+
+    * pout << "\t\t.BANK " << n << '\n';
+}
+
+void Asm::In::parse_PAGE(Tokenizer & tz)
+{
+    Token tok = tz.gettoken();
+    const address addr = parseexpr(true, tok, tz);
+    checkendline(tz);
+    if ( (addr % banksize) != 0)
+        throw AsmError(getline(), "Invalid page address, "
+            "must be a multiple of 4000H");
+
+    bankwindow = addr;
+
+    * pout << "\t\t.PAGE " << hex4(addr) << '\n';
+}
+
 void Asm::In::parse_Z80(Tokenizer & tz)
 {
     checkendline(tz);
@@ -3109,7 +4807,8 @@ void Asm::In::parse_8080(Tokenizer & /*tz*/)
     throw AsmError(getline(), "8080 mode not supported");
 }
 
-bool Asm::In::setequorlabel(const std::string & name, address value)
+bool Asm::In::setequorlabel(const std::string & name, address value,
+    int bank)
 {
     TRVAR("Set '" << name << "' to " << value << '\n');
 
@@ -3169,7 +4868,9 @@ bool Asm::In::setequorlabel(const std::string & name, address value)
     default:
         throw InvalidPassValue;
     }
-    return setvar(name, value, def);
+    const bool islocal = setvar(name, value, def, bank);
+    adddef(name, islocal);
+    return islocal;
 }
 
 bool Asm::In::setdefl(const std::string & name, address value)
@@ -3199,12 +4900,23 @@ bool Asm::In::setdefl(const std::string & name, address value)
     case DefinedPass2:
             throw RedefinedEQU(getline(), * this, mapvar[name]);
     }
-    return setvar(name, value, DefinedDEFL);
+    const bool islocal = setvar(name, value, DefinedDEFL);
+    adddef(name, islocal);
+    return islocal;
 }
 
 void Asm::In::setlabel(const std::string & name)
 {
-    bool islocal = setequorlabel(name, current);
+    bool islocal = setequorlabel(name, current, currentbank);
+    if (currentbank == nobank)
+        maplabels.push_back(make_pair(current, name) );
+    if (dropunusedmode && procdepth == 0 && ! islocal)
+    {
+        if (prelabeladdr != current)
+            prelabels.clear();
+        prelabels.push_back(name);
+        prelabeladdr = current;
+    }
     * pout << hex4(current) << ":\t\t";
     if (islocal)
         * pout << "local ";
@@ -3323,7 +5035,7 @@ void Asm::In::parseMACRO(Tokenizer & tz, const std::string & name,
 
     while (nextline() )
     {
-        Tokenizer & tz(getcurrentline() );
+        Tokenizer tz(getcurrentline() );
 
         Token tok = tz.gettoken();
         TypeToken tt = tok.type();
@@ -3395,12 +5107,15 @@ byte Asm::In::parsedesp(Tokenizer & tz, bool bracket)
 
 void Asm::In::emitwarning(const std::string & text)
 {
-    showwarning(* pwarn, getline(), text);
+    emitwarning(text, getline() );
 }
 
 void Asm::In::emitwarning(const std::string & text, size_t linepos)
 {
-    showwarning(* pwarn, linepos, text);
+    // The assemblies used to generate relocatable files
+    // discard the warnings.
+    if (pwarn != & nullout)
+        showwarning(* pwarn, linepos, text);
     if (werror)
         throw AsmError(linepos, "warning treated as errors");
 }
@@ -4773,6 +6488,8 @@ void Asm::In::parseRET(Tokenizer & tz)
         code = 0xC3;
     }
     gencode(code);
+    if (flagname.empty() )
+        codefalls = false;
 
     showcode("RET" +
         (flagname.empty() ? emptystr : (" " + flagname) ) );
@@ -4825,6 +6542,8 @@ void Asm::In::parseJP_ (Tokenizer & tz, bool bracket)
         showcode("JP(" + nameHLpref(prefix) + ')');
     }
 
+    codefalls = false;
+
     if (prefix != NoPrefix)
         no8080();
 }
@@ -4896,6 +6615,8 @@ void Asm::In::parseJP(Tokenizer & tz)
         gencode(code);
         gencodeword(addr);
     }
+    if (flagname.empty() )
+        codefalls = false;
 
     showcode("JP " + (flagname.empty() ? emptystr : flagname + ", ") +
         hex4str(addr) );
@@ -4918,6 +6639,30 @@ byte Asm::In::getrelative(address addr, address off)
     return dif;
 }
 
+bool Asm::In::relaxbranch(address addr, address off)
+{
+    // Returns true if the current relaxable branch must use
+    // the long form, marking it if its target is out of range.
+
+    const size_t n = relaxindex++;
+    if (n >= relaxlong.size() )
+        relaxlong.push_back(false);
+    if (! relaxlong [n] && pass >= 2)
+    {
+        const int dif = addr - (current + off);
+        if (dif > 127 || dif < -128)
+        {
+            relaxlong [n] = true;
+            relaxchanged = true;
+        }
+    }
+    if (relaxlong [n])
+        ++nrelaxlong;
+    else
+        ++nrelaxshort;
+    return relaxlong [n];
+}
+
 void Asm::In::parserelative(Tokenizer & tz, Token tok, byte code,
     const std::string instrname)
 {
@@ -4925,9 +6670,36 @@ void Asm::In::parserelative(Tokenizer & tz, Token tok, byte code,
 
     address addr = parseexpr(false, tok, tz);
     checkendline(tz);
+
+    if (relaxmode && ! mode86 && relaxbranch(addr, 2) )
+    {
+        if (code == codeDJNZ)
+        {
+            // DJNZ to a trampoline:
+            //     DJNZ $+4 ; JR $+5 ; JP addr
+            gencode(codeDJNZ, 0x02, 0x18, 0x03);
+            gencode(0xC3);
+        }
+        else
+        {
+            // JR -> JP, JR cc -> JP cc
+            gencode(code == 0x18 ? 0xC3 : 0xC2 | (code & 0x18) );
+        }
+        gencodeword(addr);
+        if (code == 0x18)
+            codefalls = false;
+        showcode(instrname + ' ' + hex4str(addr) + " (long)");
+
+        if (code == codeDJNZ)
+            no8080();
+        return;
+    }
+
     byte reldesp = getrelative(addr, 2);
 
     gencode(code, reldesp);
+    if (code == 0x18 || code == 0xEB)
+        codefalls = false;
     showcode(instrname + ' ' + hex4str(addr) );
 
     no8080();
@@ -5475,23 +7247,20 @@ void Asm::In::parseINCBIN(Tokenizer & tz)
     checkendline(tz);
     * pout << "\t\tINCBIN " << includefile << '\n';
 
-    std::ifstream f;
-    openis(getline(), f, includefile, std::ios::in | std::ios::binary);
+    std::string content;
+    const std::string path = readbinfile(getline(), includefile, content);
 
-    char buffer [1024];
-    for (;;)
+    // Keep the content to detect changes when reloading.
+    if (isincremental() && pass == 1)
     {
-        f.read(buffer, sizeof(buffer) );
-        for (std::streamsize i = 0, r = f.gcount(); i < r; ++i)
-            gendata(static_cast <byte> (buffer [i] ) );
-        if (! f)
-        {
-            if (f.eof() )
-                break;
-            else
-                throw ErrorReadingINCBIN;
-        }
+        auto const it = incbins.insert(make_pair(path,
+            make_pair(getline(), std::string() ) ) ).first;
+        if (it->second.first == getline() )
+            it->second.second = content;
     }
+
+    for (std::string::size_type i = 0; i < content.size(); ++i)
+        gendata(static_cast <byte> (content [i] ) );
 }
 
 //*********************************************************
@@ -5610,7 +7379,7 @@ bool Asm::In::gotoENDM()
     size_t level = 1;
     while (nextline() )
     {
-        Tokenizer & tz(getcurrentline() );
+        Tokenizer tz(getcurrentline() );
         TRMACRO(tz << '\n');
 
         Token tok = tz.gettoken();
@@ -5650,16 +7419,20 @@ namespace pasmo_impl
 
 //--------------------------------------------------------------
 
-MacroFrameBase::MacroFrameBase(Asm::In & asmin_n,
+MacroFrameBase::MacroFrameBase(Asm::In & asmin_n, const std::string & name,
         const MacroBase & macro_n, const MacroArgumentList & arguments_n) :
     asmin(asmin_n),
     expandline(asmin.getline() ),
     previflevel(asmin.iflevel),
+    prevlines(asmin.nlines),
     macro(macro_n),
     arguments(arguments_n),
     pprevmframe(asmin.getmframe() )
 {
     TRMACRO("MacroFrameBase " << arguments.size() << '\n');
+    ++asmin.nmacroexpansions;
+    if (asmin.tracemode)
+        asmin.beginspan(name, expandline);
     MacroLevel * const pproc = new MacroLevel(asmin);
     asmin.localstack.push(pproc);
 
@@ -5711,9 +7484,9 @@ Tokenizer MacroFrameBase::substparentparams(Tokenizer & tz)
 
 //--------------------------------------------------------------
 
-MacroFrameChild::MacroFrameChild(Asm::In & asmin_n,
+MacroFrameChild::MacroFrameChild(Asm::In & asmin_n, const std::string & name,
         const MacroBase & macro_n, const MacroArgumentList & arguments_n) :
-    MacroFrameBase(asmin_n, macro_n, arguments_n)
+    MacroFrameBase(asmin_n, name, macro_n, arguments_n)
 {
     TRMACRO("MacroFrameChild\n");
 }
@@ -5735,7 +7508,7 @@ Tokenizer MacroFrameChild::substparams(Tokenizer & tz)
 //--------------------------------------------------------------
 
 MacroFrameREPT::MacroFrameREPT(Asm::In & asmin_n, const MacroRept & macro_n) :
-    MacroFrameChild(asmin_n, macro_n, MacroArgumentList(1) )
+    MacroFrameChild(asmin_n, "REPT", macro_n, MacroArgumentList(1) )
 {
     TRMACRO("MacroFrameREPT\n");
 }
@@ -5743,7 +7516,7 @@ MacroFrameREPT::MacroFrameREPT(Asm::In & asmin_n, const MacroRept & macro_n) :
 //--------------------------------------------------------------
 
 MacroFrameIRP::MacroFrameIRP(Asm::In & asmin_n, const MacroIrp & macro_n) :
-    MacroFrameChild(asmin_n, macro_n, MacroArgumentList(1) )
+    MacroFrameChild(asmin_n, "IRP", macro_n, MacroArgumentList(1) )
 {
     TRMACRO("MacroFrameIRP\n");
 }
@@ -5756,7 +7529,7 @@ void MacroFrameIRP::setcurrentarg(const MacroArgument & arg)
 //--------------------------------------------------------------
 
 MacroFrameIRPC::MacroFrameIRPC(Asm::In & asmin_n, const MacroIrpc & macro_n) :
-    MacroFrameChild(asmin_n, macro_n, MacroArgumentList(1) )
+    MacroFrameChild(asmin_n, "IRPC", macro_n, MacroArgumentList(1) )
 {
     TRMACRO("MacroFrameIRPC\n");
 }
@@ -5771,9 +7544,9 @@ void MacroFrameIRPC::setcurrentvalue(char c, bool nocase)
 
 //--------------------------------------------------------------
 
-MacroFrameMacro::MacroFrameMacro(Asm::In & asmin_n,
+MacroFrameMacro::MacroFrameMacro(Asm::In & asmin_n, const std::string & name,
         const Macro & macro_n, const MacroArgumentList & arguments_n) :
-    MacroFrameBase(asmin_n, macro_n, arguments_n)
+    MacroFrameBase(asmin_n, name, macro_n, arguments_n)
 {
     TRMACRO("MacroFrameMacro\n");
 }
@@ -5848,7 +7621,7 @@ void Asm::In::expandMACRO(const std::string & name,
     }
 
     // Set the local frame.
-    MacroFrameMacro mframe(* this, macro, arguments);
+    MacroFrameMacro mframe(* this, name, macro, arguments);
 
     // Do the expansion,
     try
@@ -5856,7 +7629,7 @@ void Asm::In::expandMACRO(const std::string & name,
         bool noexit = true;
         for (setline(macro.getline() ); noexit && nextline(); )
         {
-            Tokenizer & tz(getcurrentline() );
+            Tokenizer tz(getcurrentline() );
             * pout << tz << '\n';
 
             Token tok = tz.gettoken();
@@ -5880,7 +7653,9 @@ void Asm::In::expandMACRO(const std::string & name,
     }
     catch (...)
     {
-        showerrorinfo(* perr, mframe.getexpandline(), "expanding macro");
+        // In collect errors mode the errors are shown at the end.
+        if (maxerrors == 1)
+            showerrorinfo(* perr, mframe.getexpandline(), "expanding macro");
         throw;
     }
 
@@ -5957,7 +7732,7 @@ void Asm::In::parseREPT(Tokenizer & tz)
         for (setline(mframe.getexpandline() );
             noendblock && nextline(); )
         {
-            Tokenizer & tz(getcurrentline() );
+            Tokenizer tz(getcurrentline() );
 
             tok = tz.gettoken();
             TypeToken tt = tok.type();
@@ -6038,7 +7813,7 @@ void Asm::In::parseIRP(Tokenizer & tz)
         for (setline(mframe.getexpandline() );
             noendblock && nextline(); )
         {
-            Tokenizer & tz(getcurrentline() );
+            Tokenizer tz(getcurrentline() );
 
             tok = tz.gettoken();
             TypeToken tt = tok.type();
@@ -6114,7 +7889,7 @@ void Asm::In::parseIRPC(Tokenizer & tz)
         for (setline(irpcframe.getexpandline() );
             noendblock && nextline(); )
         {
-            Tokenizer & tz(getcurrentline() );
+            Tokenizer tz(getcurrentline() );
 
             tok = tz.gettoken();
             TypeToken tt = tok.type();
@@ -6171,6 +7946,24 @@ static void check_out(std::ostream & out)
         throw ErrorOutput;
 }
 
+// Header and code blocks of tap for the code of each bank, to be
+// loaded after paging it.
+
+static void writebankblocks(const Asm & as, ByteBuffer & image)
+{
+    spectrum::checkbanks(as);
+    const std::vector <Asm::BankCode> banks = as.getbanks();
+    for (size_t i = 0; i < banks.size(); ++i)
+    {
+        const Asm::BankCode & bank = banks [i];
+        tap::CodeHeader headcodeblock(bank.start, bank.size,
+            as.getheadername() );
+        tap::CodeBlock codeblock(bank.size, bank.data);
+        headcodeblock.write(image);
+        codeblock.write(image);
+    }
+}
+
 void Asm::In::message_emit(const std::string & type) const
 {
     if (debugtype != NoDebug)
@@ -6179,6 +7972,34 @@ void Asm::In::message_emit(const std::string & type) const
             '\n';
 }
 
+void Asm::In::message_compress(const spectrum::CompressedCode & code) const
+{
+    const address original = code.getoriginalsize();
+    const address packed = code.getpackedsize();
+    const tzx::Timing & timing = tzx::spectrumtiming(speed);
+    const double timeoriginal =
+        tzx::blocktime(timing, mem.data() + minused, original);
+    const double timepacked =
+        tzx::blocktime(timing, code.getdata(), code.getsize() );
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1) <<
+        "Code size: " << original << " bytes, compressed " <<
+        packed << " bytes (" << (original ? 100.0 * packed / original : 0) <<
+        "%), loaded at " << hex4(code.getstart() ) << " with decompressor\n"
+        "Estimated load time: " << timeoriginal << " s, compressed " <<
+        timepacked << " s, saved " << timeoriginal - timepacked << " s\n";
+    * pverb << oss.str();
+}
+
+void Asm::In::message_loadtime(double seconds) const
+{
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1) <<
+        "Estimated load time of the file: " << seconds << " s\n";
+    * pverb << oss.str();
+}
+
 address Asm::In::getcodesize() const
 {
     return maxused - minused + 1;
@@ -6201,34 +8022,106 @@ address Asm::In::getentrypoint() const
 
 void Asm::In::writebincode(std::ostream & out) const
 {
-    out.write(reinterpret_cast<const char *>(mem + minused), getcodesize());
+    out.write(reinterpret_cast<const char *>(mem.data() + minused),
+        getcodesize());
 }
 
-void Asm::In::emithex(std::ostream & out)
+void Asm::In::appendcode(ByteBuffer & image) const
 {
-    message_emit("Intel HEX");
+    image.append(mem.data() + minused, getcodesize() );
+}
+
+// The code in the base snapshot or in the state after the reset,
+// starting at the entry point or at the beginning of the code.
+
+void Asm::In::setsnapshot(snapshot::Machine & machine) const
+{
+    if (snapbase.empty() )
+        snapshot::setdefault(machine);
+    else
+        snapshot::load(machine, snapbase);
+    snapshot::place(machine, mem.data(), minused, getcodesize(),
+        entrypointdefined ? entrypoint : minused, ! snapbase.empty() );
 
-    const address end = maxused + 1;
-    for (address addr = minused; addr < end; addr += 16)
+    // With banks the snapshot is of the 128K, with the bank 0 paged.
+    const std::vector <BankCode> code = getbanks();
+    if (! code.empty() )
+        snapshot::set128(machine);
+    for (size_t i = 0; i < code.size(); ++i)
+        snapshot::placebank(machine, code [i].bank,
+            code [i].data, code [i].start, code [i].size);
+}
+
+std::vector <Asm::BankCode> Asm::In::getbanks() const
+{
+    std::vector <BankCode> code;
+    for (banks_t::const_iterator it = banks.begin(); it != banks.end(); ++it)
     {
-        address len = end - addr;
-        if (len > 16)
-            len = 16;
-        out << ':' << hex2(lobyte(len) ) << hex4(addr) << "00";
+        const Bank & bank = it->second;
+        BankCode bankcode;
+        bankcode.bank = static_cast <byte> (it->first);
+        bankcode.start = bank.minused;
+        bankcode.size = bank.maxused - bank.minused + 1;
+        bankcode.data = & bank.data [bank.minused % banksize];
+        code.push_back(bankcode);
+    }
+    return code;
+}
+
+void Asm::In::checknobanks(const std::string & format) const
+{
+    if (! banks.empty() )
+        throw runtime_error("The code in banks can not be generated "
+            "in " + format + " format");
+}
+
+void Asm::In::emithex(std::ostream & out)
+{
+    message_emit("Intel HEX");
+    checknobanks("Intel HEX");
+
+    // Records of up to 16 bytes: colon, length, address, type,
+    // data, checksum and CR LF.
+    const size_t recordbytes = 16;
+    const size_t recordsize = 1 + 2 + 4 + 2 + recordbytes * 2 + 2 + 2;
+
+    // size_t to not overflow with code up to FFFFH.
+    const size_t end = size_t(maxused) + 1;
+    const size_t nrecords = minused < end ?
+        (end - minused + recordbytes - 1) / recordbytes : 0;
+    TextBuffer text;
+    char * p = text.reserve( (nrecords + 1) * recordsize);
+    for (size_t addr = minused; addr < end; addr += recordbytes)
+    {
+        const size_t len = std::min(end - addr, recordbytes);
+        * p++ = ':';
+        p = puthex2(p, byte(len) );
+        p = puthex4(p, address(addr) );
+        * p++ = '0';
+        * p++ = '0';
         byte sum = len + ( (addr >> 8) & 0xFF) + (addr & 0xFF);
-        for (address j = 0; j < len; ++j)
+        for (size_t j = 0; j < len; ++j)
         {
             const byte b = mem [addr + j];
-            out << hex2(b);
+            p = puthex2(p, b);
             sum+= b;
         }
-        out << hex2(lobyte(0x100 - sum) );
-        out << "\r\n";
+        p = puthex2(p, lobyte(0x100 - sum) );
+        * p++ = '\r';
+        * p++ = '\n';
     }
     // End of file, record, used also as start address in some cases
     const address entry = getentrypoint();
     const byte sum = ( (entry >> 8) & 0xFF) + (entry & 0xFF) + 1;
-    out << ":00" << hex4(entry) << "01" << hex2(lobyte(0x100 - sum)) << "\r\n";
+    * p++ = ':';
+    p = puthex2(p, 0);
+    p = puthex4(p, entry);
+    p = puthex2(p, 1);
+    p = puthex2(p, lobyte(0x100 - sum) );
+    * p++ = '\r';
+    * p++ = '\n';
+    text.commit(p);
+    text.write(out);
 
     check_out(out);
 }
@@ -6236,25 +8129,21 @@ void Asm::In::emithex(std::ostream & out)
 void Asm::In::emitmsx(std::ostream & out)
 {
     message_emit("MSX");
+    checknobanks("MSX");
+
+    ByteBuffer image;
 
     // Header of an MSX BLOADable disk file.
-    byte header [7] = { 0xFE }; // Header identification byte.
-    // Start address.
-    header [1] = minused & 0xFF;
-    header [2] = minused >> 8;
-    // End address.
-    header [3] = maxused & 0xFF;
-    header [4] = maxused >> 8;
-    // Exec address.
-    const address entry = getentrypoint();
-    header [5] = entry & 0xFF;
-    header [6] = entry >> 8;
+    image.put(0xFE); // Header identification byte.
+    image.putword(minused); // Start address.
+    image.putword(maxused); // End address.
+    image.putword(getentrypoint() ); // Exec address.
 
-    // Write hader.
-    out.write(reinterpret_cast <char *> (header), sizeof(header) );
+    // Code.
+    appendcode(image);
 
-    // Write code.
-    writebincode(out);
+    image.write(out);
+    check_out(out);
 }
 
 void Asm::In::emitprl(std::ostream & out)
@@ -6263,6 +8152,7 @@ void Asm::In::emitprl(std::ostream & out)
     cerr << "emitprl\n";
     #endif
     message_emit("PRL");
+    checknobanks("PRL");
 
     processfile();
 
@@ -6273,24 +8163,27 @@ void Asm::In::emitprl(std::ostream & out)
     #endif
     In asmoff(* this);
     asmoff.setbase(0x100);
+    const address off = asmoff.base - base;
+    if (off % MemImage::pagesize == 0)
+        asmoff.mem.share(mem, off);
     asmoff.processfile();
+    * pverb << "Pages copied in the offset assembly: " <<
+        asmoff.mem.getcopied() << '\n';
 
     if (minused - base != asmoff.minused - asmoff.base)
         throw OutOfSyncPRL;
     if (maxused - base != asmoff.maxused - asmoff.base)
         throw OutOfSyncPRL;
     const address len = getcodesize();
-    const address off = asmoff.base - base;
 
-    // PRL header.
+    // PRL header: 256 bytes with the code length.
 
-    byte prlhead [256] = { 0 };
-    prlhead [1] = len & 0xFF;
-    prlhead [2] = len >> 8;
-    out.write(reinterpret_cast <char *> (prlhead), sizeof(prlhead) );
+    ByteBuffer image;
+    image.put(0);
+    image.putword(len);
+    image.fill(0, 256 - 3);
     const address reloclen = (len + 7) / 8;
-    byte * const reloc = new byte [reloclen];
-    fill(reloc, reloc + reloclen, byte(0) );
+    std::vector <byte> reloc(reloclen);
 
     #if DEBUG_PRL
     cerr << "building prl relocation bitmap\n";
@@ -6321,12 +8214,13 @@ void Asm::In::emitprl(std::ostream & out)
         }
     }
 
-    // Write code in position 0x0100
-    asmoff.writebincode(out);
+    // Code in position 0x0100
+    asmoff.appendcode(image);
 
-    // Write relocation bitmap.
-    out.write(reinterpret_cast <char *> (reloc), reloclen);
+    // Relocation bitmap.
+    image.append(reloc.data(), reloclen);
 
+    image.write(out);
     check_out(out);
 }
 
@@ -6338,7 +8232,7 @@ class CmdGroup
 public:
     CmdGroup(); // Create empty group
     CmdGroup(address lengthn); // Create Code group
-    void put(std::ostream & out) const;
+    void put(ByteBuffer & out) const;
 private:
     byte type;
     address length;
@@ -6372,13 +8266,13 @@ CmdGroup::CmdGroup(address lengthn) :
 {
 }
 
-void CmdGroup::put(std::ostream & out) const
+void CmdGroup::put(ByteBuffer & out) const
 {
     out.put(type);
-    putword(out, length);
-    putword(out, base);
-    putword(out, minimum);
-    putword(out, maximum);
+    out.putword(length);
+    out.putword(base);
+    out.putword(minimum);
+    out.putword(maximum);
 }
 
 } // namespace
@@ -6386,6 +8280,7 @@ void CmdGroup::put(std::ostream & out) const
 void Asm::In::emitcmd(std::ostream & out)
 {
     message_emit("CMD");
+    checknobanks("CMD");
 
     address codesize = getcodesize();
     CmdGroup code(codesize);
@@ -6393,28 +8288,30 @@ void Asm::In::emitcmd(std::ostream & out)
 
     // CMD header.
 
+    ByteBuffer image;
+
     // 8 group descriptors: 72 bytes in total.
-    code.put(out);
+    code.put(image);
     for (size_t i = 1; i < 8; ++i)
-        empty.put(out);
+        empty.put(image);
 
     // Until 128 bytes: filled with zeroes(in this case).
-    char fillhead [128 - 72] = { };
-    out.write(fillhead, sizeof(fillhead) );
+    image.fill(0, 128 - 72);
 
     // First 256 bytes of prefix in 8080 model.
-    char prefix [256] = { };
-    out.write(prefix, sizeof(prefix) );
+    image.fill(0, 256);
 
     // Binary image.
-    writebincode(out);
+    appendcode(image);
 
+    image.write(out);
     check_out(out);
 }
 
 void Asm::In::emitsdrel(std::ostream & out)
 {
     message_emit("REL");
+    checknobanks("REL");
 
     // Assembly with appropiate offset to obtain the information
     // for reloc entries
@@ -6432,12 +8329,17 @@ void Asm::In::emitsdrel(std::ostream & out)
     if (npublics == 0)
         emitwarning("No public symbols");
 
-    out << "XL2\n";
-    out << "M " << headername << '\n';
-    out << "H 1 areas " << npublics + 1 << " global symbols\n";
-    out << "O -mz80\n";
-    out << "S .__.ABS. Def0000\n";
-    out << "A _CODE size " << hex2(byte(len)) << " flags 0 addr 0\n";
+    TextBuffer text;
+    text.append("XL2\nM ");
+    text.append(headername);
+    text.append("\nH 1 areas ");
+    text.appenddecimal(npublics + 1);
+    text.append(" global symbols\n"
+        "O -mz80\n"
+        "S .__.ABS. Def0000\n"
+        "A _CODE size ");
+    text.appendhex2(byte(len) );
+    text.append(" flags 0 addr 0\n");
 
     for (auto pit = setpublic.begin();
         pit != setpublic.end();
@@ -6445,8 +8347,13 @@ void Asm::In::emitsdrel(std::ostream & out)
     {
         auto it = mapvar.find(* pit);
         if (it != mapvar.end() )
-            out << "S " << it->first <<
-                    " Def" << hex4(it->second.getvalue()) << '\n';
+        {
+            text.append("S ");
+            text.append(it->first);
+            text.append(" Def");
+            text.appendhex4(it->second.getvalue() );
+            text.append('\n');
+        }
     }
     int tsize = 0;
     for (address i = minused; i <= maxused; ++i)
@@ -6468,68 +8375,496 @@ void Asm::In::emitsdrel(std::ostream & out)
             //const address pos = i - minused;
             if (tsize > 0)
             {
-                out << "\nR 00 00 00 00\n";
+                text.append("\nR 00 00 00 00\n");
                 tsize = 0;
             }
-            out << "T " << hex2(byte(i & 0xFF)) <<
-                    ' ' << hex2(byte(i >> 8)) <<
-                    ' ' << hex2(b) << ' ' << hex2(bh) << '\n';
-            out << "R 00 00 00 00 00 02 00 00\n";
+            text.append("T ");
+            text.appendhex2(byte(i & 0xFF) );
+            text.append(' ');
+            text.appendhex2(byte(i >> 8) );
+            text.append(' ');
+            text.appendhex2(b);
+            text.append(' ');
+            text.appendhex2(bh);
+            text.append("\nR 00 00 00 00 00 02 00 00\n");
+            ++i;
+        }
+        else
+        {
+            if (tsize == 14)
+            {
+                text.append("\nR 00 00 00 00\n");
+                tsize = 0;
+            }
+            if (tsize == 0)
+            {
+                text.append("T ");
+                text.appendhex2(byte(i & 0xFF) );
+                text.append(' ');
+                text.appendhex2(byte(i >> 8) );
+            }
+            text.append(' ');
+            text.appendhex2(b);
+            ++tsize;
+        }
+    }
+    if (tsize > 0)
+        text.append("\nR 00 00 00 00\n");
+    text.write(out);
+}
+
+void Asm::In::emitrelobj(std::ostream & out)
+{
+    message_emit("relocatable object");
+    checknobanks("relocatable object");
+
+    // The code is assembled again moving the symbols to which
+    // the words can be relative, the start of the module with
+    // number 1 and the EXTRN symbols from 2, in the assemblies
+    // that correspond to the bits of its number. The words that
+    // change give the symbol added to them.
+
+    const std::vector <std::string> externs(setextern.begin(),
+        setextern.end() );
+    const address delta = 0x0103;
+    const address checkoff = 0x0205;
+    if (minused <= maxused && maxused + checkoff > 0xFFFF)
+        throw runtime_error("Relocatable object generation failed: "
+            "the module is too big");
+    size_t nbits = 0;
+    while ( (externs.size() + 1) >> nbits)
+        ++nbits;
+
+    auto checksync = [this] (const In & other)
+    {
+        const bool empty = minused > maxused;
+        if (empty != (other.minused > other.maxused) ||
+                (! empty && (minused - base != other.minused - other.base ||
+                maxused - base != other.maxused - other.base) ) )
+            throw OutOfSyncObj;
+    };
+
+    typedef std::map <address, size_t> wordcodes_t;
+    wordcodes_t wordcodes;
+    std::map <std::string, size_t> publiccodes;
+
+    for (size_t bit = 0; bit < nbits; ++bit)
+    {
+        In asmoff(* this);
+        asmoff.pwarn = & asmoff.nullout;
+        address off = 0;
+        if (bit == 0)
+        {
+            off = delta;
+            asmoff.setbase(base + off);
+        }
+        for (size_t i = 0; i < externs.size(); ++i)
+            if ( ( (i + 2) >> bit) & 1)
+                asmoff.externvalues [externs [i] ] = delta;
+        asmoff.processfile();
+        checksync(asmoff);
+
+        for (size_t i = minused; i <= maxused; ++i)
+        {
+            if (mem [i] == asmoff.mem [i + off] )
+                continue;
+            const address w = makeword(mem [i], mem [i + 1] );
+            const address w2 = makeword(asmoff.mem [i + off],
+                asmoff.mem [i + off + 1] );
+            if (i == maxused || address(w2 - w) != delta)
+                throw InvalidRelocation(i - base);
+            wordcodes [i] |= size_t(1) << bit;
             ++i;
         }
-        else
+
+        for (setpublic_t::const_iterator pit = setpublic.begin();
+            pit != setpublic.end();
+            ++pit)
+        {
+            mapvar_t::iterator it = mapvar.find(* pit);
+            mapvar_t::iterator it2 = asmoff.mapvar.find(* pit);
+            if (it == mapvar.end() || it2 == asmoff.mapvar.end() )
+                continue;
+            const address diff = it2->second.getvalue() -
+                it->second.getvalue();
+            if (diff == delta)
+                publiccodes [* pit] |= size_t(1) << bit;
+            else if (diff != 0)
+                throw PublicNotRelocatable(* pit);
+        }
+    }
+
+    relobj::Object object;
+    object.name = headername;
+    object.externs = externs;
+    if (minused <= maxused)
+        object.code.assign(mem.data() + base, mem.data() + maxused + 1);
+    for (wordcodes_t::const_iterator it = wordcodes.begin();
+        it != wordcodes.end();
+        ++it)
+    {
+        const address offset = it->first - base;
+        if (it->second == 1)
+            object.relocs.push_back(offset);
+        else if (it->second - 2 < externs.size() )
+            object.extrefs.push_back(
+                std::make_pair(offset, externs [it->second - 2] ) );
+        else
+            throw InvalidRelocation(offset);
+    }
+    for (setpublic_t::const_iterator pit = setpublic.begin();
+        pit != setpublic.end();
+        ++pit)
+    {
+        mapvar_t::iterator it = mapvar.find(* pit);
+        if (it == mapvar.end() )
+            continue;
+        if (setextern.find(* pit) != setextern.end() )
+            throw PublicNotRelocatable(* pit);
+        const size_t code = publiccodes [* pit];
+        if (code > 1)
+            throw PublicNotRelocatable(* pit);
+        relobj::Public pub;
+        pub.name = * pit;
+        pub.relative = code == 1;
+        pub.value = it->second.getvalue() - (pub.relative ? base : 0);
+        object.publics.push_back(pub);
+    }
+
+    // Check the result with all the symbols moved to different
+    // places, this detects expressions that combine several
+    // of them.
+
+    In asmcheck(* this);
+    asmcheck.pwarn = & asmcheck.nullout;
+    std::vector <address> externcheck;
+    for (size_t i = 0; i < externs.size(); ++i)
+    {
+        externcheck.push_back(0x0307 + 0x0102 * i);
+        asmcheck.externvalues [externs [i] ] = externcheck.back();
+    }
+    asmcheck.setbase(base + checkoff);
+    asmcheck.processfile();
+    checksync(asmcheck);
+    std::vector <byte> expected(object.code);
+    for (size_t i = 0; i < object.relocs.size(); ++i)
+    {
+        const address pos = object.relocs [i];
+        const address w = makeword(expected [pos], expected [pos + 1] ) +
+            checkoff;
+        expected [pos] = lobyte(w);
+        expected [pos + 1] = hibyte(w);
+    }
+    for (size_t i = 0; i < object.extrefs.size(); ++i)
+    {
+        const address pos = object.extrefs [i].first;
+        const size_t n = std::find(externs.begin(), externs.end(),
+            object.extrefs [i].second) - externs.begin();
+        const address w = makeword(expected [pos], expected [pos + 1] ) +
+            externcheck [n];
+        expected [pos] = lobyte(w);
+        expected [pos + 1] = hibyte(w);
+    }
+    for (size_t i = minused; i <= maxused; ++i)
+        if (expected [i - base] != asmcheck.mem [i + checkoff] )
+            throw InvalidRelocation(i - base);
+    for (size_t i = 0; i < object.publics.size(); ++i)
+    {
+        const relobj::Public & pub = object.publics [i];
+        const address value = pub.value + (pub.relative ? checkoff : 0);
+        mapvar_t::iterator it = asmcheck.mapvar.find(pub.name);
+        if (it == asmcheck.mapvar.end() || it->second.getvalue() != value)
+            throw PublicNotRelocatable(pub.name);
+    }
+
+    object.write(out);
+    check_out(out);
+}
+
+//*********************************************************
+//        Symbol table generation.
+//*********************************************************
+
+void Asm::In::dumppublic(std::ostream & out)
+{
+    TextBuffer text;
+    for (setpublic_t::iterator pit = setpublic.begin();
+        pit != setpublic.end();
+        ++pit)
+    {
+        mapvar_t::iterator it = mapvar.find(* pit);
+        if (it != mapvar.end() )
+            appendsymbol(text, it->first, it->second.getvalue(),
+                it->second.getbank(), symbolformat);
+    }
+    text.write(out);
+}
+
+void Asm::In::dumpsymbol(std::ostream & out)
+{
+    TextBuffer text;
+    for (mapvar_t::iterator it = mapvar.begin();
+        it != mapvar.end();
+        ++it)
+    {
+        /*const*/ VarData & vd = it->second;
+        // Dump only EQU and label valid symbols.
+        if (vd.def() != DefinedPass2)
+            continue;
+
+        appendsymbol(text, it->first, vd.getvalue(), vd.getbank(),
+            symbolformat);
+    }
+    text.write(out);
+}
+
+//*********************************************************
+//        Memory map generation.
+//*********************************************************
+
+void Asm::In::dumpmap(std::ostream & out)
+{
+    maplabels_t labels(maplabels);
+    std::stable_sort(labels.begin(), labels.end() );
+
+    for (memblocks_t::const_iterator it = memblocks.begin();
+        it != memblocks.end();
+        ++it)
+    {
+        // The banks are shown after the main memory.
+        const MemBlock & block = * it;
+        if (block.bank != nobank)
+            continue;
+        const size_t size = static_cast <address> (block.end - block.start)
+            + 1;
+        out << "Block " << hex4(block.start) << '-' << hex4(block.end) <<
+            ' ' << size << " bytes";
+        std::string filename;
+        size_t numline;
+        if (getlineinfo(block.line, filename, numline) )
+            out << ' ' << filename << ':' << numline;
+        if (block.overwritten > 0)
+            out << " (overwrites " << block.overwritten << " bytes)";
+        out << '\n';
+
+        for (maplabels_t::const_iterator lit = std::lower_bound(
+                labels.begin(), labels.end(),
+                make_pair(block.start, std::string() ) );
+            lit != labels.end() && lit->first <= block.end;
+            ++lit)
+        {
+            out << '\t' << hex4(lit->first) << ' ' << lit->second << '\n';
+        }
+    }
+
+    for (memregions_t::const_iterator it = memregions.begin();
+        it != memregions.end();
+        ++it)
+    {
+        const MemRegion & region = * it;
+        const size_t size = static_cast <size_t> (region.end - region.start)
+            + 1;
+        size_t used = 0;
+        for (size_t addr = region.start; addr <= region.end; ++addr)
+            if (memwritten [addr] )
+                ++used;
+        out << "Region " << region.name << ' ' <<
+            hex4(region.start) << '-' << hex4(region.end) << ' ' <<
+            used << '/' << size << " bytes " <<
+            used * 100 / size << "%\n";
+    }
+
+    // The code of each bank, from the first to the last byte used,
+    // with its labels.
+    for (banks_t::const_iterator it = banks.begin(); it != banks.end(); ++it)
+    {
+        const Bank & bank = it->second;
+        out << "Bank " << it->first << ' ' <<
+            hex4(bank.minused) << '-' << hex4(bank.maxused) << ' ' <<
+            (bank.maxused - bank.minused + 1) << " bytes\n";
+
+        maplabels_t banklabels;
+        for (mapvar_t::iterator vit = mapvar.begin();
+            vit != mapvar.end();
+            ++vit)
+        {
+            VarData & vd = vit->second;
+            if (vd.getbank() == it->first && vd.def() == DefinedPass2)
+                banklabels.push_back(make_pair(vd.getvalue(), vit->first) );
+        }
+        std::stable_sort(banklabels.begin(), banklabels.end() );
+        for (maplabels_t::const_iterator lit = banklabels.begin();
+            lit != banklabels.end();
+            ++lit)
+        {
+            out << '\t' << hex4(lit->first) << ' ' << lit->second << '\n';
+        }
+    }
+}
+
+void Asm::In::trace()
+{
+    tracemode = true;
+    setstats(& stats);
+}
+
+void Asm::In::listing()
+{
+    listmode = true;
+}
+
+void Asm::In::dumplisting(std::ostream & out)
+{
+    listbuffer.write(out);
+}
+
+void Asm::In::sourcemap()
+{
+    srcmapmode = true;
+}
+
+// The ranges with the file and line number, joining the ones of
+// different lines in the same place, as in macro expansions.
+
+void Asm::In::getsourceranges(std::vector <SourceRange> & ranges,
+    std::vector <std::string> & files) const
+{
+    std::vector <SourceMap::Range> lines;
+    srcmap.getranges(lines);
+
+    std::map <std::string, size_t> fileindex;
+    std::string filename;
+    ranges.clear();
+    files.clear();
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        const SourceMap::Range & line = lines [i];
+        size_t numline = 0;
+        if (! getlineinfo(line.line, filename, numline) )
+            continue;
+        std::map <std::string, size_t>::iterator it =
+            fileindex.find(filename);
+        if (it == fileindex.end() )
+        {
+            it = fileindex.insert(std::make_pair(filename, files.size() ) ).
+                first;
+            files.push_back(filename);
+        }
+        if (! ranges.empty() && ranges.back().file == it->second &&
+                ranges.back().numline == numline &&
+                ranges.back().end + 1 == line.start)
         {
-            if (tsize == 14)
-            {
-                out << "\nR 00 00 00 00\n";
-                tsize = 0;
-            }
-            if (tsize == 0)
-            {
-                out << "T " << hex2(byte(i & 0xFF)) <<
-                        ' ' << hex2(byte(i >> 8));
-            }
-            out << ' ' << hex2(b);
-            ++tsize;
+            ranges.back().end = line.end;
+            continue;
         }
+        SourceRange range;
+        range.start = line.start;
+        range.end = line.end;
+        range.file = it->second;
+        range.numline = numline;
+        ranges.push_back(range);
     }
-    if (tsize > 0)
-        out << "\nR 00 00 00 00\n";
 }
 
-//*********************************************************
-//        Symbol table generation.
-//*********************************************************
+void Asm::In::dumpsourcemap(std::ostream & out)
+{
+    std::vector <SourceRange> ranges;
+    std::vector <std::string> files;
+    getsourceranges(ranges, files);
+    writesourcemap(out, ranges, files);
+}
 
-void Asm::In::dumppublic(std::ostream & out)
+void Asm::In::dumpsourceindex(std::ostream & out)
 {
-    for (setpublic_t::iterator pit = setpublic.begin();
-        pit != setpublic.end();
-        ++pit)
+    std::vector <SourceRange> ranges;
+    std::vector <std::string> files;
+    getsourceranges(ranges, files);
+    ByteBuffer image;
+    writesourceindex(image, ranges, files);
+    image.write(out);
+    check_out(out);
+}
+
+void Asm::In::setsymbolformat(SymbolFormat format)
+{
+    symbolformat = format;
+}
+
+void Asm::In::beginphase(const std::string & name, const std::string & file)
+{
+    stats.beginphase(name, file);
+}
+
+void Asm::In::beginspan(const std::string & name, size_t line)
+{
+    std::string file;
+    size_t numline = 0;
+    getlineinfo(line, file, numline);
+    stats.beginspan(name, file, numline);
+}
+
+void Asm::In::endphase()
+{
+    stats.endphase();
+}
+
+void Asm::In::cancelphase()
+{
+    stats.cancelphase();
+}
+
+void Asm::In::addemitted(size_t size)
+{
+    nemitted += size;
+}
+
+void Asm::In::dumpstats(std::ostream & out, bool json)
+{
+    stats.setcounter("source lines", getnumlines() );
+    stats.setcounter("lines processed", nlines);
+    stats.setcounter("tokens", getnumtokens() + ntokens);
+    const size_t linestorage = getlinestorage();
+    stats.setcounter("line storage bytes", linestorage);
+    stats.setcounter("line storage per line",
+        getnumlines() == 0 ? 0 : linestorage / getnumlines() );
+    stats.setcounter("symbol lookups", mapvar.getlookups() );
+    stats.setcounter("symbol inserts", mapvar.getinserts() );
+    stats.setcounter("macro expansions", nmacroexpansions);
+    stats.setcounter("macro lines", nmacrolines);
+    stats.setcounter("lines skipped", nskippedlines);
+    stats.setcounter("bytes emitted", nemitted);
+    if (isincremental() )
     {
-        mapvar_t::iterator it = mapvar.find(* pit);
-        if (it != mapvar.end() )
-        {
-            out << tablabel(it->first) << "EQU 0" <<
-                hex4(it->second.getvalue() ) << "H\n";
-        }
+        stats.setcounter("pass 1 resumed at line", resumeline [0] );
+        stats.setcounter("pass 2 resumed at line", resumeline [1] );
     }
+    stats.setcounter("peak memory KB", peakmemory() );
+
+    if (json)
+        stats.writejson(out);
+    else
+        stats.write(out);
 }
 
-void Asm::In::dumpsymbol(std::ostream & out)
+void Asm::In::dumptrace(std::ostream & out)
 {
-    for (mapvar_t::iterator it = mapvar.begin();
-        it != mapvar.end();
-        ++it)
-    {
-        /*const*/ VarData & vd = it->second;
-        // Dump only EQU and label valid symbols.
-        if (vd.def() != DefinedPass2)
-            continue;
+    stats.writetrace(out);
+}
 
-        out << tablabel(it->first) << "EQU 0" <<
-            hex4(vd.getvalue() ) << "H\n";
-    }
+double Asm::In::phasetime(const std::string & name) const
+{
+    return stats.phasetime(name);
+}
+
+void Asm::In::resetstats()
+{
+    stats.clear();
+    nlines = 0;
+    ntokens = 0;
+    nmacroexpansions = 0;
+    nmacrolines = 0;
+    nskippedlines = 0;
+    nemitted = 0;
 }
 
 //*********************************************************
@@ -6571,6 +8906,11 @@ void Asm::errtostdout()
     pin->errtostdout();
 }
 
+void Asm::setwarnstream(std::ostream & out)
+{
+    pin->setwarnstream(out);
+}
+
 void Asm::showerrorinfo(std::ostream & os,
         size_t nline, const std::string message) const
 {
@@ -6622,11 +8962,61 @@ void Asm::setwerror()
     pin->setwerror();
 }
 
+void Asm::relax()
+{
+    pin->relax();
+}
+
+void Asm::dropunused()
+{
+    pin->dropunused();
+}
+
+void Asm::compress()
+{
+    pin->compress();
+}
+
+void Asm::setmaxerrors(size_t n)
+{
+    pin->setmaxerrors(n);
+}
+
+void Asm::setspeed(const std::string & speed)
+{
+    pin->setspeed(speed);
+}
+
+const std::string & Asm::getspeed() const
+{
+    return pin->getspeed();
+}
+
+void Asm::setsnapbase(const std::string & filename)
+{
+    pin->setsnapbase(filename);
+}
+
 void Asm::addincludedir(const std::string & dirname)
 {
     pin->addincludedir(dirname);
 }
 
+void Asm::setfileprovider(const AsmFileProvider & provider)
+{
+    pin->setfileprovider(provider);
+}
+
+void Asm::collectdiagnostics()
+{
+    pin->collectdiagnostics();
+}
+
+const std::vector <AsmDiagnostic> & Asm::getdiagnostics() const
+{
+    return pin->getdiagnostics();
+}
+
 void Asm::addpredef(const std::string & predef)
 {
     pin->addpredef(predef);
@@ -6647,6 +9037,36 @@ void Asm::processfile()
     pin->processfile();
 }
 
+bool Asm::assemble(const std::string & filename)
+{
+    return pin->assemble(filename);
+}
+
+void Asm::incremental(size_t interval)
+{
+    pin->incremental(interval);
+}
+
+void Asm::reloadfile(const std::string & filename)
+{
+    pin->reloadfile(filename);
+}
+
+size_t Asm::getresumeline(int npass) const
+{
+    return pin->getresumeline(npass);
+}
+
+const std::vector <std::string> & Asm::getopenedfiles() const
+{
+    return pin->getopenedfiles();
+}
+
+const std::vector <std::string> & Asm::getmissingfiles() const
+{
+    return pin->getmissingfiles();
+}
+
 const byte * Asm::getmem() const
 {
     return pin->getmem();
@@ -6687,15 +9107,22 @@ void Asm::writebincode(std::ostream & out) const
     pin->writebincode(out);
 }
 
+std::vector <Asm::BankCode> Asm::getbanks() const
+{
+    return pin->getbanks();
+}
+
 void Asm::emitobject(std::ostream & out)
 {
     pin->message_emit("raw binary");
+    pin->checknobanks("raw binary");
     writebincode(out);
 }
 
 void Asm::emitplus3dos(std::ostream & out)
 {
     pin->message_emit("PLUS3DOS");
+    pin->checknobanks("PLUS3DOS");
 
     const address codesize = getcodesize();
     const address minused = getminused();
@@ -6703,19 +9130,19 @@ void Asm::emitplus3dos(std::ostream & out)
     spectrum::Plus3Head head;
     head.setsize(codesize);
     head.setstart(minused);
-    head.write(out);
 
-    // Write code.
-    pin->writebincode(out);
+    ByteBuffer image;
+    head.write(image);
+
+    // Code.
+    pin->appendcode(image);
 
-    // Write rounding to 128 byte block.
+    // Rounding to 128 byte block.
     size_t round = 128 - (codesize % 128);
     if (round != 128)
-    {
-        char aux [128] = {};
-        out.write(aux, round);
-    }
+        image.fill(0, round);
 
+    image.write(out);
     check_out(out);
 }
 
@@ -6731,37 +9158,48 @@ void Asm::emittap(std::ostream & out)
     tap::CodeBlock codeblock(codesize, mem + minused);
 
     // Write the file.
-    headcodeblock.write(out);
-    codeblock.write(out);
+    ByteBuffer image;
+    headcodeblock.write(image);
+    codeblock.write(image);
+    writebankblocks(* this, image);
 
+    image.write(out);
     check_out(out);
 }
 
 void Asm::emittrs(std::ostream & out)
 {
     pin->message_emit("TRS");
+    pin->checknobanks("TRS");
 
     const byte * const mem = pin->getmem();
     address addr = getminused();
     address remain = getcodesize();
+    ByteBuffer image;
     while (remain > 256)
     {
         // Data of 256 bytes
-        out << byte(1) << byte(2) << byte (addr & 0xFF) << byte(addr >> 8);
-        out.write(reinterpret_cast<const char *>(mem + addr), 256);
+        image.put(1);
+        image.put(2);
+        image.putword(addr);
+        image.append(mem + addr, 256);
         addr += 256;
         remain -= 256;
     }
     if (remain > 0)
     {
         // Data of remain bytes
-        out << byte(1) << byte(remain + 2) << byte (addr & 0xFF) << byte(addr >> 8);
-        out.write(reinterpret_cast<const char *>(mem + addr), remain);
+        image.put(1);
+        image.put(byte(remain + 2) );
+        image.putword(addr);
+        image.append(mem + addr, remain);
     }
-    const address entry = getentrypoint();
     // Transfer address record, also marks the end.
-    out << byte(2) << byte(2) << byte (entry & 0xFF) << byte(entry >> 8);
+    image.put(2);
+    image.put(2);
+    image.putword(getentrypoint() );
 
+    image.write(out);
     check_out(out);
 }
 
@@ -6769,9 +9207,14 @@ void Asm::emittzx(std::ostream & out)
 {
     pin->message_emit("TZX");
 
-    tzx::writefilehead(out);
+    spectrum::checkbanks(* this);
+
+    ByteBuffer tape;
+    tzx::writefilehead(tape);
 
-    tzx::write_tzx_code(*this, out);
+    tzx::write_tzx_code(*this, tape);
+    pin->message_loadtime(tzx::loadtime(tape) );
+    tape.write(out);
     check_out(out);
 }
 
@@ -6779,9 +9222,12 @@ void Asm::emitcdt(std::ostream & out)
 {
     pin->message_emit("CDT");
 
-    tzx::writefilehead(out);
+    ByteBuffer tape;
+    tzx::writefilehead(tape);
 
-    cpc::write_cdt_code(* this, out);
+    cpc::write_cdt_code(* this, tape);
+    pin->message_loadtime(tzx::loadtime(tape) );
+    tape.write(out);
     check_out(out);
 }
 
@@ -6800,13 +9246,16 @@ void Asm::emitcdtbas(std::ostream & out)
     head.setblock(1);
     head.setblocklength(basicsize);
 
-    tzx::writefilehead(out);
+    const tzx::Timing & timing = tzx::cpctiming(getspeed() );
+    ByteBuffer tape;
+
+    tzx::writefilehead(tape);
 
     // Write header.
 
-    tzx::writeturboblockhead(out, 263);
+    tzx::writeturboblockhead(tape, 263, timing);
 
-    head.write(out);
+    head.write(tape);
 
     // Write Basic.
 
@@ -6816,69 +9265,215 @@ void Asm::emitcdtbas(std::ostream & out)
     tzxdatalen*= maxsubblock + 2;
     tzxdatalen+= 5;
 
-    tzx::writeturboblockhead(out, tzxdatalen);
+    tzx::writeturboblockhead(tape, tzxdatalen, timing);
 
-    out.put(0x16);  // Data block identifier.
+    tape.put(0x16);  // Data block identifier.
 
-    out.write(basic.data(), basicsize);
-    for (address n = basicsize ; (n % maxsubblock) != 0; ++n)
-        out.put('\0');
-    const address crc = cpc::crc
-        (reinterpret_cast <const unsigned char *> (basic.data() ),
+    // The loader is less than a chunk.
+    cpc::writechunk(tape, reinterpret_cast <const byte *> (basic.data() ),
         basicsize);
-    out.put(hibyte(crc) ); // CRC in hi-lo format.
-    out.put(lobyte(crc) );
 
-    out.put('\xFF');
-    out.put('\xFF');
-    out.put('\xFF');
-    out.put('\xFF');
+    tape.fill(0xFF, 4);
 
-    //pin->writecdtcode(out);
-    cpc::write_cdt_code(* this, out);
+    cpc::write_cdt_code(* this, tape);
+    pin->message_loadtime(tzx::loadtime(tape) );
+    tape.write(out);
     check_out(out);
 }
 
+namespace
+{
+
+// Code block loaded by the basic loader of tapbas and tzxbas: the
+// code generated, or compressed with the decompressor in front of
+// it when using --compress.
+
+class BasicCode
+{
+public:
+    BasicCode(const Asm & as, const Asm::In & in);
+    std::string loader(const Asm & as) const;
+    std::string loader(const std::vector <byte> & turbo) const;
+
+    address start;
+    address size;
+    const byte * data;
+private:
+    address clear;
+    bool hasusr;
+    address usr;
+    std::unique_ptr <spectrum::CompressedCode> pcode;
+};
+
+BasicCode::BasicCode(const Asm & as, const Asm::In & in) :
+    start(as.getminused() ),
+    size(as.getcodesize() ),
+    data(as.getmem() + start),
+    clear(start - 1),
+    hasusr(as.hasentrypoint() ),
+    usr(as.getentrypoint() )
+{
+    if (in.iscompress() )
+    {
+        in.checknobanks("compressed");
+        pcode.reset(new spectrum::CompressedCode(as) );
+        in.message_compress(* pcode);
+        start = pcode->getstart();
+        size = pcode->getsize();
+        data = pcode->getdata();
+        clear = pcode->getclear();
+        hasusr = true;
+        usr = start;
+    }
+}
+
+std::string BasicCode::loader(const Asm & as) const
+{
+    // The loader of the code as generated also loads the banks.
+    if (pcode)
+        return spectrum::basicloader(* pcode);
+    else
+        return spectrum::basicloader(as);
+}
+
+std::string BasicCode::loader(const std::vector <byte> & turbo) const
+{
+    return spectrum::basicloader(clear, hasusr, usr, turbo);
+}
+
+} // namespace
+
 void Asm::emittapbas(std::ostream & out)
 {
     pin->showdebugmsg("Emiting TZX with basic loader");
 
     // Prepare the data.
 
-    std::string basic(spectrum::basicloader(* this) );
+    const BasicCode code(* this, * pin);
+    std::string basic(code.loader(* this) );
     tap::BasicHeader basicheadblock(basic);
     tap::BasicBlock basicblock(basic);
 
+    pin->message_emit("TAP");
+
+    tap::CodeHeader headcodeblock(code.start, code.size,
+        pin->getheadername() );
+    tap::CodeBlock codeblock(code.size, code.data);
+
     // Write the file.
 
-    basicheadblock.write(out);
-    basicblock.write(out);
+    ByteBuffer image;
+    basicheadblock.write(image);
+    basicblock.write(image);
+    headcodeblock.write(image);
+    codeblock.write(image);
+    writebankblocks(* this, image);
 
-    emittap(out);
+    image.write(out);
+    check_out(out);
 }
 
 void Asm::emittzxbas(std::ostream & out)
 {
     pin->showdebugmsg("Emiting TZX with basic loader");
 
-    // Prepare the data.
+    // Prepare the data: the code block, compressed or not, and the
+    // basic loader for it, with a turbo loader if not using the
+    // standard speed.
 
-    std::string basic(spectrum::basicloader(*this) );
+    const BasicCode code(* this, * pin);
+
+    const bool turbo = ! tzx::isstandardspeed(getspeed() );
+    const tzx::Timing & timing = tzx::spectrumtiming(getspeed() );
+    std::string basic;
+    if (turbo)
+    {
+        pin->checknobanks("turbo");
+        basic = code.loader(
+            spectrum::turboloader(code.start, code.size, timing) );
+    }
+    else
+        basic = code.loader(* this);
     tap::BasicHeader basicheadblock(basic);
     tap::BasicBlock basicblock(basic);
+    tap::CodeHeader headcodeblock(code.start, code.size,
+        pin->getheadername() );
+    tap::CodeBlock codeblock(code.size, code.data);
 
     // Write the file.
 
-    tzx::writefilehead(out);
+    ByteBuffer tape;
+
+    tzx::writefilehead(tape);
+
+    tzx::writestandardblockhead(tape);
+    basicheadblock.write(tape);
 
-    tzx::writestandardblockhead(out);
-    basicheadblock.write(out);
+    tzx::writestandardblockhead(tape);
+    basicblock.write(tape);
 
-    tzx::writestandardblockhead(out);
-    basicblock.write(out);
+    if (turbo)
+    {
+        // The turbo loader does not use a header.
+        tzx::writeturboblockhead(tape, code.size + 2, timing);
+        codeblock.writecontent(tape);
+    }
+    else
+    {
+        tzx::writestandardblockhead(tape);
+        headcodeblock.write(tape);
+
+        tzx::writestandardblockhead(tape);
+        codeblock.write(tape);
+
+        const std::vector <BankCode> banks = getbanks();
+        for (size_t i = 0; i < banks.size(); ++i)
+        {
+            const BankCode & bank = banks [i];
+            tap::CodeHeader bankhead(bank.start, bank.size,
+                pin->getheadername() );
+            tap::CodeBlock bankblock(bank.size, bank.data);
+
+            tzx::writestandardblockhead(tape);
+            bankhead.write(tape);
+
+            tzx::writestandardblockhead(tape);
+            bankblock.write(tape);
+        }
+    }
+
+    pin->message_loadtime(tzx::loadtime(tape) );
+    tape.write(out);
+    check_out(out);
+}
+
+void Asm::emitsna(std::ostream & out)
+{
+    pin->message_emit("SNA");
+    spectrum::checkbanks(* this);
 
-    //pin->writetzxcode(out);
-    tzx::write_tzx_code(* this, out);
+    std::unique_ptr <snapshot::Machine> machine(new snapshot::Machine);
+    pin->setsnapshot(* machine);
+
+    ByteBuffer image;
+    snapshot::writesna(* machine, image);
+
+    image.write(out);
+    check_out(out);
+}
+
+void Asm::emitz80snap(std::ostream & out)
+{
+    pin->message_emit("Z80");
+    spectrum::checkbanks(* this);
+
+    std::unique_ptr <snapshot::Machine> machine(new snapshot::Machine);
+    pin->setsnapshot(* machine);
+
+    ByteBuffer image;
+    snapshot::writez80(* machine, image);
+
+    image.write(out);
     check_out(out);
 }
 
@@ -6890,9 +9485,12 @@ void Asm::emithex(std::ostream & out)
 void Asm::emitamsdos(std::ostream & out)
 {
     pin->message_emit("Amsdos");
+    pin->checknobanks("Amsdos");
 
-    cpc::write_amsdos(* this, out);
+    ByteBuffer image;
+    cpc::write_amsdos(* this, image);
 
+    image.write(out);
     check_out(out);
 }
 
@@ -6911,11 +9509,50 @@ void Asm::emitsdrel(std::ostream & out)
     pin->emitsdrel(out);
 }
 
+void Asm::emitrelobj(std::ostream & out)
+{
+    pin->emitrelobj(out);
+}
+
 void Asm::emitmsx(std::ostream & out)
 {
     pin->emitmsx(out);
 }
 
+namespace
+{
+
+// Output to the end of a buffer.
+
+class BufferOut : public std::streambuf
+{
+public:
+    BufferOut(std::vector <byte> & buffer_n) : buffer(buffer_n) { }
+protected:
+    int overflow(int c)
+    {
+        if (c != EOF)
+            buffer.push_back(static_cast <byte> (c) );
+        return c;
+    }
+    std::streamsize xsputn(const char * s, std::streamsize n)
+    {
+        buffer.insert(buffer.end(), s, s + n);
+        return n;
+    }
+private:
+    std::vector <byte> & buffer;
+};
+
+} // namespace
+
+void Asm::emit(emitfunc_t emitfunc, std::vector <byte> & buffer)
+{
+    BufferOut buf(buffer);
+    std::ostream out(& buf);
+    (this->* emitfunc) (out);
+}
+
 void Asm::dumppublic(std::ostream & out)
 {
     pin->dumppublic(out);
@@ -6926,6 +9563,81 @@ void Asm::dumpsymbol(std::ostream & out)
     pin->dumpsymbol(out);
 }
 
+void Asm::dumpmap(std::ostream & out)
+{
+    pin->dumpmap(out);
+}
+
+void Asm::trace()
+{
+    pin->trace();
+}
+
+void Asm::listing()
+{
+    pin->listing();
+}
+
+void Asm::dumplisting(std::ostream & out)
+{
+    pin->dumplisting(out);
+}
+
+void Asm::sourcemap()
+{
+    pin->sourcemap();
+}
+
+void Asm::dumpsourcemap(std::ostream & out)
+{
+    pin->dumpsourcemap(out);
+}
+
+void Asm::dumpsourceindex(std::ostream & out)
+{
+    pin->dumpsourceindex(out);
+}
+
+void Asm::setsymbolformat(SymbolFormat format)
+{
+    pin->setsymbolformat(format);
+}
+
+void Asm::beginphase(const std::string & name, const std::string & file)
+{
+    pin->beginphase(name, file);
+}
+
+void Asm::endphase()
+{
+    pin->endphase();
+}
+
+void Asm::addemitted(size_t size)
+{
+    pin->addemitted(size);
+}
+
+void Asm::dumpstats(std::ostream & out, bool json)
+{
+    pin->dumpstats(out, json);
+}
+
+void Asm::dumptrace(std::ostream & out)
+{
+    pin->dumptrace(out);
+}
+
+void Asm::resetstats()
+{
+    pin->resetstats();
+}
+
+double Asm::phasetime(const std::string & name) const
+{
+    return pin->phasetime(name);
+}
+
 address Asm::getvalue(const std::string & varname)
 {
     return pin->getvalue(varname);
@@ -6952,6 +9664,15 @@ LocalLevel::~LocalLevel()
 pasmo_impl::MacroFrameBase::~MacroFrameBase()
 {
     TRMACRO("Exit macro frame\n");
+    // Only the expansions big enough to matter are kept in the trace.
+    if (asmin.tracemode)
+    {
+        if (asmin.nlines - prevlines >= tracemacrolines)
+            asmin.endphase();
+        else
+            asmin.cancelphase();
+    }
+
     // Clear the local frame, including unclosed PROCs and autolocals.
     while (dynamic_cast <MacroLevel *> (asmin.localstack.top() ) == nullptr)
         asmin.localstack.pop();
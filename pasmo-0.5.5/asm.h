@@ -1,9 +1,14 @@
+#ifndef INCLUDE_ASM_H
+#define INCLUDE_ASM_H
+
 // asm.h
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "pasmotypes.h"
+#include "asmio.h"
 
 class Tokenizer;
 
@@ -16,7 +21,12 @@ public:
     void verbose();
     enum DebugType { NoDebug, DebugSecondPass, DebugAll };
     void setdebugtype(DebugType type);
+    // Format of the lines of dumpsymbol and dumppublic.
+    enum SymbolFormat { SymbolPasmo, SymbolSjasm, SymbolNocash };
+    void setsymbolformat(SymbolFormat format);
     void errtostdout();
+    // Write the warnings to out instead of the standard error.
+    void setwarnstream(std::ostream & out);
     void setbase(address addr);
     void caseinsensitive();
     void autolocal();
@@ -26,18 +36,48 @@ public:
     void setpass(int npass);
     void setpass3();
     void setwerror();
+    void relax();
+    void dropunused();
+    void compress();
+    // Continue after an error until n errors are found, 0 for no
+    // limit, and show all them sorted by file and line.
+    void setmaxerrors(size_t n);
+    void setspeed(const std::string & speed);
+    // Snapshot in which the code is placed by emitsna and
+    // emitz80snap, instead of the state after the reset.
+    void setsnapbase(const std::string & filename);
 
     void showerrorinfo(std::ostream & os,
         size_t nline, const std::string message) const;
 
     void addincludedir(const std::string & dirname);
+    // Read the source and the INCLUDE and INCBIN files with the
+    // provider instead of from the file system.
+    void setfileprovider(const AsmFileProvider & provider);
+    // Keep the errors and warnings instead of showing them.
+    void collectdiagnostics();
+    const std::vector <AsmDiagnostic> & getdiagnostics() const;
     void addpredef(const std::string & predef);
     const std::string & getheadername() const;
+    const std::string & getspeed() const;
     void setheadername(const std::string & headername_n);
 
     void parseline(Tokenizer & tz);
     void loadfile(const std::string & filename);
     void processfile();
+    // Load and process the file, false if there are errors.
+    bool assemble(const std::string & filename);
+
+    // Keep checkpoints each interval lines, to assemble again after
+    // reloadfile from the last one before the first line changed.
+    void incremental(size_t interval);
+    void reloadfile(const std::string & filename);
+    size_t getresumeline(int npass) const;
+    // Paths of the source and binary files opened.
+    const std::vector <std::string> & getopenedfiles() const;
+    // Paths searched for them in the include path before finding
+    // them, that did not exist.
+    const std::vector <std::string> & getmissingfiles() const;
 
     void emitobject(std::ostream & out);
     void emitplus3dos(std::ostream & out);
@@ -51,6 +91,9 @@ public:
     void emittzxbas(std::ostream & out);
     void emitcdtbas(std::ostream & out);
 
+    void emitsna(std::ostream & out);
+    void emitz80snap(std::ostream & out);
+
     void emithex(std::ostream & out);
     void emitamsdos(std::ostream & out);
 
@@ -58,10 +101,38 @@ public:
     void emitcmd(std::ostream & out);
 
     void emitsdrel(std::ostream & out);
+    void emitrelobj(std::ostream & out);
 
     void emitmsx(std::ostream & out);
+
+    // Append the output of one of the emit or dump functions
+    // to the buffer.
+    typedef void (Asm::* emitfunc_t) (std::ostream &);
+    void emit(emitfunc_t emitfunc, std::vector <byte> & buffer);
+
     void dumppublic(std::ostream & out);
     void dumpsymbol(std::ostream & out);
+    void dumpmap(std::ostream & out);
+
+    void trace();
+    // Keep the listing of the last pass for dumplisting.
+    void listing();
+    void dumplisting(std::ostream & out);
+    // Keep the source line of each address of the last pass for
+    // dumpsourcemap, as text, and dumpsourceindex, in binary.
+    void sourcemap();
+    void dumpsourcemap(std::ostream & out);
+    void dumpsourceindex(std::ostream & out);
+    void beginphase(const std::string & name,
+        const std::string & file = std::string() );
+    void endphase();
+    void addemitted(size_t size);
+    void dumpstats(std::ostream & out, bool json);
+    void dumptrace(std::ostream & out);
+    double phasetime(const std::string & name) const;
+    // Start the phases and counters again, for each assembly
+    // of the same file in watch mode.
+    void resetstats();
 
     const byte * getmem() const;
     byte peekbyte(address addr) const;
@@ -72,6 +143,18 @@ public:
     bool hasentrypoint() const;
     address getentrypoint() const;
     void writebincode(std::ostream & out) const;
+
+    // Code generated after .BANK n, for each bank used in order of
+    // number: the address of its first byte with the bank paged in,
+    // its size and the data.
+    struct BankCode
+    {
+        byte bank;
+        address start;
+        address size;
+        const byte * data;
+    };
+    std::vector <BankCode> getbanks() const;
 private:
     Asm(const Asm & a); // Forbidden
     void operator = (const Asm &); // Forbidden
@@ -83,4 +166,6 @@ private:
     In * pin;
 };
 
+#endif
+
 // End
@@ -39,6 +39,16 @@ IdentifierExpected::IdentifierExpected(size_t linepos, const Token & tok) :
         tok.str() + "' found")
 { }
 
+UndefinedVar::UndefinedVar(size_t linepos, const std::string & varname) :
+    AsmError(linepos, "Symbol '" + varname + "' is undefined"),
+    name(varname)
+{ }
+
+const std::string & UndefinedVar::getname() const
+{
+    return name;
+}
+
 //--------------------------------------------------------------
 
 AsmError DivisionByZero(size_t linepos)
@@ -61,11 +71,6 @@ AsmError Length1Required(size_t linepos)
     return AsmError(linepos, "Invalid literal, length 1 required");
 }
 
-AsmError UndefinedVar(size_t linepos, const std::string & varname)
-{
-    return AsmError(linepos, "Symbol '" + varname + "' is undefined");
-}
-
 AsmError EndLineExpected(size_t linepos, const Token & tok)
 {
     return AsmError(linepos, "End line expected but '" +
@@ -43,11 +43,18 @@ public:
     IdentifierExpected(size_t linepos, const Token & tok);
 };
 
+class UndefinedVar : public AsmError
+{
+    const std::string name;
+public:
+    UndefinedVar(size_t linepos, const std::string & varname);
+    const std::string & getname() const;
+};
+
 AsmError DivisionByZero(size_t linepos);
 AsmError EQUwithoutlabel(size_t linepos);
 AsmError DEFLwithoutlabel(size_t linepos);
 AsmError Length1Required(size_t linepos);
-AsmError UndefinedVar(size_t linepos, const std::string & varname);
 AsmError EndLineExpected(size_t linepos, const Token & tok);
 AsmError ValueExpected(size_t linepos, const Token & tok);
 AsmError MacroExpected(size_t linepos, const std::string & name);
@@ -4,6 +4,9 @@
 #include "asmerror.h"
 
 #include <vector>
+#include <map>
+#include <sstream>
+#include <memory>
 #include <stdexcept>
 #include <algorithm>
 
@@ -35,18 +38,25 @@ AsmError InvalidInclude(size_t linepos, const Token & tok)
 
 //**************************************************************
 
+// A line is a range of the tokens and of the text stored in its FileRef.
+// 32 bit positions are used to keep it small.
+
 class FileLine
 {
-    const std::string text;
-    Tokenizer tkz;
-    const size_t linenum;
+    unsigned int tokenpos;
+    unsigned int ntokens;
+    unsigned int textpos;
+    unsigned int textlen;
+    unsigned int linenum;
 public:
-    FileLine(const std::string & text_n, const Tokenizer & tkz_n,
-        size_t linenum_n);
+    FileLine(size_t tokenpos_n, size_t ntokens_n,
+        size_t textpos_n, size_t textlen_n, size_t linenum_n);
     bool empty() const;
     size_t numline() const;
-    Tokenizer & gettkz();
-    const std::string & getstrline() const;
+    size_t gettokenpos() const;
+    size_t getntokens() const;
+    size_t gettextpos() const;
+    size_t gettextlen() const;
 };
 
 typedef std::vector <FileLine> filelines_t;
@@ -56,26 +66,32 @@ typedef std::vector <FileLine> filelines_t;
 class FileRef
 {
     const std::string filename;
+    const bool nocase;
     filelines_t lines;
+    std::vector <Token> tokens;
+    std::string text;
     const size_t l_begin;
     size_t l_end;
 
-    FileLine & line(size_t n);
     const FileLine & line(size_t n) const;
 public:
-    FileRef(const std::string & name, size_t linebeg);
+    FileRef(const std::string & name, bool nocase_n, size_t linebeg);
+    FileRef(const FileRef & fr, size_t linebeg);
     void setend(size_t n);
 
     size_t linebegin() const;
     size_t lineend() const;
     std::string name() const;
 
+    size_t numlines() const;
     bool lineempty(size_t n) const;
     size_t numline(size_t n) const;
-    Tokenizer & gettkz(size_t n);
-    const std::string & getstrline(size_t n) const;
+    bool sametext(const std::vector <std::string> & filelines) const;
+    Tokenizer gettkz(size_t n) const;
+    std::string getstrline(size_t n) const;
+    size_t storagesize() const;
 
-    void pushline(const std::string & text, const Tokenizer & tkz,
+    void pushline(const std::string & linetext, const Tokenizer & tkz,
         size_t realnumline);
 };
 
@@ -106,19 +122,74 @@ size_t LineContent::getfilenum() const
     return filenum;
 }
 
+//--------------------------------------------------------------
+
+// Consecutive lines of a file that are consecutive in the program.
+// Including again a file already loaded adds the spans of its
+// lines instead of one entry for each line.
+
+class LineSpan
+{
+    size_t linebegin;
+    size_t filenum;
+    size_t fileline;
+    size_t count;
+public:
+    LineSpan(size_t linebegin_n, size_t filenum_n, size_t fileline_n,
+        size_t count_n);
+    size_t begin() const;
+    size_t end() const;
+    LineContent getline(size_t nline) const;
+    bool extend(size_t filenum_n, size_t fileline_n, size_t count_n);
+};
+
+LineSpan::LineSpan(size_t linebegin_n, size_t filenum_n, size_t fileline_n,
+        size_t count_n) :
+    linebegin(linebegin_n),
+    filenum(filenum_n),
+    fileline(fileline_n),
+    count(count_n)
+{ }
+
+size_t LineSpan::begin() const
+{
+    return linebegin;
+}
+
+size_t LineSpan::end() const
+{
+    return linebegin + count;
+}
+
+LineContent LineSpan::getline(size_t nline) const
+{
+    ASSERT(nline >= linebegin && nline < end() );
+    return LineContent(filenum, fileline + (nline - linebegin) );
+}
+
+bool LineSpan::extend(size_t filenum_n, size_t fileline_n, size_t count_n)
+{
+    if (filenum_n != filenum || fileline_n != fileline + count)
+        return false;
+    count += count_n;
+    return true;
+}
+
 //**************************************************************
 
-FileLine::FileLine(const std::string & text_n, const Tokenizer & tkz_n,
-        size_t linenum_n) :
-    text(text_n),
-    tkz(tkz_n),
+FileLine::FileLine(size_t tokenpos_n, size_t ntokens_n,
+        size_t textpos_n, size_t textlen_n, size_t linenum_n) :
+    tokenpos(tokenpos_n),
+    ntokens(ntokens_n),
+    textpos(textpos_n),
+    textlen(textlen_n),
     linenum(linenum_n)
 {
 }
 
 bool FileLine::empty() const
 {
-    return tkz.empty();
+    return ntokens == 0;
 }
 
 size_t FileLine::numline() const
@@ -126,20 +197,40 @@ size_t FileLine::numline() const
     return linenum;
 }
 
-Tokenizer & FileLine::gettkz()
+size_t FileLine::gettokenpos() const
+{
+    return tokenpos;
+}
+
+size_t FileLine::getntokens() const
 {
-    return tkz;
+    return ntokens;
 }
 
-const std::string & FileLine::getstrline() const
+size_t FileLine::gettextpos() const
 {
-    return text;
+    return textpos;
+}
+
+size_t FileLine::gettextlen() const
+{
+    return textlen;
 }
 
 //--------------------------------------------------------------
 
-FileRef::FileRef(const std::string & name, size_t linebeg) :
+FileRef::FileRef(const std::string & name, bool nocase_n, size_t linebeg) :
     filename(name),
+    nocase(nocase_n),
+    l_begin(linebeg)
+{ }
+
+FileRef::FileRef(const FileRef & fr, size_t linebeg) :
+    filename(fr.filename),
+    nocase(fr.nocase),
+    lines(fr.lines),
+    tokens(fr.tokens),
+    text(fr.text),
     l_begin(linebeg)
 { }
 
@@ -163,14 +254,31 @@ std::string FileRef::name() const
     return filename;
 }
 
-FileLine & FileRef::line(size_t n)
+const FileLine & FileRef::line(size_t n) const
 {
     return lines.at(n);
 }
 
-const FileLine & FileRef::line(size_t n) const
+size_t FileRef::numlines() const
 {
-    return lines.at(n);
+    return lines.size();
+}
+
+bool FileRef::sametext(const std::vector <std::string> & filelines) const
+{
+    // Compare with the lines read from the file, skipping the
+    // lines added at the end of each include.
+    size_t n = 0;
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        const Tokenizer tz = gettkz(i);
+        if (tz.begin() != tz.end() && tz.begin()->type() == TypeEndOfInclude)
+            continue;
+        if (n >= filelines.size() || getstrline(i) != filelines [n] )
+            return false;
+        ++n;
+    }
+    return n == filelines.size();
 }
 
 bool FileRef::lineempty(size_t n) const
@@ -183,20 +291,41 @@ size_t FileRef::numline(size_t n) const
     return line(n).numline();
 }
 
-Tokenizer & FileRef::gettkz(size_t n)
+Tokenizer FileRef::gettkz(size_t n) const
 {
-    return line(n).gettkz();
+    const FileLine & fl = line(n);
+    const Token * const first = tokens.data() + fl.gettokenpos();
+    return Tokenizer(first, first + fl.getntokens(), nocase);
 }
 
-const std::string & FileRef::getstrline(size_t n) const
+std::string FileRef::getstrline(size_t n) const
 {
-    return line(n).getstrline();
+    const FileLine & fl = line(n);
+    return text.substr(fl.gettextpos(), fl.gettextlen() );
 }
 
-void FileRef::pushline(const std::string & text, const Tokenizer & tkz,
+size_t FileRef::storagesize() const
+{
+    size_t size = lines.capacity() * sizeof(FileLine) +
+        tokens.capacity() * sizeof(Token) + text.capacity();
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        // Count the string contents that does not fit in the
+        // std::string object.
+        const std::string::size_type l = tokens [i].rawstr().size();
+        if (l >= sizeof(std::string) )
+            size += l + 1;
+    }
+    return size;
+}
+
+void FileRef::pushline(const std::string & linetext, const Tokenizer & tkz,
     size_t realnumline)
 {
-    FileLine fl(text, tkz, realnumline);
+    FileLine fl(tokens.size(), tkz.size(),
+        text.size(), linetext.size(), realnumline);
+    tokens.insert(tokens.end(), tkz.begin(), tkz.end() );
+    text += linetext;
     lines.push_back(fl);
 }
 
@@ -212,46 +341,99 @@ public:
     void delref();
 
     size_t numlines() const;
+    size_t numtokens() const;
     //size_t numfiles() const;
 
+    size_t storagesize() const;
+
     bool lineempty(size_t n) const;
-    Tokenizer & gettkz(size_t n);
-    const std::string & getstrline(size_t n) const;
+    Tokenizer gettkz(size_t n) const;
+    std::string getstrline(size_t n) const;
 
     void addincludedir(const std::string & dirname);
-    void openis(size_t linepos, std::ifstream & is,
-        const std::string & filename, std::ios::openmode mode) const;
+    void setfileprovider(const AsmFileProvider & provider_n);
+    void collectdiagnostics();
+    const std::vector <AsmDiagnostic> & getdiagnostics() const;
+    void setstats(Stats * pstats_n);
+    void copysettings(In & in);
+    bool sameline(size_t n, const In & in) const;
+    void releaseprevious();
+    const std::vector <std::string> & getopenedfiles() const;
+    const std::vector <std::string> & getmissingfiles() const;
+    std::string readfile(size_t linepos, const std::string & filename,
+        std::string & content, std::ios::openmode mode) const;
+    std::string readbinfile(size_t linepos, const std::string & filename,
+        std::string & content) const;
+    bool readpath(const std::string & path,
+        std::string & content, std::ios::openmode mode) const;
     void copyfile(FileRef & fr, std::ostream & outverb);
+    void reusefile(const FileRef & fr, size_t filenum, bool nocase,
+        std::ostream & outverb, std::ostream & outerr);
     void loadfile(size_t linepos, const std::string & filename, bool nocase,
         std::ostream & outverb, std::ostream& outerr);
 
+    bool getlineinfo(size_t nline,
+        std::string & filename, size_t & numline) const;
     void showerrorinfo(std::ostream & os,
         size_t nline, const std::string message) const;
+    void showerror(std::ostream & os, const std::string & message) const;
     void showlineinfo(std::ostream & os, size_t nline) const;
     void showwarning(std::ostream & os,
         size_t nline, const std::string message) const;
 private:
+    void adddiagnostic(AsmDiagnostic::Kind kind,
+        size_t nline, const std::string & message) const;
     In(const In &); // Forbidden.
     In & operator = (const In &); // Forbidden.
 
     const FileRef & getfile(size_t n) const;
     FileRef & getfile(size_t n);
 
-    const LineContent & getline(size_t n) const;
-    LineContent & getline(size_t n);
+    LineContent getline(size_t n) const;
 
     size_t numrefs;
+    size_t ntokens;
 
-    typedef std::vector <LineContent> vlinecont_t;
-    vlinecont_t vlinecont;
+    // Where to record the time spent loading each include, if not null.
+    Stats * pstats;
+
+    typedef std::vector <LineSpan> vlinespan_t;
+    vlinespan_t vlinespan;
+    size_t nlines;
+    // Span of the last line searched, lines are usually
+    // accessed in order.
+    mutable size_t lastspan;
 
     std::vector <FileRef> vfileref;
 
+    // Files of the previous load while loading again.
+    In * pprevious;
+    const FileRef * findprevious(const std::string & filename) const;
+
+    // Paths of the files opened, kept between loads.
+    mutable std::vector <std::string> openedfiles;
+    // Paths tried in the include path before finding a file.
+    mutable std::vector <std::string> missingfiles;
+
+    // Path and content of the binary files read in this load,
+    // by the name used to include them.
+    typedef std::map <std::string, std::pair <std::string, std::string> >
+        binfiles_t;
+    mutable binfiles_t binfiles;
+
     void pushline(size_t linenum, size_t file);
+    void pushspan(size_t filenum, size_t fileline, size_t count);
 
     // ******** Paths for include ************
 
     std::vector <std::string> includepath;
+
+    // Reads the files instead of the file system if set.
+    AsmFileProvider provider;
+
+    // Errors and warnings kept instead of shown if not null,
+    // shared with the next loads.
+    std::shared_ptr <std::vector <AsmDiagnostic> > pdiagnostics;
 };
 
 //--------------------------------------------------------------
@@ -259,6 +441,11 @@ private:
 AsmFile::In::In()
 {
     numrefs = 1;
+    ntokens = 0;
+    pstats = 0;
+    nlines = 0;
+    lastspan = 0;
+    pprevious = 0;
 }
 
 void AsmFile::In::addref()
@@ -270,12 +457,28 @@ void AsmFile::In::delref()
 {
     --numrefs;
     if (numrefs == 0)
+    {
+        releaseprevious();
         delete this;
+    }
 }
 
 size_t AsmFile::In::numlines() const
 {
-    return vlinecont.size();
+    return nlines;
+}
+
+size_t AsmFile::In::numtokens() const
+{
+    return ntokens;
+}
+
+size_t AsmFile::In::storagesize() const
+{
+    size_t size = vlinespan.capacity() * sizeof(LineSpan);
+    for (size_t i = 0; i < vfileref.size(); ++i)
+        size += vfileref [i].storagesize();
+    return size;
 }
 
 #if 0
@@ -297,44 +500,118 @@ FileRef & AsmFile::In::getfile(size_t n)
     return vfileref [n];
 }
 
-const LineContent & AsmFile::In::getline(size_t n) const
+LineContent AsmFile::In::getline(size_t n) const
 {
     ASSERT(n < numlines() );
-    return vlinecont [n];
-}
 
-LineContent & AsmFile::In::getline(size_t n)
-{
-    ASSERT(n < numlines() );
-    return vlinecont [n];
+    if (lastspan < vlinespan.size() )
+    {
+        const LineSpan & last = vlinespan [lastspan];
+        if (n >= last.begin() )
+        {
+            if (n < last.end() )
+                return last.getline(n);
+            if (lastspan + 1 < vlinespan.size() &&
+                    n < vlinespan [lastspan + 1].end() )
+            {
+                ++lastspan;
+                return vlinespan [lastspan].getline(n);
+            }
+        }
+    }
+
+    auto const it = std::upper_bound(vlinespan.begin(), vlinespan.end(), n,
+        [] (size_t nline, const LineSpan & span)
+            { return nline < span.begin(); } );
+    ASSERT(it != vlinespan.begin() );
+    lastspan = (it - vlinespan.begin() ) - 1;
+    return vlinespan [lastspan].getline(n);
 }
 
 bool AsmFile::In::lineempty(size_t n) const
 {
     ASSERT(n < numlines() );
 
-    //return vlinecont [n].empty();
-    const LineContent & lc = getline(n);
+    const LineContent lc = getline(n);
     return getfile(lc.getfilenum() ).lineempty(lc.getfileline() );
 }
 
-Tokenizer & AsmFile::In::gettkz(size_t n)
+Tokenizer AsmFile::In::gettkz(size_t n) const
 {
     ASSERT(n < numlines() );
 
-    //return vlinecont [n].gettkz();
-    LineContent & lc = getline(n);
+    const LineContent lc = getline(n);
     return getfile(lc.getfilenum() ).gettkz(lc.getfileline() );
 }
 
-const std::string & AsmFile::In::getstrline(size_t n) const
+std::string AsmFile::In::getstrline(size_t n) const
 {
     ASSERT(n < numlines() );
 
-    const LineContent & lc = getline(n);
+    const LineContent lc = getline(n);
     return getfile(lc.getfilenum() ).getstrline(lc.getfileline() );
 }
 
+void AsmFile::In::setstats(Stats * pstats_n)
+{
+    pstats = pstats_n;
+}
+
+void AsmFile::In::copysettings(In & in)
+{
+    pstats = in.pstats;
+    includepath = in.includepath;
+    openedfiles = in.openedfiles;
+    missingfiles = in.missingfiles;
+    provider = in.provider;
+    pdiagnostics = in.pdiagnostics;
+    pprevious = & in;
+    in.addref();
+}
+
+const FileRef * AsmFile::In::findprevious(const std::string & filename) const
+{
+    if (pprevious == 0)
+        return 0;
+    const std::vector <FileRef> & vprev = pprevious->vfileref;
+    auto const it = std::find_if(vprev.begin(), vprev.end(),
+            [& filename] (const auto & ref) { return ref.name() == filename; } );
+    return it == vprev.end() ? 0 : & * it;
+}
+
+void AsmFile::In::releaseprevious()
+{
+    if (pprevious != 0)
+    {
+        pprevious->delref();
+        pprevious = 0;
+    }
+}
+
+const std::vector <std::string> & AsmFile::In::getopenedfiles() const
+{
+    return openedfiles;
+}
+
+const std::vector <std::string> & AsmFile::In::getmissingfiles() const
+{
+    return missingfiles;
+}
+
+bool AsmFile::In::sameline(size_t n, const In & in) const
+{
+    const LineContent lc = getline(n);
+    const LineContent lcin = in.getline(n);
+    const FileRef & fr = getfile(lc.getfilenum() );
+    const FileRef & frin = in.getfile(lcin.getfilenum() );
+    const size_t l = lc.getfileline();
+    const size_t lin = lcin.getfileline();
+    return fr.name() == frin.name() &&
+        fr.numline(l) == frin.numline(lin) &&
+        fr.lineempty(l) == frin.lineempty(lin) &&
+        fr.getstrline(l) == frin.getstrline(lin);
+}
+
 void AsmFile::In::addincludedir(const std::string & dirname)
 {
     if (const std::string::size_type l = dirname.size())
@@ -347,30 +624,89 @@ void AsmFile::In::addincludedir(const std::string & dirname)
     }
 }
 
-void AsmFile::In::openis(size_t linepos, std::ifstream & is,
-    const std::string & filename, std::ios::openmode mode) const
+void AsmFile::In::setfileprovider(const AsmFileProvider & provider_n)
 {
-    ASSERT(! is.is_open() );
-    is.open(filename.c_str(), mode);
-    if (is.is_open() )
-        return;
-    for (size_t i = 0; i < includepath.size(); ++i)
+    provider = provider_n;
+}
+
+void AsmFile::In::collectdiagnostics()
+{
+    pdiagnostics.reset(new std::vector <AsmDiagnostic> );
+}
+
+const std::vector <AsmDiagnostic> & AsmFile::In::getdiagnostics() const
+{
+    static const std::vector <AsmDiagnostic> none;
+    return pdiagnostics ? * pdiagnostics : none;
+}
+
+bool AsmFile::In::readpath(const std::string & path,
+    std::string & content, std::ios::openmode mode) const
+{
+    if (provider)
+        return provider(path, content);
+
+    std::ifstream is(path.c_str(), mode);
+    if (! is.is_open() )
+        return false;
+    std::ostringstream oss;
+    oss << is.rdbuf();
+    if (is.bad() )
+        throw runtime_error("Error reading file '" + path + "'");
+    content = oss.str();
+    return true;
+}
+
+std::string AsmFile::In::readfile(size_t linepos,
+    const std::string & filename,
+    std::string & content, std::ios::openmode mode) const
+{
+    std::string path(filename);
+    bool found = readpath(path, content, mode);
+    for (size_t i = 0; ! found && i < includepath.size(); ++i)
     {
-        std::string path(includepath [i] );
-        path+= filename;
-        is.clear();
-        is.open(path.c_str(), mode);
-        if (is.is_open() )
-            return;
+        if (std::find(missingfiles.begin(), missingfiles.end(), path) ==
+                missingfiles.end() )
+            missingfiles.push_back(path);
+        path = includepath [i] + filename;
+        found = readpath(path, content, mode);
     }
-    throw FileNotFound(linepos, filename);
+    if (! found)
+        throw FileNotFound(linepos, filename);
+    if (std::find(openedfiles.begin(), openedfiles.end(), path) ==
+            openedfiles.end() )
+        openedfiles.push_back(path);
+    return path;
+}
+
+std::string AsmFile::In::readbinfile(size_t linepos,
+    const std::string & filename, std::string & content) const
+{
+    binfiles_t::iterator it = binfiles.find(filename);
+    if (it == binfiles.end() )
+    {
+        std::pair <std::string, std::string> file;
+        file.first = readfile(linepos, filename, file.second,
+            std::ios::in | std::ios::binary);
+        it = binfiles.insert(std::make_pair(filename, file) ).first;
+    }
+    content = it->second.second;
+    return it->second.first;
 }
 
 void AsmFile::In::pushline(size_t filenum, size_t linenum)
 {
     ASSERT(filenum < vfileref.size() );
 
-    vlinecont.push_back(LineContent(filenum, linenum) );
+    pushspan(filenum, linenum, 1);
+}
+
+void AsmFile::In::pushspan(size_t filenum, size_t fileline, size_t count)
+{
+    if (vlinespan.empty() ||
+            ! vlinespan.back().extend(filenum, fileline, count) )
+        vlinespan.push_back(LineSpan(nlines, filenum, fileline, count) );
+    nlines += count;
 }
 
 void AsmFile::In::copyfile(FileRef & fr, std::ostream & outverb)
@@ -381,10 +717,19 @@ void AsmFile::In::copyfile(FileRef & fr, std::ostream & outverb)
     const size_t linebegin = fr.linebegin();
     const size_t lineend = fr.lineend();
 
-    for (size_t i = linebegin; i < lineend; ++i)
+    // Add the part of each span of the previous load in the range,
+    // the spans added are after the range.
+    const size_t nspans = vlinespan.size();
+    for (size_t i = 0; i < nspans; ++i)
     {
-        LineContent l = getline(i);
-        vlinecont.push_back(l);
+        const LineSpan span = vlinespan [i];
+        const size_t from = std::max(span.begin(), linebegin);
+        const size_t to = std::min(span.end(), lineend);
+        if (from < to)
+        {
+            const LineContent first = span.getline(from);
+            pushspan(first.getfilenum(), first.getfileline(), to - from);
+        }
     }
 
     outverb << "Finished reloading file: " << fr.name() <<
@@ -400,11 +745,22 @@ void AsmFile::In::loadfile(size_t linepos, const std::string & filename,
             ": " << filename << '\n';
     #endif
 
+    const bool span = pstats != 0 && linepos != LINE_BEGIN;
+    if (span)
+    {
+        std::string incfile;
+        size_t incline = 0;
+        getlineinfo(linepos, incfile, incline);
+        pstats->beginspan("include " + filename, incfile, incline);
+    }
+
     auto oldref = std::find_if(vfileref.begin(), vfileref.end(),
             [& filename] (const auto & ref) { return ref.name() == filename; } );
     if (oldref != vfileref.end())
     {
         copyfile(*oldref, outverb);
+        if (span)
+            pstats->endphase();
         return;
     }
 
@@ -413,23 +769,41 @@ void AsmFile::In::loadfile(size_t linepos, const std::string & filename,
     outverb << "Loading file: " << filename <<
         " in " << numlines() << '\n';
 
-    std::ifstream file;
-    openis(linepos, file, filename, std::ios::in);
+    std::string content;
+    readfile(linepos, filename, content, std::ios::in);
+
+    std::vector <std::string> filelines;
+    std::istringstream file(content);
+    std::string text;
+    while (std::getline(file, text) )
+        filelines.push_back(text);
 
-    vfileref.push_back(FileRef(filename, numlines() ) );
+    // When loading again use the tokens of the previous load
+    // if the file has not changed.
+    const FileRef * const prevref = findprevious(filename);
+    if (prevref != 0 && prevref->sametext(filelines) )
+    {
+        vfileref.push_back(FileRef(* prevref, numlines() ) );
+        reusefile(* prevref, vfileref.size() - 1, nocase, outverb, outerr);
+        if (span)
+            pstats->endphase();
+        return;
+    }
+
+    vfileref.push_back(FileRef(filename, nocase, numlines() ) );
     const size_t filenum = vfileref.size() - 1;
 
-    std::string line;
     size_t linenum;
     size_t realnum;
 
     try
     {
-        for (linenum = 0, realnum = 0;
-            std::getline(file, line);
+        for (linenum = 0, realnum = 0; realnum < filelines.size();
             ++linenum, ++realnum)
         {
+            const std::string & line = filelines [realnum];
             Tokenizer tz(line, nocase);
+            ntokens += tz.size();
             Token tok = tz.gettoken();
             getfile(filenum).pushline(line, tz, realnum);
             pushline(filenum, linenum);
@@ -462,23 +836,101 @@ void AsmFile::In::loadfile(size_t linepos, const std::string & filename,
     }
     outverb << "Finished loading file: " << filename <<
         " in " << numlines() << '\n';
+    if (span)
+        pstats->endphase();
+}
+
+void AsmFile::In::reusefile(const FileRef & fr, size_t filenum, bool nocase,
+    std::ostream & outverb, std::ostream & outerr)
+{
+    outverb << "Reusing file: " << fr.name() <<
+        " in " << numlines() << '\n';
+
+    try
+    {
+        for (size_t linenum = 0; linenum < fr.numlines(); ++linenum)
+        {
+            Tokenizer tz = fr.gettkz(linenum);
+            ntokens += tz.size();
+            pushline(filenum, linenum);
+            if (tz.gettoken().type() == TypeINCLUDE)
+            {
+                // The line after is the end of include.
+                const size_t curposline = numlines() - 1;
+                loadfile(curposline, tz.getincludefile(), nocase,
+                    outverb, outerr);
+            }
+        }
+        getfile(filenum).setend(numlines() );
+    }
+    catch (AsmError & err)
+    {
+        showerrorinfo(outerr, err.getline(), err.message());
+        throw ErrorAlreadyReported();
+    }
+}
+
+bool AsmFile::In::getlineinfo(size_t nline,
+    std::string & filename, size_t & numline) const
+{
+    if (nline >= numlines())
+        return false;
+    const LineContent linf = getline(nline);
+    const FileRef & fileref = getfile(linf.getfilenum() );
+    filename = fileref.name();
+    numline = fileref.numline(linf.getfileline() ) + 1;
+    return true;
+}
+
+void AsmFile::In::adddiagnostic(AsmDiagnostic::Kind kind,
+    size_t nline, const std::string & message) const
+{
+    AsmDiagnostic diag;
+    diag.kind = kind;
+    diag.message = message;
+    diag.line = 0;
+    getlineinfo(nline, diag.file, diag.line);
+
+    // Warnings are shown in each pass, keep only the first one.
+    for (size_t i = 0; i < pdiagnostics->size(); ++i)
+    {
+        const AsmDiagnostic & prev = (* pdiagnostics) [i];
+        if (prev.kind == diag.kind && prev.line == diag.line &&
+                prev.file == diag.file && prev.message == diag.message)
+            return;
+    }
+    pdiagnostics->push_back(diag);
 }
 
 void AsmFile::In::showerrorinfo(std::ostream & os,
     size_t nline, const std::string message) const
 {
+    if (pdiagnostics)
+    {
+        adddiagnostic(AsmDiagnostic::Error, nline, message);
+        return;
+    }
     os << "ERROR: " << message << ' ';
     showlineinfo(os, nline);
     os << '\n';
 }
 
+void AsmFile::In::showerror(std::ostream & os,
+    const std::string & message) const
+{
+    if (pdiagnostics)
+        adddiagnostic(AsmDiagnostic::Error, LINE_BEGIN, message);
+    else
+        os << "ERROR: " << message << '\n';
+}
+
 void AsmFile::In::showlineinfo(std::ostream & os, size_t nline) const
 {
     if (nline >= numlines())
         os << " detected after end of file";
     else
     {
-    const LineContent & linf = getline(nline);
+    const LineContent linf = getline(nline);
     const FileRef & fileref = getfile(linf.getfilenum() );
 
     os << " on line " << fileref.numline(linf.getfileline() ) + 1 <<
@@ -489,6 +941,11 @@ void AsmFile::In::showlineinfo(std::ostream & os, size_t nline) const
 void AsmFile::In::showwarning(std::ostream & os,
     size_t nline, const std::string message) const
 {
+    if (pdiagnostics)
+    {
+        adddiagnostic(AsmDiagnostic::Warning, nline, message);
+        return;
+    }
     os << "WARNING: " << message;
     showlineinfo(os, nline);
     os << '\n';
@@ -529,16 +986,87 @@ void AsmFile::addincludedir(const std::string & dirname)
     in().addincludedir(dirname);
 }
 
-void AsmFile::openis(size_t linepos, std::ifstream & is,
-    const std::string & filename, std::ios::openmode mode) const
+std::string AsmFile::readfile(size_t linepos, const std::string & filename,
+    std::string & content, std::ios::openmode mode) const
+{
+    return in().readfile(linepos, filename, content, mode);
+}
+
+std::string AsmFile::readbinfile(size_t linepos,
+    const std::string & filename, std::string & content) const
+{
+    return in().readbinfile(linepos, filename, content);
+}
+
+bool AsmFile::readpath(const std::string & path,
+    std::string & content, std::ios::openmode mode) const
+{
+    return in().readpath(path, content, mode);
+}
+
+void AsmFile::setfileprovider(const AsmFileProvider & provider)
+{
+    in().setfileprovider(provider);
+}
+
+void AsmFile::collectdiagnostics()
+{
+    in().collectdiagnostics();
+}
+
+const std::vector <AsmDiagnostic> & AsmFile::getdiagnostics() const
+{
+    return in().getdiagnostics();
+}
+
+const std::vector <std::string> & AsmFile::getopenedfiles() const
+{
+    return in().getopenedfiles();
+}
+
+const std::vector <std::string> & AsmFile::getmissingfiles() const
+{
+    return in().getmissingfiles();
+}
+
+void AsmFile::setstats(Stats * pstats)
+{
+    in().setstats(pstats);
+}
+
+void AsmFile::clearfiles()
+{
+    // The lines loaded may be shared with other instances.
+    In * const pnew = new In;
+    pnew->copysettings(in() );
+    pin->delref();
+    pin = pnew;
+}
+
+size_t AsmFile::firstchange(const AsmFile & af) const
 {
-    in().openis(linepos, is, filename, mode);
+    const size_t n = std::min(in().numlines(), af.in().numlines() );
+    size_t line = 0;
+    while (line < n && in().sameline(line, af.in() ) )
+        ++line;
+    return line;
 }
 
 void AsmFile::loadfile(size_t linepos, const std::string & filename,
     bool nocase, std::ostream & outverb, std::ostream& outerr)
 {
-    in().loadfile(linepos, filename, nocase, outverb, outerr);
+    // The files of the previous load are no longer needed
+    // after loading the main file.
+    try
+    {
+        in().loadfile(linepos, filename, nocase, outverb, outerr);
+    }
+    catch (...)
+    {
+        in().releaseprevious();
+        throw;
+    }
+    in().releaseprevious();
 }
 
 bool AsmFile::getvalidline()
@@ -564,15 +1092,28 @@ size_t AsmFile::getline() const
     return currentline;
 }
 
-Tokenizer & AsmFile::getcurrentline()
+size_t AsmFile::getnumlines() const
+{
+    return in().numlines();
+}
+
+size_t AsmFile::getnumtokens() const
+{
+    return in().numtokens();
+}
+
+size_t AsmFile::getlinestorage() const
+{
+    return in().storagesize();
+}
+
+Tokenizer AsmFile::getcurrentline() const
 {
     ASSERT(! passeof() );
-    Tokenizer & tz = in().gettkz(currentline);
-    tz.reset();
-    return tz;
+    return in().gettkz(currentline);
 }
 
-const std::string & AsmFile::getcurrenttext() const
+std::string AsmFile::getcurrenttext() const
 {
     ASSERT(! passeof() );
     //return in().getlinecont(currentline).getstrline();
@@ -615,6 +1156,12 @@ void AsmFile::prevline()
     --currentline;
 }
 
+bool AsmFile::getlineinfo(size_t nline,
+    std::string & filename, size_t & numline) const
+{
+    return in().getlineinfo(nline, filename, numline);
+}
+
 void AsmFile::showerrorinfo(std::ostream & os,
     size_t nline, const std::string message) const
 {
@@ -627,4 +1174,9 @@ void AsmFile::showwarning(std::ostream & os,
     in().showwarning(os, nline, message);
 }
 
+void AsmFile::showerror(std::ostream & os, const std::string & message) const
+{
+    in().showerror(os, message);
+}
+
 // End
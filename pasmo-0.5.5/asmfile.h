@@ -3,11 +3,14 @@
 
 // asmfile.h
 
+#include "asmio.h"
 #include "token.h"
+#include "stats.h"
 
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
 
 class AsmFile
 {
@@ -16,20 +19,53 @@ public:
     AsmFile(const AsmFile & af);
     ~AsmFile();
     void addincludedir(const std::string & dirname);
+    void setfileprovider(const AsmFileProvider & provider);
+    void collectdiagnostics();
+    const std::vector <AsmDiagnostic> & getdiagnostics() const;
+    void setstats(Stats * pstats);
     void loadfile(size_t linepos, const std::string & filename, bool nocase,
         std::ostream & outverb, std::ostream & outerr);
     size_t getline() const;
+    size_t getnumlines() const;
+    size_t getnumtokens() const;
+    size_t getlinestorage() const;
+    bool getlineinfo(size_t nline,
+        std::string & filename, size_t & numline) const;
     void showerrorinfo(std::ostream & os,
         size_t nline, const std::string message) const;
+    // Error not related to a line.
+    void showerror(std::ostream & os, const std::string & message) const;
+    // Paths of the files opened, in the order of the first open.
+    const std::vector <std::string> & getopenedfiles() const;
+    // Paths searched in the include path that did not exist.
+    const std::vector <std::string> & getmissingfiles() const;
 protected:
-    void openis(size_t linepos, std::ifstream & is,
-        const std::string & filename, std::ios::openmode mode) const;
+    // Read the file searching it in the include path,
+    // returns the path used.
+    std::string readfile(size_t linepos, const std::string & filename,
+        std::string & content, std::ios::openmode mode) const;
+    // As readfile in binary mode, but the file is read only once
+    // for each load, the passes and the instances that share the
+    // lines get the same content.
+    std::string readbinfile(size_t linepos, const std::string & filename,
+        std::string & content) const;
+    // Read the file with that path, false if not found.
+    bool readpath(const std::string & path,
+        std::string & content, std::ios::openmode mode) const;
     void showwarning(std::ostream & os,
         size_t nline, const std::string message) const;
     bool getvalidline();
     bool passeof() const;
-    Tokenizer & getcurrentline();
-    const std::string & getcurrenttext() const;
+    // The Tokenizer returned uses the tokens stored in the file,
+    // without copying them.
+    Tokenizer getcurrentline() const;
+    std::string getcurrenttext() const;
+
+    // Discard the files loaded, keeping the include path. The next
+    // load reuses the tokens of the files whose content is the same.
+    void clearfiles();
+    // First line that is not the same in the other file.
+    size_t firstchange(const AsmFile & af) const;
 
     void setline(size_t line);
     void setendline();
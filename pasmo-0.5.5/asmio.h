@@ -0,0 +1,33 @@
+#ifndef INCLUDE_ASMIO_H
+#define INCLUDE_ASMIO_H
+
+// asmio.h
+
+// Types shared by the Asm interface and the loading of the
+// source files: how the files are read and how the errors and
+// warnings are reported.
+
+#include <string>
+#include <functional>
+
+// An error or warning, with the file and line where it was
+// detected, empty and 0 when it is not related to a line.
+
+struct AsmDiagnostic
+{
+    enum Kind { Error, Warning };
+    Kind kind;
+    std::string message;
+    std::string file;
+    size_t line;
+};
+
+// Puts the content of the file in the string, false if it
+// does not exist.
+
+typedef std::function <bool (const std::string & filename,
+    std::string & content)> AsmFileProvider;
+
+#endif
+
+// End
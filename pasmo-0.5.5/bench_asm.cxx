@@ -0,0 +1,422 @@
+// bench_asm.cxx
+
+// Assembly benchmarks on synthetic sources.
+// Without arguments runs small versions of each workload once,
+// as a test. With --full uses the real sizes and repeats each
+// workload, showing the median and 95th percentile times.
+
+#include "asm.h"
+
+#include "test_protocol.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+using namespace Pasmo::Test;
+
+namespace
+{
+
+std::string workdir("bench_work");
+
+// Divisor applied to the workload sizes in quick mode.
+size_t reduce = 100;
+
+size_t scaled(size_t n)
+{
+    const size_t r = n / reduce;
+    return r == 0 ? 1 : r;
+}
+
+std::string workfile(const std::string & name)
+{
+    return workdir + '/' + name;
+}
+
+void openout(std::ofstream & out, const std::string & filename)
+{
+    out.open(filename.c_str(), std::ios::out | std::ios::binary);
+    if (! out.is_open() )
+        throw std::runtime_error("Error creating " + filename);
+}
+
+//--------------------------------------------------------------
+//        Workload generators.
+//--------------------------------------------------------------
+
+// Lines of code without labels, restarting the ORG before
+// running out of memory.
+
+std::string genflat()
+{
+    static const char * const code [] = {
+        "\tLD A,(IX+5)", "\tADD A,B", "\tLD HL,1234H", "\tINC DE",
+        "\tPUSH BC", "\tLDIR", "\tOUT (0FEH),A", "\tAND 0F0H",
+        "\tLD (IY-3),7", "\tEX DE,HL", "\tSBC HL,DE", "\tRLCA",
+        "\tBIT 3,(HL)", "\tLD BC,(4000H)", "\tPOP AF", "\tCPL"
+    };
+    const size_t ncode = sizeof(code) / sizeof(code [0]);
+
+    const std::string name = workfile("flat.asm");
+    std::ofstream out;
+    openout(out, name);
+    const size_t lines = scaled(500000);
+    for (size_t i = 0; i < lines; ++i)
+    {
+        if (i % 16384 == 0)
+            out << "\tORG 0\n";
+        out << code [i % ncode] << '\n';
+    }
+    out << "\tEND\n";
+    return name;
+}
+
+// Labels referenced before being defined.
+
+std::string genlabels()
+{
+    const std::string name = workfile("labels.asm");
+    std::ofstream out;
+    openout(out, name);
+    const size_t labels = scaled(50000);
+    for (size_t i = 0; i < labels; ++i)
+    {
+        if (i % 16384 == 0)
+            out << "\tORG 0\n";
+        out << "L" << i << ":\tJP L" << (i + 1000) % labels << '\n';
+    }
+    out << "\tEND\n";
+    return name;
+}
+
+// A binary tree of include files.
+
+void genincnode(size_t depth, size_t index, size_t maxdepth)
+{
+    std::ostringstream oss;
+    oss << "inc_" << depth << '_' << index << ".asm";
+    std::ofstream out;
+    openout(out, workfile(oss.str() ) );
+    for (size_t i = 0; i < 50; ++i)
+        out << "\tLD A," << i << '\n';
+    if (depth < maxdepth)
+    {
+        for (size_t child = 0; child < 2; ++child)
+        {
+            const size_t childindex = index * 2 + child;
+            out << "\tINCLUDE " << workfile("inc_") <<
+                depth + 1 << '_' << childindex << ".asm\n";
+            genincnode(depth + 1, childindex, maxdepth);
+        }
+    }
+}
+
+std::string genincludes()
+{
+    const size_t maxdepth = reduce > 1 ? 4 : 9;
+    genincnode(0, 0, maxdepth);
+    const std::string name = workfile("includes.asm");
+    std::ofstream out;
+    openout(out, name);
+    out << "\tORG 0\n" <<
+        "\tINCLUDE " << workfile("inc_0_0.asm") << '\n' <<
+        "\tEND\n";
+    return name;
+}
+
+// Nested macro, REPT and IRP expansions. DEFL is used
+// to avoid generating code beyond the memory size.
+
+std::string genmacros()
+{
+    const std::string name = workfile("macros.asm");
+    std::ofstream out;
+    openout(out, name);
+    out << "COUNT\tDEFL 0\n"
+        "INNER\tMACRO V\n"
+        "COUNT\tDEFL COUNT + V\n"
+        "\tENDM\n"
+        "OUTER\tMACRO N\n"
+        "\tREPT 8\n"
+        "\tIRP X,1,2,3,N\n"
+        "\tINNER X\n"
+        "\tENDM\n"
+        "\tENDM\n"
+        "\tENDM\n"
+        "\tREPT " << scaled(5000) << "\n"
+        "\tOUTER 4\n"
+        "\tENDM\n"
+        "\tDEFW COUNT\n"
+        "\tEND\n";
+    return name;
+}
+
+// The same binary file included several times.
+
+std::string genincbin()
+{
+    const std::string binname = workfile("incbin.bin");
+    {
+        std::ofstream bin;
+        openout(bin, binname);
+        const size_t size = reduce > 1 ? 4096 : 48 * 1024;
+        for (size_t i = 0; i < size; ++i)
+            bin.put(static_cast <char> (i * 31 + (i >> 8) ) );
+    }
+    const std::string name = workfile("incbin.asm");
+    std::ofstream out;
+    openout(out, name);
+    const size_t times = reduce > 1 ? 2 : 32;
+    for (size_t i = 0; i < times; ++i)
+        out << "\tORG 0\n" <<
+            "\tINCBIN " << binname << '\n';
+    out << "\tEND\n";
+    return name;
+}
+
+// Big blocks skipped by false conditionals.
+
+std::string genfalseif()
+{
+    const std::string name = workfile("falseif.asm");
+    std::ofstream out;
+    openout(out, name);
+    const size_t lines = scaled(100000);
+    out << "\tORG 0\n";
+    for (size_t block = 0; block < 4; ++block)
+    {
+        out << "\tIF 0\n";
+        for (size_t i = 0; i < lines; ++i)
+        {
+            if (i % 1000 == 0)
+                out << "\tIF 1\n\tNOP\n\tELSE\n\tNOP\n\tENDIF\n";
+            out << "\tLD HL," << i << "\n";
+        }
+        out << "\tELSE\n\tNOP\n\tENDIF\n";
+    }
+    out << "\tEND\n";
+    return name;
+}
+
+// A full 64 KB image, for the text emitters.
+
+std::string genfullimage()
+{
+    const std::string binname = workfile("full.bin");
+    {
+        std::ofstream bin;
+        openout(bin, binname);
+        for (size_t i = 0; i < 0x10000; ++i)
+            bin.put(static_cast <char> (i * 7 + (i >> 8) ) );
+    }
+    const std::string name = workfile("full.asm");
+    std::ofstream out;
+    openout(out, name);
+    out << "\tORG 0\n" <<
+        "\tINCBIN " << binname << '\n' <<
+        "\tEND\n";
+    return name;
+}
+
+//--------------------------------------------------------------
+//        Timing.
+//--------------------------------------------------------------
+
+struct Sample
+{
+    double load;
+    double pass1;
+    double pass2;
+    double emit;
+    double total;
+};
+
+class NullBuf : public std::streambuf
+{
+protected:
+    int overflow(int c) { return c; }
+};
+
+Sample runonce(const std::string & filename)
+{
+    // Discard the warnings about overwritten code or unused labels.
+    NullBuf nullbuf;
+    std::streambuf * errbuf = std::cerr.rdbuf(& nullbuf);
+
+    Sample sample;
+    try
+    {
+        typedef std::chrono::steady_clock clock;
+        const clock::time_point start = clock::now();
+
+        Asm as;
+        as.loadfile(filename);
+        as.processfile();
+
+        const clock::time_point emitstart = clock::now();
+        std::ostringstream out;
+        as.emitobject(out);
+        const clock::time_point end = clock::now();
+
+        sample.load = as.phasetime("load");
+        sample.pass1 = as.phasetime("pass 1");
+        sample.pass2 = as.phasetime("pass 2");
+        sample.emit = std::chrono::duration <double> (end - emitstart).count();
+        sample.total = std::chrono::duration <double> (end - start).count();
+    }
+    catch (...)
+    {
+        std::cerr.rdbuf(errbuf);
+        throw;
+    }
+    std::cerr.rdbuf(errbuf);
+    return sample;
+}
+
+double percentile(std::vector <double> values, size_t percent)
+{
+    std::sort(values.begin(), values.end() );
+    const size_t pos = (values.size() - 1) * percent / 100;
+    return values [pos];
+}
+
+void report(const std::string & workload, const char * phase,
+    const std::vector <Sample> & samples, double Sample::* field)
+{
+    std::vector <double> values;
+    for (size_t i = 0; i < samples.size(); ++i)
+        values.push_back(samples [i].* field);
+    std::ostringstream oss;
+    oss.setf(std::ios::fixed);
+    oss.precision(6);
+    oss << workload << ' ' << phase <<
+        " median " << percentile(values, 50) <<
+        " p95 " << percentile(values, 95);
+    diag(oss.str() );
+}
+
+void bench(const std::string & workload, std::string (* gen) (),
+    size_t runs)
+{
+    bool success = true;
+    try
+    {
+        const std::string filename = gen();
+        std::vector <Sample> samples;
+        for (size_t i = 0; i < runs; ++i)
+            samples.push_back(runonce(filename) );
+
+        report(workload, "load", samples, & Sample::load);
+        report(workload, "pass1", samples, & Sample::pass1);
+        report(workload, "pass2", samples, & Sample::pass2);
+        report(workload, "emit", samples, & Sample::emit);
+        report(workload, "total", samples, & Sample::total);
+    }
+    catch (std::exception & e)
+    {
+        diag(std::string("caught ") + e.what() );
+        success = false;
+    }
+    catch (...)
+    {
+        success = false;
+    }
+    ok(success, workload.c_str() );
+}
+
+// Intel HEX generation speed, in MB of text per second.
+
+void benchhex(size_t runs)
+{
+    // 4096 records of 16 bytes and the end record.
+    const size_t hexsize = 4096 * 45 + 13;
+    const size_t repeat = reduce > 1 ? 1 : 20;
+    bool success = true;
+    try
+    {
+        Asm as;
+        as.loadfile(genfullimage() );
+        as.processfile();
+
+        std::vector <double> rates;
+        std::ostringstream out;
+        for (size_t i = 0; i < runs; ++i)
+        {
+            typedef std::chrono::steady_clock clock;
+            const clock::time_point start = clock::now();
+            for (size_t j = 0; j < repeat; ++j)
+            {
+                out.str(std::string() );
+                as.emithex(out);
+            }
+            const double seconds =
+                std::chrono::duration <double> (clock::now() - start).count();
+            if (out.str().size() != hexsize)
+                success = false;
+            rates.push_back(hexsize * repeat / 1e6 / seconds);
+        }
+        std::ostringstream oss;
+        oss.setf(std::ios::fixed);
+        oss.precision(1);
+        oss << "hex 64KB MB/s median " << percentile(rates, 50) <<
+            " p5 " << percentile(rates, 5);
+        diag(oss.str() );
+    }
+    catch (std::exception & e)
+    {
+        diag(std::string("caught ") + e.what() );
+        success = false;
+    }
+    ok(success, "hex");
+}
+
+} // namespace
+
+int main(int argc, char * * argv)
+{
+    size_t runs = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg(argv [i] );
+        if (arg == "--full")
+        {
+            reduce = 1;
+            if (runs == 1)
+                runs = 5;
+        }
+        else if (arg == "--runs" && i + 1 < argc)
+            runs = strtoul(argv [++i], nullptr, 10);
+        else if (arg == "--dir" && i + 1 < argc)
+            workdir = argv [++i];
+        else
+        {
+            std::cerr << "Usage: bench_asm [--full] [--runs n] [--dir dir]\n";
+            return 1;
+        }
+    }
+    if (runs == 0)
+        runs = 1;
+
+    mkdir(workdir.c_str(), 0777);
+
+    plan(7);
+
+    bench("flat", genflat, runs);
+    bench("labels", genlabels, runs);
+    bench("includes", genincludes, runs);
+    bench("macros", genmacros, runs);
+    bench("incbin", genincbin, runs);
+    bench("falseif", genfalseif, runs);
+    benchhex(runs);
+}
+
+// End
@@ -0,0 +1,222 @@
+// bench_token.cxx
+
+// Throughput of the Tokenizer for several kinds of source lines.
+// Compares the results with a baseline file, failing when any of
+// them is slower than the baseline by more than the tolerance.
+
+#include "token.h"
+
+#include "test_protocol.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <stdexcept>
+
+#include <stdlib.h>
+
+using namespace Pasmo::Test;
+
+namespace
+{
+
+struct Shape
+{
+    const char * name;
+    std::vector <std::string> lines;
+};
+
+struct Result
+{
+    double linespersec;
+    double tokenspersec;
+};
+
+std::vector <Shape> getshapes()
+{
+    std::vector <Shape> shapes;
+
+    Shape instruction = { "instruction", {
+        "\tLD A,(IX+5)",
+        "LOOP:\tDJNZ LOOP",
+        "\tLD HL,BUFFER+2*SIZE",
+        "\tADD HL,DE",
+        "\tJP NZ,NEXT",
+        "\tEX (SP),IY",
+        "\tLD (VAR),A",
+        "\tOUT (0FEH),A"
+    } };
+    shapes.push_back(instruction);
+
+    Shape defbstring = { "defb_string", {
+        "\tDEFB 'Hello, world', 0DH, 0AH, 0",
+        "MSG:\tDEFM \"Press any key to continue\"",
+        "\tDB \"A \"\"quoted\"\" word\", 0",
+        "\tDEFB 'It''s ', \"done\", '$'"
+    } };
+    shapes.push_back(defbstring);
+
+    Shape numeric = { "numeric", {
+        "\tDEFB 12, 255, 0, 128D, 77, 1, 2, 3",
+        "\tDEFB 0FFH, 1AH, 0x1F, 0X80, 7FH, 0C9H",
+        "\tDEFB 1010B, 11110000B, 17O, 377Q, 12Q",
+        "\tDEFB $FF, $1A, $7F, $1$0, $C9",
+        "\tDEFB %1010, %11110000, %1, %0101$1010",
+        "\tDEFB #FF, #1A, #7F, #C9, #80",
+        "\tDEFW &HFFFF, &H1234, &O177, &X1010"
+    } };
+    shapes.push_back(numeric);
+
+    Shape comment = { "comment", {
+        "; This is a comment line with some text in it",
+        "\tNOP ; Does nothing, but takes some time",
+        ";;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;",
+        "\tRET\t; Back to the caller, with carry set on error"
+    } };
+    shapes.push_back(comment);
+
+    return shapes;
+}
+
+// Tokenize the lines repeatedly during at least the given time
+// in several trials, and keep the best one.
+
+Result measure(const Shape & shape, double seconds)
+{
+    typedef std::chrono::steady_clock clock;
+    const size_t trials = 5;
+    Result best = { 0, 0 };
+    for (size_t trial = 0; trial < trials; ++trial)
+    {
+        size_t lines = 0;
+        size_t tokens = 0;
+        const clock::time_point start = clock::now();
+        double elapsed = 0;
+        do
+        {
+            for (size_t rep = 0; rep < 100; ++rep)
+                for (size_t i = 0; i < shape.lines.size(); ++i)
+                {
+                    Tokenizer tz(shape.lines [i], false);
+                    tokens += tz.size();
+                    ++lines;
+                }
+            elapsed = std::chrono::duration <double>
+                (clock::now() - start).count();
+        } while (elapsed < seconds / trials);
+
+        const Result result = { lines / elapsed, tokens / elapsed };
+        if (result.linespersec > best.linespersec)
+            best = result;
+    }
+    return best;
+}
+
+typedef std::map <std::string, Result> baseline_t;
+
+baseline_t readbaseline(const std::string & filename)
+{
+    std::ifstream in(filename.c_str() );
+    if (! in.is_open() )
+        throw std::runtime_error("Error opening " + filename);
+    baseline_t baseline;
+    std::string line;
+    while (std::getline(in, line) )
+    {
+        if (line.empty() || line [0] == '#')
+            continue;
+        std::istringstream iss(line);
+        std::string name;
+        Result result;
+        if (iss >> name >> result.linespersec >> result.tokenspersec)
+            baseline [name] = result;
+    }
+    return baseline;
+}
+
+} // namespace
+
+int main(int argc, char * * argv)
+{
+    std::string baselinefile;
+    std::string writefile;
+    double tolerance = 20;
+    double seconds = 0.5;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg(argv [i] );
+        if (arg == "--baseline" && i + 1 < argc)
+            baselinefile = argv [++i];
+        else if (arg == "--write" && i + 1 < argc)
+            writefile = argv [++i];
+        else if (arg == "--tolerance" && i + 1 < argc)
+            tolerance = strtod(argv [++i], nullptr);
+        else if (arg == "--time" && i + 1 < argc)
+            seconds = strtod(argv [++i], nullptr);
+        else
+        {
+            std::cerr << "Usage: bench_token [--baseline file] "
+                "[--tolerance percent] [--time seconds] [--write file]\n";
+            return 1;
+        }
+    }
+
+    try
+    {
+        baseline_t baseline;
+        if (! baselinefile.empty() )
+            baseline = readbaseline(baselinefile);
+
+        const std::vector <Shape> shapes = getshapes();
+        std::ostringstream results;
+        results.setf(std::ios::fixed);
+        results.precision(0);
+        results << "# shape lines/s tokens/s\n";
+
+        plan(shapes.size() );
+        for (size_t i = 0; i < shapes.size(); ++i)
+        {
+            const Shape & shape = shapes [i];
+            const Result result = measure(shape, seconds);
+            std::ostringstream oss;
+            oss.setf(std::ios::fixed);
+            oss.precision(0);
+            oss << shape.name << ' ' << result.linespersec << ' ' <<
+                result.tokenspersec;
+            results << oss.str() << '\n';
+
+            bool success = true;
+            const baseline_t::const_iterator it = baseline.find(shape.name);
+            if (it != baseline.end() )
+            {
+                const double limit = 1 - tolerance / 100;
+                const Result & base = it->second;
+                oss << " baseline " << base.linespersec << ' ' <<
+                    base.tokenspersec;
+                success = result.linespersec >= base.linespersec * limit &&
+                    result.tokenspersec >= base.tokenspersec * limit;
+            }
+            diag(oss.str() );
+            ok(success, shape.name);
+        }
+
+        if (! writefile.empty() )
+        {
+            std::ofstream out(writefile.c_str() );
+            if (! out.is_open() )
+                throw std::runtime_error("Error creating " + writefile);
+            out << results.str();
+        }
+    }
+    catch (std::exception & e)
+    {
+        std::cerr << "ERROR: " << e.what() << '\n';
+        return 1;
+    }
+}
+
+// End
@@ -0,0 +1,249 @@
+// buildcache.cxx
+
+#include "buildcache.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+const std::string manifestname("manifest");
+const std::string manifestheader("pasmo-cache 2");
+const std::string warningsname("warnings");
+
+// Hash in the manifest of the files that must not exist.
+const std::string missinghash("-");
+
+// 64 bit FNV-1a hash.
+
+class Hash
+{
+public:
+    Hash();
+    void add(const char * data, size_t size);
+    void add(const std::string & str);
+    std::string hex() const;
+private:
+    unsigned long long h;
+};
+
+Hash::Hash() :
+    h(14695981039346656037ULL)
+{ }
+
+void Hash::add(const char * data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= static_cast <unsigned char> (data [i] );
+        h *= 1099511628211ULL;
+    }
+}
+
+void Hash::add(const std::string & str)
+{
+    add(str.data(), str.size() );
+}
+
+std::string Hash::hex() const
+{
+    std::ostringstream oss;
+    oss << std::hex;
+    oss.width(16);
+    oss.fill('0');
+    oss << h;
+    return oss.str();
+}
+
+// Add the content of the file to the hash, false if it can't be read.
+
+bool hashfile(Hash & hash, const std::string & filename)
+{
+    std::ifstream f(filename.c_str(), std::ios::in | std::ios::binary);
+    if (! f.is_open() )
+        return false;
+    char buffer [4096];
+    do
+    {
+        f.read(buffer, sizeof(buffer) );
+        hash.add(buffer, f.gcount() );
+    } while (f);
+    return f.eof();
+}
+
+struct CacheEntry
+{
+    fs::path path;
+    fs::file_time_type used;
+    unsigned long long size;
+};
+
+bool olderentry(const CacheEntry & e1, const CacheEntry & e2)
+{
+    return e1.used < e2.used;
+}
+
+} // namespace
+
+BuildCache::BuildCache(const std::string & dir_n,
+        unsigned long long maxsize_n) :
+    dir(dir_n),
+    maxsize(maxsize_n)
+{ }
+
+std::string BuildCache::entrydir() const
+{
+    return (fs::path(dir) / key).string();
+}
+
+void BuildCache::setkey(const std::string & options,
+    const std::string & mainfile)
+{
+    Hash hash;
+    hash.add(options);
+    hash.add("", 1);
+    if (hashfile(hash, mainfile) )
+        key = hash.hex();
+    else
+        key.clear();
+}
+
+bool BuildCache::lookup(std::vector <std::string> & inputs)
+{
+    if (key.empty() )
+        return false;
+    const fs::path manifest = fs::path(entrydir() ) / manifestname;
+    std::ifstream in(manifest.string().c_str() );
+    std::string line;
+    if (! std::getline(in, line) || line != manifestheader)
+        return false;
+
+    // Each line has the hash of a file and its name, or a - for
+    // the files that must not exist.
+    inputs.clear();
+    while (std::getline(in, line) )
+    {
+        const std::string::size_type pos = line.find(' ');
+        if (pos == std::string::npos)
+            return false;
+        const std::string filename = line.substr(pos + 1);
+        if (line.substr(0, pos) == missinghash)
+        {
+            std::error_code ec;
+            if (fs::exists(filename, ec) || ec)
+                return false;
+            continue;
+        }
+        Hash hash;
+        if (! hashfile(hash, filename) || hash.hex() != line.substr(0, pos) )
+            return false;
+        inputs.push_back(filename);
+    }
+    in.close();
+
+    // Mark as recently used.
+    fs::last_write_time(manifest, fs::file_time_type::clock::now() );
+    return true;
+}
+
+void BuildCache::getoutput(const std::string & name,
+    const std::string & filename) const
+{
+    fs::copy_file(fs::path(entrydir() ) / name, filename,
+        fs::copy_options::overwrite_existing);
+}
+
+std::string BuildCache::getwarnings() const
+{
+    std::ifstream in( (fs::path(entrydir() ) / warningsname).string().c_str(),
+        std::ios::in | std::ios::binary);
+    std::ostringstream oss;
+    oss << in.rdbuf();
+    return oss.str();
+}
+
+void BuildCache::store(const std::vector <std::string> & inputs,
+    const std::vector <std::string> & missing,
+    const std::vector <std::pair <std::string, std::string> > & outputs,
+    const std::string & warnings)
+{
+    if (key.empty() )
+        return;
+
+    // Prepare the entry with a temporary name, so an incomplete
+    // one is never used.
+    const fs::path entry(entrydir() );
+    fs::path tmp(entry);
+    tmp+= ".tmp" + std::to_string(
+        std::chrono::steady_clock::now().time_since_epoch().count() );
+    fs::create_directories(tmp);
+
+    for (size_t i = 0; i < outputs.size(); ++i)
+        fs::copy_file(outputs [i].second, tmp / outputs [i].first);
+
+    {
+        std::ofstream out( (tmp / manifestname).string().c_str() );
+        out << manifestheader << '\n';
+        for (size_t i = 0; i < inputs.size(); ++i)
+        {
+            Hash hash;
+            hashfile(hash, inputs [i] );
+            out << hash.hex() << ' ' << inputs [i] << '\n';
+        }
+        for (size_t i = 0; i < missing.size(); ++i)
+            out << missinghash << ' ' << missing [i] << '\n';
+    }
+
+    {
+        std::ofstream out( (tmp / warningsname).string().c_str(),
+            std::ios::out | std::ios::binary);
+        out << warnings;
+    }
+
+    fs::remove_all(entry);
+    fs::rename(tmp, entry);
+
+    evict();
+}
+
+void BuildCache::evict()
+{
+    // Remove the least recently used entries until the
+    // size is under the limit.
+
+    std::vector <CacheEntry> entries;
+    unsigned long long total = 0;
+    for (const fs::directory_entry & de : fs::directory_iterator(dir) )
+    {
+        if (! de.is_directory() ||
+                de.path().filename().string().find('.') != std::string::npos)
+            continue;
+        CacheEntry entry;
+        entry.path = de.path();
+        entry.size = 0;
+        for (const fs::directory_entry & file :
+                fs::directory_iterator(de.path() ) )
+            entry.size += file.file_size();
+        std::error_code ec;
+        entry.used = fs::last_write_time(de.path() / manifestname, ec);
+        if (ec)
+            entry.used = fs::file_time_type::min();
+        total += entry.size;
+        entries.push_back(entry);
+    }
+
+    std::sort(entries.begin(), entries.end(), olderentry);
+    for (size_t i = 0; i < entries.size() && total > maxsize; ++i)
+    {
+        fs::remove_all(entries [i].path);
+        total -= entries [i].size;
+    }
+}
+
+// End
@@ -0,0 +1,51 @@
+#ifndef INCLUDE_BUILDCACHE_H
+#define INCLUDE_BUILDCACHE_H
+
+// buildcache.h
+
+// Cache of the output files of previous assemblies, used with the
+// --cache option. Each entry is a directory named by a hash of the
+// options and the main source, with a manifest that lists the
+// files read with a hash of their contents and the files searched
+// that did not exist, the outputs and the warnings shown.
+// The least recently used entries are removed when the total size
+// is over the limit.
+
+#include <string>
+#include <vector>
+
+class BuildCache
+{
+public:
+    BuildCache(const std::string & dir_n, unsigned long long maxsize_n);
+    // Select the entry for the options given as text and the
+    // content of the main source file.
+    void setkey(const std::string & options, const std::string & mainfile);
+    // True if the entry exists, all the files it was assembled
+    // from are unchanged and the ones missing still do not exist,
+    // returning the names of the files read.
+    bool lookup(std::vector <std::string> & inputs);
+    // Copy an output of the entry found to the file.
+    void getoutput(const std::string & name,
+        const std::string & filename) const;
+    // Warnings of the assembly of the entry found.
+    std::string getwarnings() const;
+    // Store the outputs, pairs of output name and file, with the
+    // files read to generate them, the files searched that did
+    // not exist and the warnings.
+    void store(const std::vector <std::string> & inputs,
+        const std::vector <std::string> & missing,
+        const std::vector <std::pair <std::string, std::string> > & outputs,
+        const std::string & warnings);
+private:
+    const std::string dir;
+    const unsigned long long maxsize;
+    std::string key;
+
+    std::string entrydir() const;
+    void evict();
+};
+
+#endif
+
+// End
@@ -16,30 +16,51 @@ using std::logic_error;
 // This routine is adapted from 2CDT from Kevin Thacker
 // (at his time taken from Pierre Guerrier's AIFF decoder).
 
-unsigned short cpc::crc (const unsigned char * data, size_t size)
+namespace
 {
-    typedef unsigned short word;
 
-    const word crcinitial= 0xFFFF;
-    const word crcpoly= 0x1021;
-    const word crcfinalxor= 0xFFFF;
-    const size_t cpcchunksize= 256;
+const address crcinitial= 0xFFFF;
+const address crcpoly= 0x1021;
+const address crcfinalxor= 0xFFFF;
+const size_t cpcchunksize= 256;
 
-    word crc= crcinitial;
-    for (size_t n= 0; n < cpcchunksize; ++n)
+} // namespace
+
+cpc::Crc::Crc () :
+    value (crcinitial)
+{ }
+
+void cpc::Crc::add (byte b)
+{
+    address crc= value ^ (static_cast <address> (b) << 8);
+    for (size_t i= 0; i < 8; ++i)
     {
-        char c= n < size ? data [n] : 0;
-        crc^= (static_cast <word> (c) << 8);
-        for (size_t i= 0; i < 8; ++i)
-        {
-            if (crc & 0x8000)
-                crc= (crc << 1) ^ crcpoly;
-            else
-                crc<<= 1;
-        }
+        if (crc & 0x8000)
+            crc= (crc << 1) ^ crcpoly;
+        else
+            crc<<= 1;
     }
-    crc^= crcfinalxor;
-    return crc;
+    value= crc;
+}
+
+address cpc::Crc::get () const
+{
+    return value ^ crcfinalxor;
+}
+
+void cpc::writechunk (ByteBuffer & out, const byte * data, size_t size)
+{
+    Crc crc;
+    for (size_t n= 0; n < size; ++n)
+    {
+        const byte b= data [n];
+        out.put (b);
+        crc.add (b);
+    }
+    for (size_t n= size; n < cpcchunksize; ++n)
+        crc.add (0);
+    out.fill (0, cpcchunksize - size);
+    out.putwordhl (crc.get () ); // CRC in hi-lo format.
 }
 
 //**************************************************************
@@ -55,7 +76,7 @@ public:
     void setlength (address len);
     void setloadaddress (address load);
     void setentry (address entry);
-    void write (std::ostream & out);
+    void write (ByteBuffer & out);
 private:
     void clear ();
 
@@ -142,22 +163,13 @@ void cpc::Header::setentry (address entry)
     data [0x1B]= hibyte (entry);
 }
 
-void cpc::Header::write (std::ostream & out)
+void cpc::Header::write (ByteBuffer & out)
 {
     out.put (0x2C);  // Header identifier.
 
-    out.write (reinterpret_cast <const char *> (data), headsize);
-    for (size_t i= headsize; i < 256; ++i)
-        out.put ('\x00');
-
-    address crcword= crc (data, headsize);
-    out.put (hibyte (crcword) ); // CRC in hi-lo format.
-    out.put (lobyte (crcword) );
+    writechunk (out, data, headsize);
 
-    out.put ('\xFF');
-    out.put ('\xFF');
-    out.put ('\xFF');
-    out.put ('\xFF');
+    out.fill (0xFF, 4);
 }
 
 //**************************************************************
@@ -226,7 +238,7 @@ void cpc::AmsdosHeader::setentry (address entry)
     amsdos [0x1B]= hibyte (entry);
 }
 
-void cpc::AmsdosHeader::write (std::ostream & out)
+void cpc::AmsdosHeader::write (ByteBuffer & out)
 {
     // 43-44 checksum of bytes 00-42
     address check= 0;
@@ -236,7 +248,7 @@ void cpc::AmsdosHeader::write (std::ostream & out)
     amsdos [0x44]= hibyte (check);
 
     // Write header.
-    out.write (reinterpret_cast <char *> (amsdos), headsize);
+    out.append (amsdos, headsize);
 }
 
 //**************************************************************
@@ -247,7 +259,8 @@ static const char
     tokHexNumber = '\x1C',
     tokCALL = '\x83',
     tokLOAD = '\xA8',
-    tokMEMORY = '\xAA';
+    tokMEMORY = '\xAA',
+    tokOUT = '\xB9';
 
 static std::string number (address n)
 {
@@ -280,6 +293,35 @@ std::string cpc::cpcbasicloader(const Asm & as)
     line = std::string(1, tokLOAD) + "\"!\"," + hexnumber(minused);
     basic+= basicline(20, line);
 
+    // The extra banks 4 to 7 of the 6128 are paged at 4000H with
+    // the configurations C4H to C7H of the gate array.
+    const std::vector <Asm::BankCode> banks = as.getbanks();
+    for (size_t i = 0; i < banks.size(); ++i)
+    {
+        const Asm::BankCode & bank = banks [i];
+        if (bank.bank < 4 || bank.bank > 7)
+            throw std::runtime_error("Bank " + std::to_string(bank.bank) +
+                " is not an extra bank of the CPC 6128");
+        if (bank.start < 0x4000 || bank.start >= 0x8000)
+            throw std::runtime_error("The banks of the CPC 6128 are "
+                "paged at 4000H");
+
+        // Line: 21... OUT &7F00, &C0 + bank
+        // Line: 22... LOAD "!", start
+        const address linenum = static_cast <address> (21 + 2 * i);
+        line = tokOUT + hexnumber(0x7F00) + ',' +
+            hexnumber(0xC0 + bank.bank);
+        basic+= basicline(linenum, line);
+        line = std::string(1, tokLOAD) + "\"!\"," + hexnumber(bank.start);
+        basic+= basicline(linenum + 1, line);
+    }
+    if (! banks.empty() )
+    {
+        // Line: 29 OUT &7F00, &C0
+        line = tokOUT + hexnumber(0x7F00) + ',' + hexnumber(0xC0);
+        basic+= basicline(29, line);
+    }
+
     if (as.hasentrypoint())
     {
         // Line: 30 CALL entry_point
@@ -294,27 +336,27 @@ std::string cpc::cpcbasicloader(const Asm & as)
     return basic;
 }
 
-void cpc::write_cdt_code(const Asm & as, std::ostream & out)
+namespace
 {
-    const address minused = as.getminused();
-    const address codesize = as.getcodesize();
-    const address entry = as.hasentrypoint() ? as.getentrypoint(): 0;
-    const byte * const mem = as.getmem();
 
+void writecdtfile(const Asm & as, ByteBuffer & out,
+    address start, address codesize, const byte * data, address entry)
+{
     cpc::Header head(as.getheadername());
     head.settype(cpc::Header::Binary);
     head.firstblock(true);
     head.lastblock(false);
     head.setlength(codesize);
-    head.setloadaddress(minused);
+    head.setloadaddress(start);
     head.setentry(entry);
 
-    address pos = minused;
+    address pos = start;
     address pending = codesize;
 
     const address maxblock = 2048;
     const address maxsubblock = 256;
     byte blocknum = 1;
+    const tzx::Timing & timing = tzx::cpctiming(as.getspeed() );
 
     while (pending > 0)
     {
@@ -338,13 +380,13 @@ void cpc::write_cdt_code(const Asm & as, std::ostream & out)
 
         // Write header.
 
-        tzx::writeturboblockhead(out, 263);
+        tzx::writeturboblockhead(out, 263, timing);
 
         head.write(out);
 
         // Write code.
 
-        tzx::writeturboblockhead(out, tzxdatalen);
+        tzx::writeturboblockhead(out, tzxdatalen, timing);
 
         out.put(0x16);  // Data block identifier.
 
@@ -354,22 +396,12 @@ void cpc::write_cdt_code(const Asm & as, std::ostream & out)
         {
             const address subblock = blockpending < maxsubblock ?
                 blockpending : maxsubblock;
-            out.write(reinterpret_cast <const char *>
-                (mem + subpos),
-                subblock);
-            for (size_t i = subblock; i < maxsubblock; ++i)
-                out.put('\0');
-            const address crc = cpc::crc(mem + subpos, subblock);
-            out.put(hibyte(crc) ); // CRC in hi-lo format.
-            out.put(lobyte(crc) );
+            cpc::writechunk(out, data + address(subpos - start), subblock);
             blockpending-= subblock;
             subpos+= subblock;
         }
 
-        out.put('\xFF');
-        out.put('\xFF');
-        out.put('\xFF');
-        out.put('\xFF');
+        out.fill(0xFF, 4);
 
         pos+= block;
         pending-= block;
@@ -377,7 +409,23 @@ void cpc::write_cdt_code(const Asm & as, std::ostream & out)
     }
 }
 
-void cpc::write_amsdos(const Asm & as, std::ostream & out)
+} // namespace
+
+void cpc::write_cdt_code(const Asm & as, ByteBuffer & out)
+{
+    const address minused = as.getminused();
+    const address entry = as.hasentrypoint() ? as.getentrypoint(): 0;
+    writecdtfile(as, out, minused, as.getcodesize(),
+        as.getmem() + minused, entry);
+
+    // A file for the code of each bank.
+    const std::vector <Asm::BankCode> banks = as.getbanks();
+    for (size_t i = 0; i < banks.size(); ++i)
+        writecdtfile(as, out, banks [i].start, banks [i].size,
+            banks [i].data, 0);
+}
+
+void cpc::write_amsdos(const Asm & as, ByteBuffer & out)
 {
     const address minused = as.getminused();
     const address codesize = as.getcodesize();
@@ -391,7 +439,7 @@ void cpc::write_amsdos(const Asm & as, std::ostream & out)
     head.write(out);
 
     // Write code.
-    as.writebincode(out);
+    out.append(as.getmem() + minused, codesize);
 }
 
 // End
@@ -12,7 +12,23 @@ class Asm;
 namespace cpc
 {
 
-unsigned short crc (const unsigned char * data, size_t size);
+// CRC of the chunks of 256 bytes of the tape blocks, that can be
+// accumulated while the bytes are written.
+
+class Crc
+{
+public:
+    Crc ();
+    void add (byte b);
+    address get () const;
+private:
+    address value;
+};
+
+// Chunk of a tape block: the data, filled with zeroes up to 256
+// bytes, and its CRC.
+
+void writechunk (ByteBuffer & out, const byte * data, size_t size);
 
 class Header
 {
@@ -32,7 +48,7 @@ public:
     void setblocklength (address blen);
     void setloadaddress (address load);
     void setentry (address entry);
-    void write (std::ostream & out);
+    void write (ByteBuffer & out);
 private:
     static const size_t headsize= 64;
     byte data [headsize];
@@ -71,8 +87,8 @@ private:
 
 std::string cpcbasicloader(const Asm & as);
 
-void write_cdt_code(const Asm & as, std::ostream & out);
-void write_amsdos(const Asm & as, std::ostream & out);
+void write_cdt_code(const Asm & as, ByteBuffer & out);
+void write_amsdos(const Asm & as, ByteBuffer & out);
 
 } // namespace cpc
 
@@ -0,0 +1,35 @@
+; Test of unused code elimination, assemble with --dropunused.
+
+	org 8000h
+
+start:
+	call used
+	ret
+
+used	PROC
+	LOCAL loop
+	ld b, 3
+loop:
+	djnz loop
+	call alsoused
+	ret
+	ENDP
+
+alsoused	PROC
+	ret
+	ENDP
+
+; Not referenced from the reachable code.
+
+unused	PROC
+	call alsounused
+	ret
+	ENDP
+
+alsounused	PROC
+	ld a, (value)
+	ret
+value	db 0
+	ENDP
+
+	end start
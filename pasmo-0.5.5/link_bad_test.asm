@@ -0,0 +1,6 @@
+; Invalid in a relocatable object, an external symbol
+; added to a relative one.
+
+	EXTRN EXT
+	DEFW EXT+$
+; End
@@ -0,0 +1,14 @@
+; Relocatable module linked with link_main_test.asm
+
+	EXTRN COUNT
+	PUBLIC PRINT, MSG, LIBSIZE
+PRINT:	LD A,(HL)
+	OR A
+	RET Z
+	INC HL
+	LD (COUNT),A
+	JP PRINT
+MSG:	DEFB 'Hi',0
+LIBSIZE	EQU $ - PRINT
+
+; End
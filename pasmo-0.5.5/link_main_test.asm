@@ -0,0 +1,15 @@
+; Relocatable module linked with link_lib_test.asm,
+; the result must be the same as link_whole_test.asm
+
+	EXTRN PRINT, MSG
+	PUBLIC START, COUNT
+START:	LD HL,MSG
+	CALL PRINT
+	LD A,(COUNT)
+	JR START
+COUNT:	DEFB 3
+	DEFW MSG+2, START
+VAL	EQU 1234H
+	DEFW VAL
+
+; End
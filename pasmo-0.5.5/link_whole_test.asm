@@ -0,0 +1,20 @@
+; link_main_test.asm and link_lib_test.asm linked at 8000H
+
+	ORG 8000H
+START:	LD HL,MSG
+	CALL PRINT
+	LD A,(COUNT)
+	JR START
+COUNT:	DEFB 3
+	DEFW MSG+2, START
+VAL	EQU 1234H
+	DEFW VAL
+PRINT:	LD A,(HL)
+	OR A
+	RET Z
+	INC HL
+	LD (COUNT),A
+	JP PRINT
+MSG:	DEFB 'Hi',0
+
+; End
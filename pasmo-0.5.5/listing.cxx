@@ -0,0 +1,83 @@
+// listing.cxx
+
+#include "listing.h"
+
+#include <algorithm>
+
+namespace
+{
+
+// Bytes shown in each line of the listing, the rest of the code
+// of the line is shown in the following ones.
+const size_t bytesperline = 4;
+
+// Minimal width of the file and line column.
+const size_t posfieldwidth = 20;
+
+char * putspaces(char * p, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        * p++ = ' ';
+    return p;
+}
+
+// Address and up to bytesperline bytes of code.
+
+char * putcode(char * p, const byte * mem, address memstart, address addr,
+    size_t len)
+{
+    p = puthex4(p, addr);
+    * p++ = ' ';
+    for (size_t i = 0; i < len; ++i)
+        p = puthex2(p, mem [address(addr + i - memstart)] );
+    return p;
+}
+
+} // namespace
+
+Listing::Listing()
+{ }
+
+void Listing::clear()
+{
+    text.clear();
+}
+
+void Listing::addline(const std::string & file, size_t numline,
+    const byte * mem, address memstart, address addr, size_t len,
+    const std::string & source)
+{
+    // Worst case, with 20 digits for the line number.
+    const size_t nlines = len / bytesperline + 1;
+    const size_t maxlen = nlines * (6 + bytesperline * 2) +
+        2 + file.size() + 21 + posfieldwidth + source.size();
+    char * p = text.reserve(maxlen);
+
+    const size_t first = len < bytesperline ? len : bytesperline;
+    p = putcode(p, mem, memstart, addr, first);
+    p = putspaces(p, (bytesperline - first) * 2 + 2);
+
+    char * const pos = p;
+    p = std::copy(file.begin(), file.end(), p);
+    * p++ = ':';
+    p = putdecimal(p, numline);
+    const size_t poslen = p - pos;
+    p = putspaces(p, poslen < posfieldwidth ? posfieldwidth - poslen : 1);
+    p = std::copy(source.begin(), source.end(), p);
+    * p++ = '\n';
+
+    for (size_t i = first; i < len; i += bytesperline)
+    {
+        const size_t n = len - i < bytesperline ? len - i : bytesperline;
+        p = putcode(p, mem, memstart, address(addr + i), n);
+        * p++ = '\n';
+    }
+    text.commit(p);
+}
+
+void Listing::write(std::ostream & out) const
+{
+    text.write(out);
+}
+
+// End
@@ -0,0 +1,35 @@
+#ifndef INCLUDE_LISTING_H
+#define INCLUDE_LISTING_H
+
+// listing.h
+
+// Listing of the last pass generated with the --list option, with
+// the file and line, the address, the code generated and the source
+// text of each line processed.
+// The lines are formatted directly in a buffer that is kept between
+// passes and assemblies, instead of using the stream operators.
+
+#include "pasmotypes.h"
+
+#include <iostream>
+#include <string>
+
+class Listing
+{
+public:
+    Listing();
+    // Discard the lines of a previous pass.
+    void clear();
+    // The code is taken from the memory given, that begins at the
+    // address memstart, starting at addr.
+    void addline(const std::string & file, size_t numline,
+        const byte * mem, address memstart, address addr, size_t len,
+        const std::string & source);
+    void write(std::ostream & out) const;
+private:
+    TextBuffer text;
+};
+
+#endif
+
+// End
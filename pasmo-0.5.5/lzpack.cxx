@@ -0,0 +1,224 @@
+// lzpack.cxx
+
+#include "lzpack.h"
+
+#include <stdexcept>
+
+namespace
+{
+
+const size_t maxmatch = 0x7F + lzpack::minmatch;
+const size_t maxliteral = 0x7F;
+const size_t maxoffset = 0xFFFF;
+const size_t maxchain = 256;
+
+const size_t hashbits = 14;
+const size_t hashsize = 1 << hashbits;
+const size_t nopos = size_t(-1);
+
+size_t hash(const byte * p)
+{
+    return ( (p [0] << 8) ^ (p [1] << 4) ^ p [2]) & (hashsize - 1);
+}
+
+class Packer
+{
+public:
+    Packer(const byte * datan, size_t sizen);
+    std::vector <byte> pack();
+private:
+    void insert(size_t pos);
+    size_t findmatch(size_t pos, size_t & offset) const;
+    void literals(size_t from, size_t to);
+
+    const byte * const data;
+    const size_t size;
+    std::vector <size_t> head;
+    std::vector <size_t> prev;
+    std::vector <byte> out;
+};
+
+Packer::Packer(const byte * datan, size_t sizen) :
+    data(datan),
+    size(sizen),
+    head(hashsize, nopos),
+    prev(sizen, nopos)
+{ }
+
+void Packer::insert(size_t pos)
+{
+    if (pos + 3 > size)
+        return;
+    const size_t h = hash(data + pos);
+    prev [pos] = head [h];
+    head [h] = pos;
+}
+
+size_t Packer::findmatch(size_t pos, size_t & offset) const
+{
+    size_t best = 0;
+    if (pos + lzpack::minmatch > size)
+        return best;
+    size_t limit = size - pos;
+    if (limit > maxmatch)
+        limit = maxmatch;
+
+    size_t chain = 0;
+    for (size_t cand = head [hash(data + pos) ];
+        cand != nopos && chain < maxchain;
+        cand = prev [cand], ++chain)
+    {
+        if (pos - cand > maxoffset)
+            break;
+        size_t len = 0;
+        while (len < limit && data [cand + len] == data [pos + len])
+            ++len;
+        if (len > best)
+        {
+            best = len;
+            offset = pos - cand;
+            if (len == limit)
+                break;
+        }
+    }
+    return best;
+}
+
+void Packer::literals(size_t from, size_t to)
+{
+    while (from < to)
+    {
+        size_t n = to - from;
+        if (n > maxliteral)
+            n = maxliteral;
+        out.push_back(static_cast <byte> (n) );
+        out.insert(out.end(), data + from, data + from + n);
+        from += n;
+    }
+}
+
+std::vector <byte> Packer::pack()
+{
+    out.clear();
+    size_t litstart = 0;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t offset = 0;
+        const size_t len = findmatch(pos, offset);
+        if (len >= lzpack::minmatch)
+        {
+            literals(litstart, pos);
+            out.push_back(static_cast <byte> (0x80 | (len - lzpack::minmatch) ) );
+            out.push_back(lobyte(static_cast <address> (offset) ) );
+            out.push_back(hibyte(static_cast <address> (offset) ) );
+            for (size_t i = 0; i < len; ++i)
+                insert(pos + i);
+            pos += len;
+            litstart = pos;
+        }
+        else
+        {
+            insert(pos);
+            ++pos;
+        }
+    }
+    literals(litstart, size);
+    out.push_back(0);
+    return out;
+}
+
+} // namespace
+
+std::vector <byte> lzpack::pack(const byte * data, size_t size)
+{
+    Packer packer(data, size);
+    return packer.pack();
+}
+
+std::vector <byte> lzpack::unpack(const std::vector <byte> & packed)
+{
+    std::vector <byte> result;
+    size_t pos = 0;
+    for (;;)
+    {
+        if (pos >= packed.size() )
+            throw std::runtime_error("Compressed data truncated");
+        const byte control = packed [pos++];
+        if (control == 0)
+            break;
+        if (control < 0x80)
+        {
+            if (pos + control > packed.size() )
+                throw std::runtime_error("Compressed data truncated");
+            result.insert(result.end(),
+                packed.begin() + pos, packed.begin() + pos + control);
+            pos += control;
+        }
+        else
+        {
+            if (pos + 2 > packed.size() )
+                throw std::runtime_error("Compressed data truncated");
+            const size_t offset = makeword(packed [pos], packed [pos + 1]);
+            pos += 2;
+            if (offset == 0 || offset > result.size() )
+                throw std::runtime_error("Invalid offset in compressed data");
+            const size_t len = (control & 0x7F) + minmatch;
+            // Byte by byte, the source may overlap the destination.
+            for (size_t i = 0; i < len; ++i)
+                result.push_back(result [result.size() - offset] );
+        }
+    }
+    return result;
+}
+
+std::vector <byte> lzpack::decompressor(address packed, address dest,
+    bool hasentry, address entry)
+{
+    const byte code [] = {
+        0x21, lobyte(packed), hibyte(packed), // LD HL,packed
+        0x11, lobyte(dest), hibyte(dest),     // LD DE,dest
+        // loop:
+        0x7E,                   // LD A,(HL)
+        0x23,                   // INC HL
+        0x06, 0x00,             // LD B,0
+        0xFE, 0x80,             // CP 80h
+        0x30, 0x08,             // JR NC,match
+        0xB7,                   // OR A
+        0x28, 0x1B,             // JR Z,done
+        0x4F,                   // LD C,A
+        0xED, 0xB0,             // LDIR
+        0x18, 0xF0,             // JR loop
+        // match:
+        0xE6, 0x7F,             // AND 7Fh
+        0xC6, byte(minmatch),   // ADD A,minmatch
+        0x4F,                   // LD C,A
+        0x7E,                   // LD A,(HL)
+        0x23,                   // INC HL
+        0xE5,                   // PUSH HL
+        0x66,                   // LD H,(HL)
+        0x6F,                   // LD L,A
+        0xD5,                   // PUSH DE
+        0xEB,                   // EX DE,HL
+        0xB7,                   // OR A
+        0xED, 0x52,             // SBC HL,DE
+        0xD1,                   // POP DE
+        0xED, 0xB0,             // LDIR
+        0xE1,                   // POP HL
+        0x23,                   // INC HL
+        0x18, 0xDA,             // JR loop
+        // done:
+    };
+    std::vector <byte> result(code, code + sizeof(code) );
+    if (hasentry)
+    {
+        result.push_back(0xC3); // JP entry
+        result.push_back(lobyte(entry) );
+        result.push_back(hibyte(entry) );
+    }
+    else
+        result.push_back(0xC9); // RET
+    return result;
+}
+
+// End
@@ -0,0 +1,38 @@
+#ifndef INCLUDE_LZPACK_H
+#define INCLUDE_LZPACK_H
+
+// lzpack.h
+
+// Simple LZ compression, with a format easy to decompress in the Z80.
+//
+// The compressed data is a sequence of blocks, each starting with a
+// control byte:
+//   0          End of data.
+//   1 to 7F    Number of literal bytes that follow.
+//   80 to FF   Copy (n & 7F) + minmatch bytes from the already
+//              decompressed data, a word with the offset back follows.
+
+#include "pasmotypes.h"
+
+#include <vector>
+
+namespace lzpack
+{
+
+const size_t minmatch = 4;
+
+std::vector <byte> pack(const byte * data, size_t size);
+
+std::vector <byte> unpack(const std::vector <byte> & packed);
+
+// Z80 routine that decompresses the data at packed into dest and
+// then jumps to entry, or returns if there is no entry point.
+
+std::vector <byte> decompressor(address packed, address dest,
+    bool hasentry, address entry);
+
+} // namespace lzpack
+
+#endif
+
+// End
@@ -0,0 +1,33 @@
+; Test of memory map and regions.
+; With OVERFLOW defined the small region overflows.
+; With INTRUDE defined the first block runs into a region.
+; With OVERLAP defined some code is overwritten.
+
+	.REGION code, 8000h, 80FFh
+
+	IFDEF OVERFLOW
+	.REGION small, 8000h, 8003h
+	ENDIF
+
+	IFDEF INTRUDE
+	.REGION late, 8005h, 8008h
+	ENDIF
+
+	org 8000h
+start:
+	ld hl, data
+	call subr
+	ret
+subr:
+	ret
+
+	org 8010h
+data:
+	db 1, 2, 3
+
+	IFDEF OVERLAP
+	org subr
+	nop
+	ENDIF
+
+	end start
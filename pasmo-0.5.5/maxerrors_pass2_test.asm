@@ -0,0 +1,16 @@
+; Errors found only in pass 2 with --maxerrors 0. The line that
+; fails keeps the size it had in pass 1, so AFTER does not move,
+; and the use of the name of a macro whose expansion fails is
+; still reported as undefined.
+
+	org 8000h
+FAILING	macro
+	ld a, nowhere
+	endm
+	ld hl, AFTER
+	jp nowhere
+AFTER:	nop
+	FAILING
+	ld a, FAILING
+
+	end
@@ -0,0 +1,17 @@
+; Errors found with --maxerrors 0, the uses of FOO are not
+; reported because the line that defines it fails.
+
+	org 8000h
+start:	ld a, b c
+FOO	equ 3 +
+	ld hl, FOO
+	IF BAR +
+	nop
+	ELSE
+	nop
+	ENDIF
+	jp start
+	ld q, 1
+	jp nowhere
+
+	end
@@ -2,12 +2,28 @@
 
 #include "asm.h"
 #include "asmerror.h"
+#include "buildcache.h"
 
 #include <string>
 #include <vector>
+#include <map>
 #include <fstream>
+#include <sstream>
+#include <filesystem>
 #include <iostream>
 #include <stdexcept>
+#include <chrono>
+#include <thread>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 using std::cout;
 using std::cerr;
@@ -48,6 +64,9 @@ const string optv("-v");
 const string optB("-B");
 const string optE("-E");
 const string optI("-I");
+const string optMD("-MD");
+const string optMF("-MF");
+const string optMP("-MP");
 
 const string opt86        ("--86");
 const string optalocal    ("--alocal");
@@ -55,26 +74,46 @@ const string optamsdos    ("--amsdos");
 const string optbin       ("--bin");
 const string optbracket   ("--bracket");
 const string optcdt       ("--cdt");
+const string optcache     ("--cache");
+const string optcachesize ("--cachesize");
 const string optcdtbas    ("--cdtbas");
 const string optcmd       ("--cmd");
+const string optcompress  ("--compress");
+const string optdropunused("--dropunused");
 const string optequ       ("--equ");
 const string opterr       ("--err");
 const string opthex       ("--hex");
+const string optlist      ("--list");
+const string optmap       ("--map");
+const string optmaxerrors ("--maxerrors");
 const string optmsx       ("--msx");
 const string optname      ("--name");
 const string optnocase    ("--nocase");
+const string optobj       ("--obj");
 const string optpass3     ("--pass3");
 const string optplus3dos  ("--plus3dos");
 const string optprl       ("--prl");
 const string optpublic    ("--public");
+const string optrelax     ("--relax");
 const string optsdrel     ("--sdrel");
+const string optsna       ("--sna");
+const string optsnapbase  ("--snapbase");
+const string optspeed     ("--speed");
+const string optsrcindex  ("--srcindex");
+const string optsrcmap    ("--srcmap");
+const string optstats     ("--stats");
+const string optstatsjson ("--statsjson");
+const string optsymformat ("--symformat");
 const string opttap       ("--tap");
 const string opttapbas    ("--tapbas");
+const string opttrace     ("--trace");
 const string opttrs       ("--trs");
 const string opttzx       ("--tzx");
 const string opttzxbas    ("--tzxbas");
 const string optw8080     ("--w8080");
+const string optwatch     ("--watch");
 const string optwerror    ("--werror");
+const string optz80snap   ("--z80snap");
 
 class Options
 {
@@ -91,7 +130,21 @@ public:
     string getfileout() const { return fileout; }
     string getfilesymbol() const { return filesymbol; }
     string getfilepublic() const;
+    string getfilemap() const { return filemap; }
+    string getfilelist() const { return filelist; }
+    string getfilesrcmap() const { return filesrcmap; }
+    string getfilesrcindex() const { return filesrcindex; }
+    bool getstats() const { return stats; }
+    string getfilestatsjson() const { return filestatsjson; }
+    string getfiletrace() const { return filetrace; }
     string getheadername() const { return headername; }
+    bool getwatch() const { return watch; }
+    string getfiledeps() const;
+    bool getdepsphony() const { return depsphony; }
+    bool usecache() const;
+    string getcachedir() const { return cachedir; }
+    unsigned long long getcachesize() const { return cachesize; }
+    string getcachekey() const;
     void apply(Asm & assembler) const;
 private:
     emitfunc_t emitfunc;
@@ -108,6 +161,14 @@ private:
     bool mode86;
     bool werror;
     bool pass3;
+    bool relax;
+    bool dropunused;
+    bool compress;
+    size_t maxerrors;
+    bool stats;
+    bool watch;
+    bool deps;
+    bool depsphony;
 
     vector <string> includedir;
     vector <string> labelpredef;
@@ -116,7 +177,19 @@ private:
     string fileout;
     string filesymbol;
     string filepublic;
+    string filemap;
+    string filelist;
+    string filesrcmap;
+    string filesrcindex;
+    string symformat;
+    string filestatsjson;
+    string filetrace;
+    string filedeps;
     string headername;
+    string speed;
+    string snapbase;
+    string cachedir;
+    unsigned long long cachesize;
 };
 
 const Options::emitfunc_t Options::emitdefault(& Asm::emitobject);
@@ -133,7 +206,16 @@ Options::Options(int argc, char * * argv) :
     warn8080(false),
     mode86(false),
     werror(false),
-    pass3(false)
+    pass3(false),
+    relax(false),
+    dropunused(false),
+    compress(false),
+    maxerrors(1),
+    stats(false),
+    watch(false),
+    deps(false),
+    depsphony(false),
+    cachesize(100 * 1024 * 1024)
 {
     int argpos;
     for (argpos = 1; argpos < argc; ++argpos)
@@ -149,8 +231,16 @@ Options::Options(int argc, char * * argv) :
             emitfunc = & Asm::emitcmd;
         else if (arg == optsdrel)
             emitfunc = & Asm::emitsdrel;
+        else if (arg == optobj)
+            emitfunc = & Asm::emitrelobj;
         else if (arg == optpass3)
             pass3 = true;
+        else if (arg == optrelax)
+            relax = true;
+        else if (arg == optdropunused)
+            dropunused = true;
+        else if (arg == optcompress)
+            compress = true;
         else if (arg == optplus3dos)
             emitfunc = & Asm::emitplus3dos;
         else if (arg == opttap)
@@ -171,6 +261,10 @@ Options::Options(int argc, char * * argv) :
             emitfunc = & Asm::emitamsdos;
         else if (arg == optmsx)
             emitfunc = & Asm::emitmsx;
+        else if (arg == optsna)
+            emitfunc = & Asm::emitsna;
+        else if (arg == optz80snap)
+            emitfunc = & Asm::emitz80snap;
         else if (arg == optpublic)
             emitpublic = true;
         else if (arg == optname)
@@ -180,6 +274,76 @@ Options::Options(int argc, char * * argv) :
                 throw NeedArgument(optname);
             headername = argv [argpos];
         }
+        else if (arg == optspeed)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optspeed);
+            speed = argv [argpos];
+        }
+        else if (arg == optsnapbase)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optsnapbase);
+            snapbase = argv [argpos];
+        }
+        else if (arg == optstats)
+            stats = true;
+        else if (arg == optwatch)
+            watch = true;
+        else if (arg == optstatsjson)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optstatsjson);
+            filestatsjson = argv [argpos];
+        }
+        else if (arg == opttrace)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(opttrace);
+            filetrace = argv [argpos];
+        }
+        else if (arg == optmap)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optmap);
+            filemap = argv [argpos];
+        }
+        else if (arg == optlist)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optlist);
+            filelist = argv [argpos];
+        }
+        else if (arg == optsrcmap)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optsrcmap);
+            filesrcmap = argv [argpos];
+        }
+        else if (arg == optsrcindex)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optsrcindex);
+            filesrcindex = argv [argpos];
+        }
+        else if (arg == optsymformat)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optsymformat);
+            symformat = argv [argpos];
+            if (symformat != "pasmo" && symformat != "sjasm" &&
+                    symformat != "nocash")
+                throw runtime_error("Invalid symbol format: " + symformat);
+        }
         else if (arg == optv)
             verbose = true;
         else if (arg == optd)
@@ -200,6 +364,45 @@ Options::Options(int argc, char * * argv) :
             mode86 = true;
         else if (arg == optwerror)
             werror = true;
+        else if (arg == optMD)
+            deps = true;
+        else if (arg == optMF)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optMF);
+            filedeps = argv [argpos];
+        }
+        else if (arg == optMP)
+            depsphony = true;
+        else if (arg == optcache)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optcache);
+            cachedir = argv [argpos];
+        }
+        else if (arg == optcachesize)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optcachesize);
+            char * aux;
+            const unsigned long kb = strtoul(argv [argpos], & aux, 10);
+            if (* aux != '\0')
+                throw runtime_error("Invalid cache size");
+            cachesize = kb * 1024ULL;
+        }
+        else if (arg == optmaxerrors)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optmaxerrors);
+            char * aux;
+            maxerrors = strtoul(argv [argpos], & aux, 10);
+            if (* aux != '\0')
+                throw runtime_error("Invalid number of errors");
+        }
         else if (arg == optI)
         {
             ++argpos;
@@ -254,6 +457,14 @@ Options::Options(int argc, char * * argv) :
 
     if (headername.empty() )
         headername = fileout;
+
+    // The speed profile can only be used when something loads the
+    // file at that speed: the turbo loader of tzxbas or the CPC
+    // firmware.
+    if (! speed.empty() && emitfunc != & Asm::emittzxbas &&
+            emitfunc != & Asm::emitcdt && emitfunc != & Asm::emitcdtbas)
+        throw runtime_error(optspeed + " can only be used with " +
+            opttzxbas + ", " + optcdt + " or " + optcdtbas);
 }
 
 string Options::getfilepublic() const
@@ -264,6 +475,103 @@ string Options::getfilepublic() const
         return filepublic;
 }
 
+string Options::getfiledeps() const
+{
+    // As in gcc, by default the name of the object file with
+    // its extension replaced by .d
+    if (! filedeps.empty() || ! deps)
+        return filedeps;
+    string::size_type pos = fileout.find_last_of('.');
+    if (pos != string::npos && fileout.find('/', pos) != string::npos)
+        pos = string::npos;
+    return fileout.substr(0, pos) + ".d";
+}
+
+// The build cache is not used when there are outputs or
+// messages other than the generated files, or with a base
+// snapshot, that is not one of the files tracked.
+
+bool Options::usecache() const
+{
+    return ! cachedir.empty() && ! watch && debugtype == Asm::NoDebug &&
+        ! stats && filestatsjson.empty() && filetrace.empty() &&
+        filesymbol != "-" && getfilepublic() != "-" && snapbase.empty();
+}
+
+// Options that affect the result of the assembly, as text.
+
+string Options::getcachekey() const
+{
+    static const std::pair <const string *, emitfunc_t> emitters [] = {
+        std::make_pair(& optbin, & Asm::emitobject),
+        std::make_pair(& opthex, & Asm::emithex),
+        std::make_pair(& optprl, & Asm::emitprl),
+        std::make_pair(& optcmd, & Asm::emitcmd),
+        std::make_pair(& optsdrel, & Asm::emitsdrel),
+        std::make_pair(& optobj, & Asm::emitrelobj),
+        std::make_pair(& optplus3dos, & Asm::emitplus3dos),
+        std::make_pair(& opttap, & Asm::emittap),
+        std::make_pair(& opttrs, & Asm::emittrs),
+        std::make_pair(& opttzx, & Asm::emittzx),
+        std::make_pair(& optcdt, & Asm::emitcdt),
+        std::make_pair(& opttapbas, & Asm::emittapbas),
+        std::make_pair(& opttzxbas, & Asm::emittzxbas),
+        std::make_pair(& optcdtbas, & Asm::emitcdtbas),
+        std::make_pair(& optamsdos, & Asm::emitamsdos),
+        std::make_pair(& optmsx, & Asm::emitmsx),
+        std::make_pair(& optsna, & Asm::emitsna),
+        std::make_pair(& optz80snap, & Asm::emitz80snap)
+    };
+
+    string key("pasmo " + pasmoversion + '\n');
+    for (size_t i = 0; i < sizeof(emitters) / sizeof(emitters [0]); ++i)
+        if (emitfunc == emitters [i].second)
+            key+= * emitters [i].first + '\n';
+    const std::pair <bool, const string *> flags [] = {
+        std::make_pair(emitpublic, & optpublic),
+        std::make_pair(nocase, & optnocase),
+        std::make_pair(autolocal, & optalocal),
+        std::make_pair(bracketonly, & optbracket),
+        std::make_pair(warn8080, & optw8080),
+        std::make_pair(mode86, & opt86),
+        std::make_pair(werror, & optwerror),
+        std::make_pair(pass3, & optpass3),
+        std::make_pair(relax, & optrelax),
+        std::make_pair(dropunused, & optdropunused),
+        std::make_pair(compress, & optcompress)
+    };
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags [0]); ++i)
+        if (flags [i].first)
+            key+= * flags [i].second + '\n';
+    // The paths of the files read are relative to the current
+    // directory, it is part of the key and the include
+    // directories are made absolute.
+    key+= "cwd " + std::filesystem::current_path().string() + '\n';
+    for (size_t i = 0; i < includedir.size(); ++i)
+        key+= optI + ' ' +
+            std::filesystem::absolute(includedir [i] ).string() + '\n';
+    for (size_t i = 0; i < labelpredef.size(); ++i)
+        key+= optequ + ' ' + labelpredef [i] + '\n';
+    key+= optname + ' ' + headername + '\n';
+    key+= optspeed + ' ' + speed + '\n';
+    key+= optsymformat + ' ' + symformat + '\n';
+
+    // The outputs stored depend on the files given.
+    if (! emitpublic && ! filesymbol.empty() )
+        key+= "symbol\n";
+    if (! getfilepublic().empty() )
+        key+= "public\n";
+    if (! filemap.empty() )
+        key+= optmap + '\n';
+    if (! filelist.empty() )
+        key+= optlist + '\n';
+    if (! filesrcmap.empty() )
+        key+= optsrcmap + '\n';
+    if (! filesrcindex.empty() )
+        key+= optsrcindex + '\n';
+    return key;
+}
+
 void Options::apply(Asm & assembler) const
 {
     assembler.setdebugtype(debugtype);
@@ -286,6 +594,13 @@ void Options::apply(Asm & assembler) const
         assembler.setwerror ();
     if (pass3)
         assembler.setpass3 ();
+    if (relax)
+        assembler.relax ();
+    if (dropunused)
+        assembler.dropunused ();
+    if (compress)
+        assembler.compress ();
+    assembler.setmaxerrors(maxerrors);
 
     for (size_t i = 0; i < includedir.size(); ++i)
         assembler.addincludedir(includedir [i] );
@@ -294,46 +609,160 @@ void Options::apply(Asm & assembler) const
         assembler.addpredef(labelpredef [i] );
 
     assembler.setheadername(headername);
+    assembler.setspeed(speed);
+    assembler.setsnapbase(snapbase);
+
+    if (! filetrace.empty() )
+        assembler.trace();
+    if (! filelist.empty() )
+        assembler.listing();
+    if (! filesrcmap.empty() || ! filesrcindex.empty() )
+        assembler.sourcemap();
+    if (symformat == "sjasm")
+        assembler.setsymbolformat(Asm::SymbolSjasm);
+    else if (symformat == "nocash")
+        assembler.setsymbolformat(Asm::SymbolNocash);
 }
 
-int doit(Asm & assembler, int argc, char * * argv)
+// Output file that in atomic mode is written with a temporary name
+// and renamed when complete, so the previous version is available
+// until then.
+
+class OutFile : public std::ofstream
 {
-    // Process command line options.
+public:
+    OutFile();
+    ~OutFile();
+    void open(const string & filename_n, bool atomic,
+        std::ios::openmode mode = std::ios::out);
+    void commit();
+private:
+    string filename;
+    string tmpname;
+};
 
-    Options option(argc, argv);
+OutFile::OutFile()
+{ }
 
-    if (option.redirerr() )
-        perr = & cout;
+OutFile::~OutFile()
+{
+    // Not committed, discard the temporary file.
+    if (! tmpname.empty() )
+    {
+        std::ofstream::close();
+        remove(tmpname.c_str() );
+    }
+}
 
-    // Assemble.
+void OutFile::open(const string & filename_n, bool atomic,
+    std::ios::openmode mode)
+{
+    filename = filename_n;
+    if (atomic)
+        tmpname = filename + ".tmp";
+    std::ofstream::open(atomic ? tmpname.c_str() : filename.c_str(), mode);
+}
 
-    option.apply(assembler);
+void OutFile::commit()
+{
+    std::ofstream::close();
+    if (! tmpname.empty() )
+    {
+        const string name(tmpname);
+        tmpname.clear();
+        if (rename(name.c_str(), filename.c_str() ) != 0)
+            throw runtime_error("Error renaming " + name);
+    }
+}
 
-    assembler.loadfile(option.getfilein() );
-    assembler.processfile();
+// Quote a file name for make.
 
-    // Generate ouptut file.
+string makequote(const string & name)
+{
+    string r;
+    for (string::size_type i = 0; i < name.size(); ++i)
+    {
+        const char c = name [i];
+        if (c == ' ' || c == '\t' || c == '#' || c == '\\')
+            r+= '\\';
+        else if (c == '$')
+            r+= '$';
+        r+= c;
+    }
+    return r;
+}
 
-    std::ofstream out(option.getfileout().c_str(),
-        std::ios::out | std::ios::binary);
-    if (! out.is_open() )
-        throw runtime_error("Error creating object file");
+// Dependencies of the object file in the format used by make
+// and ninja, optionally with an empty rule for each file so make
+// does not fail when one of them is removed.
 
+void writedeps(std::ostream & out, const string & target,
+    const vector <string> & files, bool phony)
+{
+    out << makequote(target) << ':';
+    for (size_t i = 0; i < files.size(); ++i)
+        out << " \\\n " << makequote(files [i] );
+    out << '\n';
+    if (phony)
+    {
+        // Not for the main source, as gcc does.
+        for (size_t i = 1; i < files.size(); ++i)
+            out << '\n' << makequote(files [i] ) << ":\n";
+    }
+}
 
-    (assembler.* option.getemit() ) (out);
+void writedepsfile(const Options & option, const vector <string> & files,
+    bool atomic)
+{
+    const string filedeps = option.getfiledeps();
+    if (! filedeps.empty() )
+    {
+        OutFile dout;
+        dout.open(filedeps, atomic);
+        if (! dout.is_open() )
+            throw runtime_error("Error creating dependency file");
+        writedeps(dout, option.getfileout(), files, option.getdepsphony() );
+        dout.commit();
+    }
+}
+
+void writeoutputs(Asm & assembler, const Options & option)
+{
+    // In watch mode the files are replaced atomically, to not
+    // let other programs see partially written files.
+    const bool atomic = option.getwatch();
 
-    out.close();
+    // Generate ouptut file. It is built in memory before creating
+    // the file, so a failure while generating it does not leave a
+    // partial one.
+
+    assembler.beginphase("emit", option.getfileout() );
+    vector <byte> image;
+    assembler.emit(option.getemit(), image);
+
+    OutFile out;
+    out.open(option.getfileout(), atomic, std::ios::out | std::ios::binary);
+    if (! out.is_open() )
+        throw runtime_error("Error creating object file");
+    out.write(reinterpret_cast <const char *> (image.data() ), image.size() );
+    if (! out)
+        throw runtime_error("Error writing object file");
+    assembler.addemitted(image.size() );
+    out.commit();
+    assembler.endphase();
 
     // Generate symbol table and public symbol table if required.
 
+    assembler.beginphase("symbols");
+
     string filesymbol = option.getfilesymbol();
     if (! option.publiconly() && ! filesymbol.empty() )
     {
-        std::ofstream sout;
+        OutFile sout;
         std::streambuf * cout_buf = 0;
         if (filesymbol != "-")
         {
-            sout.open(filesymbol.c_str() );
+            sout.open(filesymbol, atomic);
             if (! sout.is_open() )
                 throw runtime_error("Error creating symbols file");
             cout_buf = cout.rdbuf();
@@ -343,18 +772,18 @@ int doit(Asm & assembler, int argc, char * * argv)
         if (cout_buf)
         {
             cout.rdbuf(cout_buf);
-            sout.close();
+            sout.commit();
         }
     }
 
     const string filepublic = option.getfilepublic();
     if (! filepublic.empty() )
     {
-        std::ofstream sout;
+        OutFile sout;
         std::streambuf * cout_buf = 0;
         if (filepublic != "-")
         {
-            sout.open(filepublic.c_str() );
+            sout.open(filepublic, atomic);
             if (! sout.is_open() )
                 throw runtime_error("Error creating public symbols file");
             cout_buf = cout.rdbuf();
@@ -364,9 +793,423 @@ int doit(Asm & assembler, int argc, char * * argv)
         if (cout_buf)
         {
             cout.rdbuf(cout_buf);
-            sout.close();
+            sout.commit();
+        }
+    }
+
+    // Generate memory map if required.
+
+    const string filemap = option.getfilemap();
+    if (! filemap.empty() )
+    {
+        OutFile mout;
+        mout.open(filemap, atomic);
+        if (! mout.is_open() )
+            throw runtime_error("Error creating map file");
+        assembler.dumpmap(mout);
+        mout.commit();
+    }
+
+    // Generate listing if required.
+
+    const string filelist = option.getfilelist();
+    if (! filelist.empty() )
+    {
+        OutFile lout;
+        lout.open(filelist, atomic);
+        if (! lout.is_open() )
+            throw runtime_error("Error creating listing file");
+        assembler.dumplisting(lout);
+        lout.commit();
+    }
+
+    // Generate source map and source index if required.
+
+    const string filesrcmap = option.getfilesrcmap();
+    if (! filesrcmap.empty() )
+    {
+        OutFile rout;
+        rout.open(filesrcmap, atomic);
+        if (! rout.is_open() )
+            throw runtime_error("Error creating source map file");
+        assembler.dumpsourcemap(rout);
+        rout.commit();
+    }
+
+    const string filesrcindex = option.getfilesrcindex();
+    if (! filesrcindex.empty() )
+    {
+        OutFile iout;
+        iout.open(filesrcindex, atomic, std::ios::out | std::ios::binary);
+        if (! iout.is_open() )
+            throw runtime_error("Error creating source index file");
+        assembler.dumpsourceindex(iout);
+        iout.commit();
+    }
+
+    // Generate dependency file if required.
+
+    writedepsfile(option, assembler.getopenedfiles(), atomic);
+
+    assembler.endphase();
+
+    // Show statistics if required.
+
+    if (option.getstats() )
+        assembler.dumpstats(cerr, false);
+
+    const string filestatsjson = option.getfilestatsjson();
+    if (! filestatsjson.empty() )
+    {
+        OutFile jout;
+        jout.open(filestatsjson, atomic);
+        if (! jout.is_open() )
+            throw runtime_error("Error creating stats file");
+        assembler.dumpstats(jout, true);
+        jout.commit();
+    }
+
+    const string filetrace = option.getfiletrace();
+    if (! filetrace.empty() )
+    {
+        OutFile tout;
+        tout.open(filetrace, atomic);
+        if (! tout.is_open() )
+            throw runtime_error("Error creating trace file");
+        assembler.dumptrace(tout);
+        tout.commit();
+    }
+}
+
+//--------------------------------------------------------------
+//        Watch mode.
+//--------------------------------------------------------------
+
+// Lines between the checkpoints used to assemble again.
+const size_t watchinterval = 1000;
+
+typedef std::vector <std::pair <string, string> > dirfiles_t;
+
+// Split the paths in directory and file name.
+
+dirfiles_t splitpaths(const vector <string> & files)
+{
+    dirfiles_t dirfiles;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        const string & path = files [i];
+        const string::size_type pos = path.find_last_of('/');
+        if (pos == string::npos)
+            dirfiles.push_back(std::make_pair(string("."), path) );
+        else
+            dirfiles.push_back(std::make_pair(
+                pos == 0 ? string("/") : path.substr(0, pos),
+                path.substr(pos + 1) ) );
+    }
+    return dirfiles;
+}
+
+// Changes in the files used. The files are registered before each
+// assembly, so the changes saved while assembling are not lost:
+// inotify keeps the events until they are read, and when polling
+// the modification times are compared with the ones before it.
+
+class Watcher
+{
+public:
+    Watcher();
+    ~Watcher();
+    void watch(const vector <string> & files);
+    void wait(const vector <string> & files);
+private:
+    typedef std::pair <time_t, off_t> filetime_t;
+    static filetime_t filetime(const string & file);
+    void pollwait(const vector <string> & files);
+    #ifdef __linux__
+    void inotifywait(const vector <string> & files);
+    // The inotify descriptor, -1 if it can't be used, and the
+    // directory of each watch.
+    int fd;
+    std::map <int, string> wddirs;
+    #endif
+    std::map <string, filetime_t> times;
+};
+
+Watcher::Watcher()
+{
+    #ifdef __linux__
+    fd = inotify_init1(IN_CLOEXEC);
+    #endif
+}
+
+Watcher::~Watcher()
+{
+    #ifdef __linux__
+    if (fd >= 0)
+        close(fd);
+    #endif
+}
+
+Watcher::filetime_t Watcher::filetime(const string & file)
+{
+    struct stat st;
+    if (stat(file.c_str(), & st) == 0)
+        return filetime_t(st.st_mtime, st.st_size);
+    else
+        return filetime_t(time_t(0), off_t(-1) );
+}
+
+void Watcher::watch(const vector <string> & files)
+{
+    times.clear();
+    for (size_t i = 0; i < files.size(); ++i)
+        times [files [i] ] = filetime(files [i] );
+
+    #ifdef __linux__
+    // The directories are watched instead of the files, because
+    // many editors save by writing a new file and renaming it.
+    // Adding again a watch for a directory just returns it.
+    const dirfiles_t dirfiles = splitpaths(files);
+    for (size_t i = 0; fd >= 0 && i < dirfiles.size(); ++i)
+    {
+        const string & dir = dirfiles [i].first;
+        const int wd = inotify_add_watch(fd, dir.c_str(),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+        if (wd < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        else
+            wddirs [wd] = dir;
+    }
+    #endif
+}
+
+void Watcher::wait(const vector <string> & files)
+{
+    #ifdef __linux__
+    if (fd >= 0)
+    {
+        // The files used in the last assembly may be new.
+        watch(files);
+        if (fd >= 0)
+        {
+            inotifywait(files);
+            return;
+        }
+    }
+    #endif
+    pollwait(files);
+}
+
+#ifdef __linux__
+
+void Watcher::inotifywait(const vector <string> & files)
+{
+    // After the first change, wait until no more events arrive
+    // for a while, a save can generate several of them.
+    const dirfiles_t dirfiles = splitpaths(files);
+    bool changed = false;
+    alignas(struct inotify_event) char buffer [4096];
+    for (;;)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        const int r = poll(& pfd, 1, changed ? 100 : -1);
+        if (r == 0)
+            break;
+        if (r < 0)
+            continue;
+        const ssize_t len = read(fd, buffer, sizeof(buffer) );
+        for (ssize_t pos = 0; pos < len; )
+        {
+            const struct inotify_event * const event =
+                reinterpret_cast <const struct inotify_event *>
+                    (buffer + pos);
+            if (event->len > 0)
+                for (size_t i = 0; i < dirfiles.size(); ++i)
+                    if (wddirs [event->wd] == dirfiles [i].first &&
+                            dirfiles [i].second == event->name)
+                        changed = true;
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+#endif
+
+void Watcher::pollwait(const vector <string> & files)
+{
+    // The files not used in the previous assembly are compared
+    // with their times when starting to wait.
+    for (size_t i = 0; i < files.size(); ++i)
+        if (times.find(files [i] ) == times.end() )
+            times [files [i] ] = filetime(files [i] );
+    for (;;)
+    {
+        for (size_t i = 0; i < files.size(); ++i)
+            if (filetime(files [i] ) != times [files [i] ] )
+                return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(500) );
+    }
+}
+
+int watch(Asm & assembler, const Options & option)
+{
+    // Keep the assembler loaded and assemble again, from the first
+    // line changed, each time one of the files used changes.
+
+    assembler.incremental(watchinterval);
+    Watcher watcher;
+    vector <string> files(1, option.getfilein() );
+    for (;;)
+    {
+        watcher.watch(files);
+        assembler.resetstats();
+
+        typedef std::chrono::steady_clock clock;
+        const clock::time_point start = clock::now();
+        bool success = false;
+        try
+        {
+            assembler.reloadfile(option.getfilein() );
+            assembler.processfile();
+            writeoutputs(assembler, option);
+            success = true;
+        }
+        catch (AsmError & err)
+        {
+            assembler.showerrorinfo(* perr, err.getline(), err.message());
+        }
+        catch (ErrorAlreadyReported &)
+        {
+        }
+        catch (std::exception & e)
+        {
+            * perr << "ERROR: " << e.what() << '\n';
+        }
+        const double seconds =
+            std::chrono::duration <double> (clock::now() - start).count();
+        cerr << (success ? "Assembled " : "Failed ") <<
+            option.getfilein() << " in " << seconds << " s\n";
+
+        files = assembler.getopenedfiles();
+        if (files.empty() )
+            files.push_back(option.getfilein() );
+        watcher.wait(files);
+    }
+}
+
+//--------------------------------------------------------------
+//        Build cache.
+//--------------------------------------------------------------
+
+// Failures of the cache are only warned, the files are
+// assembled as usual.
+
+void cachewarning(const std::exception & e)
+{
+    cerr << "WARNING: build cache: " << e.what() << '\n';
+}
+
+int cachedassemble(Asm & assembler, const Options & option)
+{
+    // Names of the outputs in the cache and their files.
+    std::vector <std::pair <string, string> > outputs;
+    outputs.push_back(std::make_pair("object", option.getfileout() ) );
+    if (! option.publiconly() && ! option.getfilesymbol().empty() )
+        outputs.push_back(std::make_pair("symbol", option.getfilesymbol() ) );
+    if (! option.getfilepublic().empty() )
+        outputs.push_back(std::make_pair("public", option.getfilepublic() ) );
+    if (! option.getfilemap().empty() )
+        outputs.push_back(std::make_pair("map", option.getfilemap() ) );
+    if (! option.getfilelist().empty() )
+        outputs.push_back(std::make_pair("list", option.getfilelist() ) );
+    if (! option.getfilesrcmap().empty() )
+        outputs.push_back(std::make_pair("srcmap", option.getfilesrcmap() ) );
+    if (! option.getfilesrcindex().empty() )
+        outputs.push_back(std::make_pair("srcindex",
+            option.getfilesrcindex() ) );
+
+    BuildCache cache(option.getcachedir(), option.getcachesize() );
+    vector <string> inputs;
+    bool found = false;
+    try
+    {
+        cache.setkey(option.getcachekey(), option.getfilein() );
+        if (cache.lookup(inputs) )
+        {
+            for (size_t i = 0; i < outputs.size(); ++i)
+                cache.getoutput(outputs [i].first, outputs [i].second);
+            cerr << cache.getwarnings();
+            found = true;
         }
     }
+    catch (std::exception & e)
+    {
+        cachewarning(e);
+    }
+    if (found)
+    {
+        writedepsfile(option, inputs, false);
+        return 0;
+    }
+
+    // Keep the warnings to show them again when the entry is used.
+    std::ostringstream warnings;
+    assembler.setwarnstream(warnings);
+    try
+    {
+        assembler.beginphase("assemble");
+        assembler.loadfile(option.getfilein() );
+        assembler.processfile();
+        assembler.endphase();
+
+        writeoutputs(assembler, option);
+    }
+    catch (...)
+    {
+        cerr << warnings.str();
+        throw;
+    }
+    cerr << warnings.str();
+
+    try
+    {
+        cache.store(assembler.getopenedfiles(), assembler.getmissingfiles(),
+            outputs, warnings.str() );
+    }
+    catch (std::exception & e)
+    {
+        cachewarning(e);
+    }
+    return 0;
+}
+
+int doit(Asm & assembler, int argc, char * * argv)
+{
+    // Process command line options.
+
+    Options option(argc, argv);
+
+    if (option.redirerr() )
+        perr = & cout;
+
+    // Assemble.
+
+    option.apply(assembler);
+
+    if (option.getwatch() )
+        return watch(assembler, option);
+    if (option.usecache() )
+        return cachedassemble(assembler, option);
+
+    assembler.beginphase("assemble");
+    assembler.loadfile(option.getfilein() );
+    assembler.processfile();
+    assembler.endphase();
+
+    writeoutputs(assembler, option);
 
     return 0;
 }
@@ -0,0 +1,176 @@
+// pasmolink.cxx
+
+// Linker for the relocatable object files generated by pasmo --obj.
+
+#include "relobj.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <stdlib.h>
+
+using std::cout;
+using std::cerr;
+
+namespace
+{
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+const string pasmoversion(VERSION);
+
+class Usage { };
+
+class NeedArgument : public runtime_error
+{
+public:
+    NeedArgument(const string & option) :
+        runtime_error("Option " + option + " requires argument")
+    { }
+};
+
+class InvalidOption : public runtime_error
+{
+public:
+    InvalidOption(const string & option) :
+        runtime_error("Invalid option: " + option)
+    { }
+};
+
+const string optorg("--org");
+const string optsym("--sym");
+
+// Addresses are accepted in decimal, with 0x prefix or with
+// H suffix as in the assembler.
+
+address parseaddress(const string & str)
+{
+    string digits(str);
+    int numbase = 0;
+    if (! digits.empty() &&
+            (digits [digits.size() - 1] == 'H' ||
+            digits [digits.size() - 1] == 'h') )
+    {
+        digits.erase(digits.size() - 1);
+        numbase = 16;
+    }
+    char * aux;
+    const unsigned long value = strtoul(digits.c_str(), & aux, numbase);
+    if (digits.empty() || * aux != '\0' || value > 0xFFFF)
+        throw runtime_error("Invalid address: " + str);
+    return static_cast <address> (value);
+}
+
+int doit(int argc, char * * argv)
+{
+    relobj::Linker linker;
+    string filesymbol;
+    int argpos;
+    for (argpos = 1; argpos < argc; ++argpos)
+    {
+        const string arg(argv [argpos] );
+        if (arg == optsym)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optsym);
+            filesymbol = argv [argpos];
+        }
+        else if (arg == optorg)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optorg);
+            linker.setorg(parseaddress(argv [argpos] ) );
+        }
+        else if (arg == "--")
+        {
+            ++argpos;
+            break;
+        }
+        else if (arg.substr(0, 1) == "-")
+            throw InvalidOption(arg);
+        else
+            break;
+    }
+
+    // The output file, and the objects with the --org options
+    // that give the address of the next ones.
+
+    if (argpos >= argc)
+        throw Usage();
+    const string fileout = argv [argpos];
+    ++argpos;
+
+    size_t nobjects = 0;
+    for ( ; argpos < argc; ++argpos)
+    {
+        const string arg(argv [argpos] );
+        if (arg == optorg)
+        {
+            ++argpos;
+            if (argpos >= argc)
+                throw NeedArgument(optorg);
+            linker.setorg(parseaddress(argv [argpos] ) );
+            continue;
+        }
+        std::ifstream in(arg.c_str() );
+        if (! in.is_open() )
+            throw runtime_error("Error opening " + arg);
+        relobj::Object object;
+        object.read(in, arg);
+        linker.add(object, arg);
+        ++nobjects;
+    }
+    if (nobjects == 0)
+        throw Usage();
+
+    linker.link();
+
+    std::ofstream out(fileout.c_str(), std::ios::out | std::ios::binary);
+    if (! out.is_open() )
+        throw runtime_error("Error creating " + fileout);
+    linker.writebin(out);
+    out.close();
+    if (! out)
+        throw runtime_error("Error writing " + fileout);
+
+    if (! filesymbol.empty() )
+    {
+        std::ofstream sout(filesymbol.c_str() );
+        if (! sout.is_open() )
+            throw runtime_error("Error creating " + filesymbol);
+        linker.writesymbols(sout);
+    }
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char * * argv)
+{
+    try
+    {
+        return doit(argc, argv);
+    }
+    catch (std::exception & e)
+    {
+        cerr << "ERROR: " << e.what() << '\n';
+    }
+    catch (Usage &)
+    {
+        cerr <<    "Pasmo link v. " << pasmoversion <<
+            " (C) 2004-2021 Julian Albo\n\n"
+            "Usage:\n\n"
+            "\tpasmo-link [options] output [--org address] object ...\n\n"
+            "See the README file for details.\n";
+    }
+    return 1;
+}
+
+// End
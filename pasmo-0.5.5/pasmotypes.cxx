@@ -2,13 +2,33 @@
 
 #include "pasmotypes.h"
 
+#include <algorithm>
+
+#include <string.h>
+
 namespace
 {
 
-const char hexdigit[] =
-{
-    '0', '1', '2', '3', '4', '5', '6', '7',
-    '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+// Hexadecimal digits of each byte value, written as a literal
+// to be available during the static initialization.
+
+const char hexpair [] =
+    "000102030405060708090A0B0C0D0E0F"
+    "101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F"
+    "303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F"
+    "505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F"
+    "707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F"
+    "909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+    "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+    "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+    "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
 
 } // namespace
 
@@ -27,26 +47,312 @@ address makeword(byte low, byte high)
     return low | (address(high) << 8);
 }
 
-void putword(std::ostream & os, address word)
+char * puthex2(char * p, byte b)
 {
-    os.put(lobyte(word) );
-    os.put(hibyte(word) );
+    const char * const hex = hexpair + b * 2;
+    p [0] = hex [0];
+    p [1] = hex [1];
+    return p + 2;
 }
 
+char * puthex4(char * p, address n)
+{
+    p = puthex2(p, hibyte(n) );
+    return puthex2(p, lobyte(n) );
+}
+
+char * puthex8(char * p, size_t nn)
+{
+    p = puthex4(p, (nn >> 16) & 0xFFFF);
+    return puthex4(p, nn & 0xFFFF);
+}
+
+char * putdecimal(char * p, size_t n)
+{
+    char digits [20];
+    size_t len = 0;
+    do
+    {
+        digits [len++] = static_cast <char> ('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+    while (len > 0)
+        * p++ = digits [--len];
+    return p;
+}
+
+// The results fit in the small string buffer of the usual
+// implementations, so they do not allocate.
+
 std::string hex2str(byte b)
 {
-    return std::string(1, hexdigit[ (b >> 4) & 0x0F] ) +
-        hexdigit[b & 0x0F];
+    char buf [2];
+    return std::string(buf, puthex2(buf, b) );
 }
 
 std::string hex4str(address n)
 {
-    return hex2str(hibyte(n) ) + hex2str(lobyte(n) );
+    char buf [4];
+    return std::string(buf, puthex4(buf, n) );
 }
 
 std::string hex8str(size_t nn)
 {
-    return hex4str( (nn >> 16) & 0xFFFF) + hex4str(nn & 0xFFFF);
+    char buf [8];
+    return std::string(buf, puthex8(buf, nn) );
+}
+
+char * puttablabel(char * p, const std::string & str)
+{
+    p = std::copy(str.begin(), str.end(), p);
+    const std::string::size_type l = str.size();
+    if (l < 8)
+    {
+        * p++ = '\t';
+        * p++ = '\t';
+    }
+    else
+        if (l < 16)
+            * p++ = '\t';
+        else
+            * p++ = ' ';
+    return p;
+}
+
+std::string tablabel(const std::string & str)
+{
+    std::string result(str.size() + 2, ' ');
+    result.resize(puttablabel(& result [0], str) - & result [0]);
+    return result;
+}
+
+//--------------------------------------------------------------
+
+TextBuffer::TextBuffer() :
+    used(0)
+{ }
+
+void TextBuffer::clear()
+{
+    used = 0;
+}
+
+char * TextBuffer::reserve(size_t len)
+{
+    if (used + len > buffer.size() )
+    {
+        size_t size = buffer.empty() ? 4096 : buffer.size() * 2;
+        if (size < used + len)
+            size = used + len;
+        buffer.resize(size);
+    }
+    return buffer.data() + used;
+}
+
+void TextBuffer::commit(const char * end)
+{
+    used = end - buffer.data();
+}
+
+void TextBuffer::append(char c)
+{
+    char * const p = reserve(1);
+    * p = c;
+    commit(p + 1);
+}
+
+void TextBuffer::append(const char * str)
+{
+    const size_t len = strlen(str);
+    char * const p = reserve(len);
+    commit(std::copy(str, str + len, p) );
+}
+
+void TextBuffer::append(const std::string & str)
+{
+    char * const p = reserve(str.size() );
+    commit(std::copy(str.begin(), str.end(), p) );
+}
+
+void TextBuffer::appendhex2(byte b)
+{
+    commit(puthex2(reserve(2), b) );
+}
+
+void TextBuffer::appendhex4(address n)
+{
+    commit(puthex4(reserve(4), n) );
+}
+
+void TextBuffer::appenddecimal(size_t n)
+{
+    commit(putdecimal(reserve(20), n) );
+}
+
+void TextBuffer::write(std::ostream & out) const
+{
+    if (used > 0)
+        out.write(buffer.data(), used);
+}
+
+//--------------------------------------------------------------
+
+ByteBuffer::ByteBuffer() :
+    used(0),
+    check(0)
+{ }
+
+void ByteBuffer::clear()
+{
+    used = 0;
+    check = 0;
+}
+
+size_t ByteBuffer::size() const
+{
+    return used;
+}
+
+const byte * ByteBuffer::data() const
+{
+    return buffer.data();
+}
+
+byte * ByteBuffer::reserve(size_t len)
+{
+    if (used + len > buffer.size() )
+    {
+        size_t size = buffer.empty() ? 4096 : buffer.size() * 2;
+        if (size < used + len)
+            size = used + len;
+        buffer.resize(size);
+    }
+    return buffer.data() + used;
+}
+
+void ByteBuffer::put(byte b)
+{
+    * reserve(1) = b;
+    ++used;
+    check ^= b;
+}
+
+void ByteBuffer::putword(address word)
+{
+    put(lobyte(word) );
+    put(hibyte(word) );
+}
+
+void ByteBuffer::putwordhl(address word)
+{
+    put(hibyte(word) );
+    put(lobyte(word) );
+}
+
+void ByteBuffer::append(const byte * data, size_t len)
+{
+    // Copy and check in the same pass.
+    byte * const p = reserve(len);
+    byte c = check;
+    for (size_t i = 0; i < len; ++i)
+    {
+        const byte b = data [i];
+        p [i] = b;
+        c ^= b;
+    }
+    check = c;
+    used += len;
+}
+
+void ByteBuffer::append(const std::string & str)
+{
+    append(reinterpret_cast <const byte *> (str.data() ), str.size() );
+}
+
+void ByteBuffer::fill(byte b, size_t len)
+{
+    std::fill(reserve(len), buffer.data() + used + len, b);
+    used += len;
+    if (len % 2)
+        check ^= b;
+}
+
+void ByteBuffer::resetcheck(byte initial)
+{
+    check = initial;
+}
+
+byte ByteBuffer::getcheck() const
+{
+    return check;
+}
+
+void ByteBuffer::write(std::ostream & out) const
+{
+    if (used > 0)
+        out.write(reinterpret_cast <const char *> (buffer.data() ), used);
+}
+
+//--------------------------------------------------------------
+
+MemImage::MemImage() :
+    copied(0),
+    flatvalid(false)
+{ }
+
+void MemImage::clear()
+{
+    written.reset();
+    flatvalid = false;
+}
+
+void MemImage::share(const MemImage & other, address offset)
+{
+    const size_t shift = offset / pagesize;
+    for (size_t i = 0; i < npages; ++i)
+        pages [(i + shift) % npages] = other.pages [i];
+    clear();
+}
+
+byte MemImage::operator [] (address addr) const
+{
+    if (! written [addr] )
+        return 0;
+    return pages [addr / pagesize]->data [addr % pagesize];
+}
+
+void MemImage::set(address addr, byte b)
+{
+    const size_t pos = addr % pagesize;
+    std::shared_ptr <Page> & page = pages [addr / pagesize];
+    if (! page)
+        page = std::make_shared <Page> ();
+    else if (page->data [pos] != b && page.use_count() > 1)
+    {
+        page = std::make_shared <Page> (* page);
+        ++copied;
+    }
+    page->data [pos] = b;
+    written.set(addr);
+    flatvalid = false;
+}
+
+const byte * MemImage::data() const
+{
+    if (! flatvalid)
+    {
+        flat.assign(0x10000, 0);
+        for (size_t addr = 0; addr < 0x10000; ++addr)
+            if (written [addr] )
+                flat [addr] = pages [addr / pagesize]->data [addr % pagesize];
+        flatvalid = true;
+    }
+    return flat.data();
+}
+
+size_t MemImage::getcopied() const
+{
+    return copied;
 }
 
 //--------------------------------------------------------------
@@ -76,13 +382,15 @@ Hex4 hex4(address n) { return Hex4(n); }
 
 std::ostream & operator << (std::ostream & os, const Hex2 & h2)
 {
-    os << h2.str();
+    char buf [2];
+    os.write(buf, puthex2(buf, h2.b) - buf);
     return os;
 }
 
 std::ostream & operator << (std::ostream & os, const Hex4 & h4)
 {
-    os << h4.str();
+    char buf [4];
+    os.write(buf, puthex4(buf, h4.n) - buf);
     return os;
 }
 
@@ -4,7 +4,10 @@
 // pasmotypes.h
 
 #include <string>
+#include <vector>
 #include <iostream>
+#include <memory>
+#include <bitset>
 
 #include <limits.h>
 #include <stdlib.h>
@@ -40,12 +43,117 @@ byte lobyte(address n);
 byte hibyte(address n);
 address makeword(byte low, byte high);
 
-void putword(std::ostream & os, address word);
+// Writers of fixed width uppercase hexadecimal and of decimal
+// numbers in a char buffer, that return the position after the
+// last char written. putdecimal writes up to 20 chars.
+
+char * puthex2(char * p, byte b);
+char * puthex4(char * p, address n);
+char * puthex8(char * p, size_t nn);
+char * putdecimal(char * p, size_t n);
 
 std::string hex2str(byte b);
 std::string hex4str(address n);
 std::string hex8str(size_t nn);
 
+// Label followed by tabs or a space to align what follows, as in
+// the symbol tables. puttablabel writes up to two chars after it.
+
+char * puttablabel(char * p, const std::string & str);
+std::string tablabel(const std::string & str);
+
+// Text output built in a buffer, that can be reused, and written
+// with a single write.
+
+class TextBuffer
+{
+public:
+    TextBuffer();
+    void clear();
+    // Room for len chars after the text, to be filled with the
+    // put functions. commit adds them up to the position given.
+    char * reserve(size_t len);
+    void commit(const char * end);
+    void append(char c);
+    void append(const char * str);
+    void append(const std::string & str);
+    void appendhex2(byte b);
+    void appendhex4(address n);
+    void appenddecimal(size_t n);
+    void write(std::ostream & out) const;
+private:
+    std::vector <char> buffer;
+    size_t used;
+};
+
+// Binary output built in memory and written with a single write.
+// The words are stored in the Z80 order, low byte first, and the
+// bytes added are accumulated in a xor check, as used in the
+// Spectrum tape blocks, that starts again with resetcheck.
+
+class ByteBuffer
+{
+public:
+    ByteBuffer();
+    void clear();
+    size_t size() const;
+    const byte * data() const;
+    void put(byte b);
+    void putword(address word);
+    // High byte first, as in the CRC of the CPC tape blocks.
+    void putwordhl(address word);
+    void append(const byte * data, size_t len);
+    void append(const std::string & str);
+    void fill(byte b, size_t len);
+    void resetcheck(byte initial);
+    byte getcheck() const;
+    void write(std::ostream & out) const;
+private:
+    byte * reserve(size_t len);
+    std::vector <byte> buffer;
+    size_t used;
+    byte check;
+};
+
+// The 64KB of memory in pages of 256 bytes, shared with the
+// images that copy them until one of them writes a different
+// value in the page. Only the bytes set after the last clear
+// have a value, the rest are 0, so clear keeps the pages and
+// generating the same code again does not copy anything.
+
+class MemImage
+{
+public:
+    MemImage();
+    void clear();
+    // Clear and share the pages of other, moved offset bytes up.
+    // The offset must be a multiple of pagesize.
+    void share(const MemImage & other, address offset);
+    byte operator [] (address addr) const;
+    void set(address addr, byte b);
+    // The whole memory as a contiguous block, valid until the
+    // next change.
+    const byte * data() const;
+    // Pages copied because they were shared.
+    size_t getcopied() const;
+
+    static const size_t pagesize = 256;
+private:
+    MemImage(const MemImage &); // Forbidden
+    void operator = (const MemImage &); // Forbidden
+
+    static const size_t npages = 0x10000 / pagesize;
+    struct Page
+    {
+        byte data [pagesize];
+    };
+    std::shared_ptr <Page> pages [npages];
+    std::bitset <0x10000> written;
+    size_t copied;
+    mutable std::vector <byte> flat;
+    mutable bool flatvalid;
+};
+
 class Hex2
 {
 public:
@@ -53,6 +161,7 @@ public:
     std::string str() const;
 private:
     byte b;
+    friend std::ostream & operator << (std::ostream & os, const Hex2 & h2);
 };
 
 class Hex4
@@ -62,6 +171,7 @@ public:
     std::string str() const;
 private:
     address n;
+    friend std::ostream & operator << (std::ostream & os, const Hex4 & h4);
 };
 
 Hex2 hex2(byte b);
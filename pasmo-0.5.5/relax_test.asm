@@ -0,0 +1,17 @@
+; Test of branch relaxation, assemble with --relax.
+
+	org 8000h
+
+start:
+	jr far		; Out of range, widened to JP.
+	djnz far	; Out of range, widened to DJNZ + trampoline.
+	jr nz, near	; In range, stays short.
+near:
+	defs 200
+far:
+	ld b, 10
+loop:
+	djnz loop	; Backwards in range.
+	jr c, start	; Out of range backwards, widened to JP C.
+
+	end start
@@ -0,0 +1,280 @@
+// relobj.cxx
+
+#include "relobj.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+
+using std::runtime_error;
+
+namespace relobj
+{
+
+namespace
+{
+
+const std::string objheader("PASMO-OBJ 1");
+
+// Bytes in each T line.
+const size_t bytesperline = 16;
+
+class InvalidObject : public runtime_error
+{
+public:
+    InvalidObject(const std::string & filename, size_t linenum) :
+        runtime_error("Invalid object file " + filename +
+            " in line " + std::to_string(linenum) )
+    { }
+};
+
+bool gethex(std::istream & is, size_t & value, size_t max)
+{
+    std::string str;
+    if (! (is >> str) )
+        return false;
+    char * aux;
+    value = strtoul(str.c_str(), & aux, 16);
+    return * aux == '\0' && value <= max;
+}
+
+} // namespace
+
+//*********************************************************
+//        Object file.
+//*********************************************************
+
+void Object::write(std::ostream & out) const
+{
+    out << objheader << '\n';
+    out << "M " << name << '\n';
+    out << "C " << hex4(code.size() ) << '\n';
+    for (size_t i = 0; i < externs.size(); ++i)
+        out << "X " << externs [i] << '\n';
+    for (size_t i = 0; i < publics.size(); ++i)
+    {
+        const Public & pub = publics [i];
+        out << "P " << pub.name << ' ' << (pub.relative ? 'R' : 'A') <<
+            ' ' << hex4(pub.value) << '\n';
+    }
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        if (i % bytesperline == 0)
+            out << "T " << hex4(i);
+        out << ' ' << hex2(code [i] );
+        if (i % bytesperline == bytesperline - 1 || i == code.size() - 1)
+            out << '\n';
+    }
+    for (size_t i = 0; i < relocs.size(); ++i)
+        out << "R " << hex4(relocs [i] ) << '\n';
+    for (size_t i = 0; i < extrefs.size(); ++i)
+        out << "E " << hex4(extrefs [i].first) << ' ' <<
+            extrefs [i].second << '\n';
+}
+
+void Object::read(std::istream & in, const std::string & filename)
+{
+    std::string line;
+    if (! std::getline(in, line) || line != objheader)
+        throw runtime_error(filename + " is not an object file");
+
+    code.clear();
+    publics.clear();
+    externs.clear();
+    relocs.clear();
+    extrefs.clear();
+
+    size_t linenum = 1;
+    bool hassize = false;
+    while (std::getline(in, line) )
+    {
+        ++linenum;
+        std::istringstream iss(line);
+        char type;
+        if (! (iss >> type) )
+            continue;
+        size_t value;
+        std::string str;
+        switch (type)
+        {
+        case 'M':
+            iss >> name;
+            break;
+        case 'C':
+            if (! gethex(iss, value, 0x10000) )
+                throw InvalidObject(filename, linenum);
+            code.resize(value);
+            hassize = true;
+            break;
+        case 'X':
+            if (! (iss >> str) )
+                throw InvalidObject(filename, linenum);
+            externs.push_back(str);
+            break;
+        case 'P':
+            {
+                Public pub;
+                if (! (iss >> pub.name >> str) ||
+                        (str != "R" && str != "A") ||
+                        ! gethex(iss, value, 0xFFFF) )
+                    throw InvalidObject(filename, linenum);
+                pub.relative = str == "R";
+                pub.value = value;
+                publics.push_back(pub);
+            }
+            break;
+        case 'T':
+            {
+                size_t pos;
+                if (! hassize || ! gethex(iss, pos, 0xFFFF) )
+                    throw InvalidObject(filename, linenum);
+                while (gethex(iss, value, 0xFF) )
+                {
+                    if (pos >= code.size() )
+                        throw InvalidObject(filename, linenum);
+                    code [pos++] = static_cast <byte> (value);
+                }
+                if (! iss.eof() )
+                    throw InvalidObject(filename, linenum);
+            }
+            break;
+        case 'R':
+            if (! gethex(iss, value, 0xFFFF) || value + 2 > code.size() )
+                throw InvalidObject(filename, linenum);
+            relocs.push_back(value);
+            break;
+        case 'E':
+            if (! gethex(iss, value, 0xFFFF) || value + 2 > code.size() ||
+                    ! (iss >> str) ||
+                    std::find(externs.begin(), externs.end(), str) ==
+                        externs.end() )
+                throw InvalidObject(filename, linenum);
+            extrefs.push_back(std::make_pair(address(value), str) );
+            break;
+        default:
+            throw InvalidObject(filename, linenum);
+        }
+    }
+    if (! hassize)
+        throw InvalidObject(filename, linenum);
+}
+
+//*********************************************************
+//        Linker.
+//*********************************************************
+
+Linker::Linker() :
+    next(0),
+    minused(0x10000),
+    maxused(0)
+{
+    std::fill(mem, mem + sizeof(mem), byte(0) );
+}
+
+void Linker::setorg(address org)
+{
+    next = org;
+}
+
+void Linker::add(const Object & object, const std::string & filename)
+{
+    if (next + object.code.size() > 0x10000)
+        throw runtime_error("Module " + filename + " does not fit in memory");
+    Module module;
+    module.object = object;
+    module.filename = filename;
+    module.addr = static_cast <address> (next);
+    modules.push_back(module);
+    next += object.code.size();
+}
+
+void Linker::link()
+{
+    // Resolve the public symbols.
+
+    for (size_t i = 0; i < modules.size(); ++i)
+    {
+        const Module & module = modules [i];
+        const std::vector <Public> & publics = module.object.publics;
+        for (size_t j = 0; j < publics.size(); ++j)
+        {
+            const Public & pub = publics [j];
+            symbols_t::const_iterator it = symbols.find(pub.name);
+            if (it != symbols.end() )
+                throw runtime_error("Symbol " + pub.name +
+                    " defined in " + it->second.filename +
+                    " and " + module.filename);
+            Symbol sym;
+            sym.value = pub.relative ? pub.value + module.addr : pub.value;
+            sym.filename = module.filename;
+            symbols [pub.name] = sym;
+        }
+    }
+
+    // Place the code and apply the relocations.
+
+    for (size_t i = 0; i < modules.size(); ++i)
+    {
+        const Module & module = modules [i];
+        const Object & object = module.object;
+        const size_t size = object.code.size();
+        if (size == 0)
+            continue;
+        for (size_t pos = module.addr; pos < module.addr + size; ++pos)
+        {
+            if (used [pos] )
+                throw runtime_error("Module " + module.filename +
+                    " overlaps at " + hex4str(pos) + 'H');
+            used [pos] = true;
+        }
+        std::copy(object.code.begin(), object.code.end(),
+            mem + module.addr);
+        minused = std::min(minused, size_t(module.addr) );
+        maxused = std::max(maxused, module.addr + size - 1);
+
+        for (size_t j = 0; j < object.relocs.size(); ++j)
+        {
+            const size_t pos = module.addr + object.relocs [j];
+            const address value = makeword(mem [pos], mem [pos + 1]) +
+                module.addr;
+            mem [pos] = lobyte(value);
+            mem [pos + 1] = hibyte(value);
+        }
+        for (size_t j = 0; j < object.extrefs.size(); ++j)
+        {
+            const std::string & name = object.extrefs [j].second;
+            symbols_t::const_iterator it = symbols.find(name);
+            if (it == symbols.end() )
+                throw runtime_error("Undefined symbol " + name +
+                    " used in " + module.filename);
+            const size_t pos = module.addr + object.extrefs [j].first;
+            const address value = makeword(mem [pos], mem [pos + 1]) +
+                it->second.value;
+            mem [pos] = lobyte(value);
+            mem [pos + 1] = hibyte(value);
+        }
+    }
+}
+
+void Linker::writebin(std::ostream & out) const
+{
+    if (minused > maxused)
+        return;
+    out.write(reinterpret_cast <const char *> (mem + minused),
+        maxused - minused + 1);
+}
+
+void Linker::writesymbols(std::ostream & out) const
+{
+    for (symbols_t::const_iterator it = symbols.begin();
+        it != symbols.end();
+        ++it)
+    {
+        out << tablabel(it->first) << "EQU 0" <<
+            hex4(it->second.value) << "H\n";
+    }
+}
+
+} // namespace relobj
+
+// End
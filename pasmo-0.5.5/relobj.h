@@ -0,0 +1,85 @@
+#ifndef INCLUDE_RELOBJ_H
+#define INCLUDE_RELOBJ_H
+
+// relobj.h
+
+// Relocatable object files generated with --obj, and the linker
+// used by pasmo-link to place them in memory.
+
+#include "pasmotypes.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <bitset>
+
+namespace relobj
+{
+
+struct Public
+{
+    std::string name;
+    // Relative to the start of the section or absolute.
+    bool relative;
+    address value;
+};
+
+// A module with one code section that starts at address 0.
+// The relocations and external references are the offsets of
+// the words in the code to which the address of the section or
+// of the external symbol must be added.
+
+class Object
+{
+public:
+    std::string name;
+    std::vector <byte> code;
+    std::vector <Public> publics;
+    std::vector <std::string> externs;
+    std::vector <address> relocs;
+    std::vector <std::pair <address, std::string> > extrefs;
+
+    void write(std::ostream & out) const;
+    void read(std::istream & in, const std::string & filename);
+};
+
+class Linker
+{
+public:
+    Linker();
+    // Place the next modules starting at the address given,
+    // by default after the previous module.
+    void setorg(address org);
+    void add(const Object & object, const std::string & filename);
+    void link();
+    void writebin(std::ostream & out) const;
+    void writesymbols(std::ostream & out) const;
+private:
+    struct Module
+    {
+        Object object;
+        std::string filename;
+        address addr;
+    };
+    std::vector <Module> modules;
+    size_t next;
+
+    struct Symbol
+    {
+        address value;
+        std::string filename;
+    };
+    typedef std::map <std::string, Symbol> symbols_t;
+    symbols_t symbols;
+
+    byte mem [65536];
+    std::bitset <65536> used;
+    size_t minused;
+    size_t maxused;
+};
+
+} // namespace relobj
+
+#endif
+
+// End
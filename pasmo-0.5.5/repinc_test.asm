@@ -0,0 +1,9 @@
+; Test of a file with nested includes included several times.
+
+	ORG 0
+
+	INCLUDE repinc_lib.asm
+	INCLUDE repinc_lib.asm
+	INCLUDE repinc_lib.asm
+
+	END
@@ -0,0 +1,543 @@
+// snapshot.cxx
+
+#include "snapshot.h"
+
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+using std::runtime_error;
+
+namespace
+{
+
+const size_t snaheadsize = 27;
+const size_t z80headsize = 30;
+const size_t z80extsize = 54;
+const size_t pagesize = 0x4000;
+
+// Pages of the .z80 format in a 48K machine.
+
+const struct
+{
+    byte page;
+    address start;
+} z80pages [] = {
+    { 4, 0x8000 },
+    { 5, 0xC000 },
+    { 8, 0x4000 },
+};
+
+// Basic area of the 48K ROM.
+
+const address chans = 0x5CB6;
+const address prog = 0x5CCB;
+const address basicend = 0x5D00;
+const address defaultramtop = 0xFF57;
+
+// Address of the main execution loop where the ROM returns
+// after an error or the end of the program.
+const address mainloop = 0x1303;
+
+byte & at(snapshot::Machine & machine, address addr)
+{
+    return machine.ram [addr - snapshot::ramstart];
+}
+
+void poke(snapshot::Machine & machine, address addr, byte b)
+{
+    at(machine, addr) = b;
+}
+
+void pokeword(snapshot::Machine & machine, address addr, address word)
+{
+    poke(machine, addr, lobyte(word) );
+    poke(machine, address(addr + 1), hibyte(word) );
+}
+
+address peekword(snapshot::Machine & machine, address addr)
+{
+    return makeword(at(machine, addr), at(machine, address(addr + 1) ) );
+}
+
+// Memory of a bank of the 128K.
+
+const byte * bankdata(const snapshot::Machine & machine, size_t bank)
+{
+    if (bank == 5)
+        return machine.ram;
+    if (bank == 2)
+        return machine.ram + snapshot::banksize;
+    if (bank == (machine.port7ffd & 0x07u) )
+        return machine.ram + 2 * snapshot::banksize;
+    return machine.banks [bank];
+}
+
+byte * bankdata(snapshot::Machine & machine, size_t bank)
+{
+    const snapshot::Machine & constmachine = machine;
+    return const_cast <byte *> (bankdata(constmachine, bank) );
+}
+
+void pushword(snapshot::Machine & machine, address word)
+{
+    machine.sp -= 2;
+    if (machine.sp < snapshot::ramstart)
+        throw runtime_error("Stack in ROM, can not create the snapshot");
+    pokeword(machine, machine.sp, word);
+}
+
+// As CLEAR: GOSUB stack end marker at RAMTOP and the error return
+// address in the machine stack below it.
+
+void setramtop(snapshot::Machine & machine, address ramtop)
+{
+    pokeword(machine, 0x5CB2, ramtop); // RAMTOP
+    poke(machine, ramtop, 0x3E);
+    machine.sp = ramtop;
+    pushword(machine, mainloop);
+    pokeword(machine, 0x5C3D, machine.sp); // ERR_SP
+}
+
+// True if some byte from first to last, both included, is in the
+// code placed at start.
+
+bool overlaps(address start, size_t size, size_t first, size_t last)
+{
+    return size > 0 && first < start + size && last >= start;
+}
+
+// The program counter is pushed below SP in the 48K .sna, and the
+// word at SP is the return address of the program.
+
+void checkstack(const snapshot::Machine & machine, address start, size_t size)
+{
+    const size_t sp = machine.sp;
+    if (overlaps(start, size, sp < 2 ? 0 : sp - 2, sp + 1) )
+        throw runtime_error("The stack at " + hex4str(machine.sp) +
+            "H overlaps the code, can not create the snapshot");
+}
+
+// Run length encoding of the .z80 format: ED ED count byte for
+// runs of 5 or more bytes or of 2 or more EDs, and the byte after
+// a single ED is not included in a run.
+
+void compress(const byte * data, size_t size, ByteBuffer & out)
+{
+    size_t i = 0;
+    while (i < size)
+    {
+        const byte b = data [i];
+        size_t run = 1;
+        while (i + run < size && data [i + run] == b && run < 255)
+            ++run;
+        if (run >= 5 || (b == 0xED && run >= 2) )
+        {
+            out.put(0xED);
+            out.put(0xED);
+            out.put(byte(run) );
+            out.put(b);
+            i += run;
+        }
+        else
+        {
+            out.put(b);
+            ++i;
+            if (b == 0xED && i < size)
+            {
+                out.put(data [i] );
+                ++i;
+            }
+        }
+    }
+}
+
+// Page of the .z80 format, compressed if that makes it smaller.
+
+void putpage(ByteBuffer & out, byte page, const byte * data)
+{
+    ByteBuffer packed;
+    compress(data, pagesize, packed);
+    if (packed.size() < pagesize)
+    {
+        out.putword(static_cast <address> (packed.size() ) );
+        out.put(page);
+        out.append(packed.data(), packed.size() );
+    }
+    else
+    {
+        out.putword(0xFFFF);
+        out.put(page);
+        out.append(data, pagesize);
+    }
+}
+
+void decompress(const byte * data, size_t size, byte * dest, size_t len)
+{
+    size_t i = 0;
+    size_t pos = 0;
+    while (pos < len && i < size)
+    {
+        if (data [i] == 0xED && i + 3 < size && data [i + 1] == 0xED)
+        {
+            const size_t count = data [i + 2];
+            if (pos + count > len)
+                break;
+            std::fill(dest + pos, dest + pos + count, data [i + 3] );
+            pos += count;
+            i += 4;
+        }
+        else
+            dest [pos++] = data [i++];
+    }
+    if (pos != len)
+        throw runtime_error("Invalid compressed data in snapshot");
+}
+
+void loadsna(snapshot::Machine & machine, const std::vector <byte> & file)
+{
+    const byte * const head = file.data();
+    machine.i = head [0];
+    machine.hl2 = makeword(head [1], head [2] );
+    machine.de2 = makeword(head [3], head [4] );
+    machine.bc2 = makeword(head [5], head [6] );
+    machine.af2 = makeword(head [7], head [8] );
+    machine.hl = makeword(head [9], head [10] );
+    machine.de = makeword(head [11], head [12] );
+    machine.bc = makeword(head [13], head [14] );
+    machine.iy = makeword(head [15], head [16] );
+    machine.ix = makeword(head [17], head [18] );
+    machine.iff = (head [19] & 0x04) != 0;
+    machine.r = head [20];
+    machine.af = makeword(head [21], head [22] );
+    machine.sp = makeword(head [23], head [24] );
+    machine.im = head [25] & 0x03;
+    machine.border = head [26] & 0x07;
+    std::copy(head + snaheadsize, head + snaheadsize + snapshot::ramsize,
+        machine.ram);
+
+    // Pop the program counter.
+    if (machine.sp < snapshot::ramstart || machine.sp == 0xFFFF)
+        throw runtime_error("Invalid stack pointer in snapshot");
+    machine.pc = peekword(machine, machine.sp);
+    machine.sp += 2;
+}
+
+void loadz80(snapshot::Machine & machine, const std::vector <byte> & file)
+{
+    const byte * const head = file.data();
+    const size_t size = file.size();
+    machine.af = makeword(head [1], head [0] );
+    machine.bc = makeword(head [2], head [3] );
+    machine.hl = makeword(head [4], head [5] );
+    machine.pc = makeword(head [6], head [7] );
+    machine.sp = makeword(head [8], head [9] );
+    machine.i = head [10];
+    byte flags = head [12];
+    if (flags == 0xFF)
+        flags = 1;
+    machine.r = (head [11] & 0x7F) | ( (flags & 0x01) << 7);
+    machine.border = (flags >> 1) & 0x07;
+    machine.de = makeword(head [13], head [14] );
+    machine.bc2 = makeword(head [15], head [16] );
+    machine.de2 = makeword(head [17], head [18] );
+    machine.hl2 = makeword(head [19], head [20] );
+    machine.af2 = makeword(head [22], head [21] );
+    machine.iy = makeword(head [23], head [24] );
+    machine.ix = makeword(head [25], head [26] );
+    machine.iff = head [27] != 0;
+    machine.im = head [29] & 0x03;
+
+    if (machine.pc != 0)
+    {
+        // Version 1: 48K, compressed or not.
+        const byte * const data = head + z80headsize;
+        const size_t len = size - z80headsize;
+        if (flags & 0x20)
+            decompress(data, len, machine.ram, snapshot::ramsize);
+        else if (len >= snapshot::ramsize)
+            std::copy(data, data + snapshot::ramsize, machine.ram);
+        else
+            throw runtime_error("Invalid snapshot size");
+        return;
+    }
+
+    // Versions 2 and 3.
+    if (size < z80headsize + 2)
+        throw runtime_error("Invalid snapshot size");
+    const size_t extlen = makeword(head [30], head [31] );
+    size_t pos = z80headsize + 2 + extlen;
+    if (size < pos)
+        throw runtime_error("Invalid snapshot size");
+    machine.pc = makeword(head [32], head [33] );
+    const byte hardware = head [34];
+    if (! (hardware == 0 || hardware == 1 ||
+            (hardware == 3 && extlen != 23) ) )
+        throw runtime_error("Only 48K snapshots can be used as base");
+
+    while (pos + 3 <= size)
+    {
+        const size_t len = makeword(head [pos], head [pos + 1] );
+        const byte page = head [pos + 2];
+        pos += 3;
+        const size_t datalen = len == 0xFFFF ? pagesize : len;
+        if (pos + datalen > size)
+            throw runtime_error("Invalid snapshot size");
+        for (size_t i = 0; i < sizeof(z80pages) / sizeof(z80pages [0]); ++i)
+        {
+            if (z80pages [i].page != page)
+                continue;
+            byte * const dest = & at(machine, z80pages [i].start);
+            if (len == 0xFFFF)
+                std::copy(head + pos, head + pos + pagesize, dest);
+            else
+                decompress(head + pos, len, dest, pagesize);
+        }
+        pos += datalen;
+    }
+}
+
+} // namespace
+
+void snapshot::setdefault(Machine & machine)
+{
+    std::fill(machine.ram, machine.ram + ramsize, byte(0) );
+    machine.is128 = false;
+    machine.port7ffd = 0;
+
+    // Screen attributes: black ink on white paper.
+    std::fill(& at(machine, 0x5800), & at(machine, 0x5B00), byte(0x38) );
+
+    // System variables.
+
+    poke(machine, 0x5C00, 0xFF); // KSTATE
+    poke(machine, 0x5C04, 0xFF);
+    poke(machine, 0x5C09, 0x23); // REPDEL
+    poke(machine, 0x5C0A, 0x05); // REPPER
+    static const byte strms [] = {
+        0x01, 0x00, 0x06, 0x00, 0x0B, 0x00, 0x01, 0x00,
+        0x01, 0x00, 0x06, 0x00, 0x10, 0x00
+    };
+    std::copy(strms, strms + sizeof(strms), & at(machine, 0x5C10) );
+    pokeword(machine, 0x5C36, 0x3C00); // CHARS
+    poke(machine, 0x5C38, 0x40); // RASP
+    poke(machine, 0x5C3A, 0xFF); // ERR_NR
+    poke(machine, 0x5C3B, 0xCC); // FLAGS
+    poke(machine, 0x5C48, 0x38); // BORDCR
+    pokeword(machine, 0x5C4B, prog); // VARS
+    pokeword(machine, 0x5C4F, chans); // CHANS
+    pokeword(machine, 0x5C51, chans + 5); // CURCHL: channel S
+    pokeword(machine, 0x5C53, prog); // PROG
+    pokeword(machine, 0x5C55, prog); // NXTLIN
+    pokeword(machine, 0x5C57, prog - 1); // DATADD
+    pokeword(machine, 0x5C59, prog + 1); // E_LINE
+    pokeword(machine, 0x5C5B, prog + 1); // K_CUR
+    pokeword(machine, 0x5C5D, prog + 1); // CH_ADD
+    pokeword(machine, 0x5C61, prog + 3); // WORKSP
+    pokeword(machine, 0x5C63, prog + 3); // STKBOT
+    pokeword(machine, 0x5C65, prog + 3); // STKEND
+    pokeword(machine, 0x5C68, 0x5C92); // MEM: MEMBOT
+    poke(machine, 0x5C6B, 0x02); // DF_SZ
+    pokeword(machine, 0x5C7B, 0xFF58); // UDG
+    poke(machine, 0x5C7F, 0x21); // P_POSN
+    pokeword(machine, 0x5C80, 0x5B00); // PR_CC
+    pokeword(machine, 0x5C82, 0x1721); // ECHO_E
+    pokeword(machine, 0x5C84, 0x4000); // DF_CC
+    pokeword(machine, 0x5C86, 0x50E0); // DF_CCL
+    pokeword(machine, 0x5C88, 0x1821); // S_POSN
+    pokeword(machine, 0x5C8A, 0x1721); // S_POSNL
+    poke(machine, 0x5C8C, 0x01); // SCR_CT
+    poke(machine, 0x5C8D, 0x38); // ATTR_P
+    poke(machine, 0x5C8F, 0x38); // ATTR_T
+    pokeword(machine, 0x5CB4, 0xFFFF); // P_RAMT
+
+    // Channels K, S, R and P, with the ROM routines of each one.
+    static const byte channels [] = {
+        0xF4, 0x09, 0xA8, 0x10, 'K',
+        0xF4, 0x09, 0xC4, 0x15, 'S',
+        0x81, 0x0F, 0xC4, 0x15, 'R',
+        0xF4, 0x09, 0xC4, 0x15, 'P',
+        0x80
+    };
+    std::copy(channels, channels + sizeof(channels), & at(machine, chans) );
+
+    // Empty program and variables, and edit line.
+    poke(machine, prog, 0x80);
+    poke(machine, prog + 1, 0x0D);
+    poke(machine, prog + 2, 0x80);
+
+    setramtop(machine, defaultramtop);
+
+    // Registers used by the ROM in the interrupt routine and
+    // in the calculator.
+    machine.af = machine.bc = machine.de = machine.hl = 0;
+    machine.af2 = machine.bc2 = machine.de2 = 0;
+    machine.hl2 = 0x2758;
+    machine.ix = 0;
+    machine.iy = 0x5C3A;
+    machine.pc = 0;
+    machine.i = 0x3F;
+    machine.r = 0;
+    machine.im = 1;
+    machine.iff = true;
+    machine.border = 7;
+}
+
+void snapshot::load(Machine & machine, const std::string & filename)
+{
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    if (! in.is_open() )
+        throw runtime_error("Error opening snapshot " + filename);
+    const std::vector <byte> file(
+        (std::istreambuf_iterator <char> (in) ),
+        std::istreambuf_iterator <char> () );
+
+    machine.is128 = false;
+    machine.port7ffd = 0;
+    if (file.size() == snaheadsize + ramsize)
+        loadsna(machine, file);
+    else if (file.size() > z80headsize)
+        loadz80(machine, file);
+    else
+        throw runtime_error("Unrecognized snapshot format: " + filename);
+}
+
+void snapshot::place(Machine & machine, const byte * mem, address start,
+    address size, address entry, bool hasbase)
+{
+    if (size > 0 && start < ramstart)
+        throw runtime_error("Code below 4000H can not be placed "
+            "in a snapshot");
+
+    // The stack below the code, as done by CLEAR. If the code is
+    // not above the Basic area and reaches the default stack, the
+    // stack is placed after the code.
+    if (! hasbase)
+    {
+        const size_t end = size_t(start) + size;
+        if (start > basicend)
+            setramtop(machine, start - 1);
+        else if (overlaps(start, size, machine.sp - 2, defaultramtop) )
+        {
+            if (end + 4 > 0xFFFF)
+                throw runtime_error("No room for the stack after the code, "
+                    "can not create the snapshot");
+            setramtop(machine, address(end + 4) );
+        }
+    }
+    checkstack(machine, start, size);
+
+    std::copy(mem + start, mem + start + size, & at(machine, start) );
+    machine.pc = entry;
+}
+
+void snapshot::set128(Machine & machine)
+{
+    machine.is128 = true;
+    machine.port7ffd = 0x10;
+    for (size_t i = 0; i < nbanks; ++i)
+        std::fill(machine.banks [i], machine.banks [i] + banksize, byte(0) );
+}
+
+void snapshot::placebank(Machine & machine, byte bank, const byte * data,
+    address start, address size)
+{
+    if (! machine.is128 || bank >= nbanks)
+        throw runtime_error("Bank " + std::to_string(bank) +
+            " does not exist in the Spectrum 128K");
+    if (bank == (machine.port7ffd & 0x07u) )
+        checkstack(machine, start, size);
+    std::copy(data, data + size, bankdata(machine, bank) + start % banksize);
+}
+
+void snapshot::writesna(const Machine & machine, ByteBuffer & out)
+{
+    const address sp = machine.is128 ? machine.sp : machine.sp - 2;
+    if (! machine.is128 && (sp < ramstart || sp == 0xFFFF) )
+        throw runtime_error("Stack in ROM, can not create the snapshot");
+
+    out.put(machine.i);
+    out.putword(machine.hl2);
+    out.putword(machine.de2);
+    out.putword(machine.bc2);
+    out.putword(machine.af2);
+    out.putword(machine.hl);
+    out.putword(machine.de);
+    out.putword(machine.bc);
+    out.putword(machine.iy);
+    out.putword(machine.ix);
+    out.put(machine.iff ? 0x04 : 0x00);
+    out.put(machine.r);
+    out.putword(machine.af);
+    out.putword(sp);
+    out.put(machine.im);
+    out.put(machine.border);
+
+    if (machine.is128)
+    {
+        const size_t paged = machine.port7ffd & 0x07;
+        out.append(machine.ram, ramsize);
+        out.putword(machine.pc);
+        out.put(machine.port7ffd);
+        out.put(0); // TR-DOS ROM not paged.
+        for (size_t bank = 0; bank < nbanks; ++bank)
+            if (bank != 5 && bank != 2 && bank != paged)
+                out.append(machine.banks [bank], banksize);
+        return;
+    }
+
+    // RAM, with the program counter pushed in the stack.
+    const size_t pos = sp - ramstart;
+    out.append(machine.ram, pos);
+    out.putword(machine.pc);
+    out.append(machine.ram + pos + 2, ramsize - pos - 2);
+}
+
+void snapshot::writez80(const Machine & machine, ByteBuffer & out)
+{
+    out.put(hibyte(machine.af) );
+    out.put(lobyte(machine.af) );
+    out.putword(machine.bc);
+    out.putword(machine.hl);
+    out.putword(0); // Version 2 or later.
+    out.putword(machine.sp);
+    out.put(machine.i);
+    out.put(machine.r & 0x7F);
+    out.put( (machine.r >> 7) | (machine.border << 1) );
+    out.putword(machine.de);
+    out.putword(machine.bc2);
+    out.putword(machine.de2);
+    out.putword(machine.hl2);
+    out.put(hibyte(machine.af2) );
+    out.put(lobyte(machine.af2) );
+    out.putword(machine.iy);
+    out.putword(machine.ix);
+    out.put(machine.iff ? 1 : 0);
+    out.put(machine.iff ? 1 : 0);
+    out.put(machine.im);
+
+    // Version 3 additional header.
+    out.putword(z80extsize);
+    out.putword(machine.pc);
+    out.put(machine.is128 ? 4 : 0); // Hardware: 128K or 48K.
+    out.put(machine.port7ffd);
+    out.fill(0, 25); // Flags, sound chip and T states.
+    out.put(0xFF); // ROM in 0000H-1FFFH.
+    out.put(0xFF); // ROM in 2000H-3FFFH.
+    out.fill(0, 23); // Joystick mappings and disk interfaces.
+
+    // In the 128K the page of each bank is its number plus 3.
+    if (machine.is128)
+    {
+        for (size_t bank = 0; bank < nbanks; ++bank)
+            putpage(out, byte(bank + 3), bankdata(machine, bank) );
+        return;
+    }
+    for (size_t i = 0; i < sizeof(z80pages) / sizeof(z80pages [0]); ++i)
+        putpage(out, z80pages [i].page,
+            machine.ram + (z80pages [i].start - ramstart) );
+}
+
+// End
@@ -0,0 +1,85 @@
+#ifndef INCLUDE_SNAPSHOT_H
+#define INCLUDE_SNAPSHOT_H
+
+// snapshot.h
+
+// Spectrum 48K and 128K snapshots in the .sna and .z80 formats, to
+// start the program in an emulator without loading it from tape.
+
+#include "pasmotypes.h"
+
+#include <string>
+
+namespace snapshot
+{
+
+const address ramstart = 0x4000;
+const size_t ramsize = 0xC000;
+const size_t banksize = 0x4000;
+const size_t nbanks = 8;
+
+// Registers and RAM of the machine. In the 128K ram has the banks
+// 5, 2 and the one paged at C000H, and banks the others.
+
+struct Machine
+{
+    address af, bc, de, hl;
+    address af2, bc2, de2, hl2;
+    address ix, iy, sp, pc;
+    byte i, r;
+    byte im;
+    bool iff;
+    byte border;
+    byte ram [ramsize];
+    bool is128;
+    byte port7ffd;
+    byte banks [nbanks] [banksize];
+};
+
+// State after the reset of the 48K Basic with no program: system
+// variables, channels, screen attributes and the registers used by
+// the ROM interrupt routine.
+
+void setdefault(Machine & machine);
+
+// Load a 48K snapshot in .sna or .z80 format, to use it as base.
+// Throws runtime_error if the format is not recognized.
+
+void load(Machine & machine, const std::string & filename);
+
+// Copy the code to its place and set the program counter. Without
+// base, the stack is placed below the code and RAMTOP adjusted as
+// by CLEAR, or at the top of memory if the code is not above the
+// Basic area, after the code if it reaches the top. Throws
+// runtime_error if the code is in the ROM or overlaps the stack.
+
+void place(Machine & machine, const byte * mem, address start, address size,
+    address entry, bool hasbase);
+
+// Change to the 128K, with the 48K Basic ROM and the bank 0 paged,
+// keeping the content of the RAM.
+
+void set128(Machine & machine);
+
+// Copy the code of a bank, given by the address where it is seen
+// when paged. Throws runtime_error if the bank does not exist, or
+// if it is the paged one and the code overlaps the stack.
+
+void placebank(Machine & machine, byte bank, const byte * data,
+    address start, address size);
+
+// In the 48K .sna format the program counter is pushed on the
+// stack, the 128K format has it after the RAM, followed by the
+// rest of the banks.
+
+void writesna(const Machine & machine, ByteBuffer & out);
+
+// Version 3 .z80, with compressed pages.
+
+void writez80(const Machine & machine, ByteBuffer & out);
+
+} // namespace snapshot
+
+#endif
+
+// End
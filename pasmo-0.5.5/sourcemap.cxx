@@ -0,0 +1,128 @@
+// sourcemap.cxx
+
+#include "sourcemap.h"
+
+#include <algorithm>
+
+namespace
+{
+
+const size_t noline = static_cast <size_t> (-1);
+
+const char indexmagic [] = "PSRC";
+const size_t indexversion = 1;
+const size_t indexheadsize = 16;
+const size_t indexrangesize = 12;
+
+void putlong(ByteBuffer & out, size_t n)
+{
+    out.putword(static_cast <address> (n & 0xFFFF) );
+    out.putword(static_cast <address> ( (n >> 16) & 0xFFFF) );
+}
+
+} // namespace
+
+SourceMap::SourceMap()
+{ }
+
+void SourceMap::clear()
+{
+    runs.clear();
+}
+
+void SourceMap::addrun(address addr, size_t line)
+{
+    Run run;
+    run.start = addr;
+    run.end = addr;
+    run.line = line;
+    runs.push_back(run);
+}
+
+void SourceMap::getranges(std::vector <Range> & ranges) const
+{
+    // Line of each address, in the order generated.
+    std::vector <size_t> lineof(0x10000, noline);
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        const Run & run = runs [i];
+        for (size_t addr = run.start; addr <= run.end; ++addr)
+            lineof [addr] = run.line;
+    }
+
+    ranges.clear();
+    for (size_t addr = 0; addr < 0x10000; ++addr)
+    {
+        const size_t line = lineof [addr];
+        if (line == noline)
+            continue;
+        if (! ranges.empty() && ranges.back().line == line &&
+                size_t(ranges.back().end) + 1 == addr)
+            ++ranges.back().end;
+        else
+        {
+            Range range;
+            range.start = static_cast <address> (addr);
+            range.end = static_cast <address> (addr);
+            range.line = line;
+            ranges.push_back(range);
+        }
+    }
+}
+
+void writesourcemap(std::ostream & out,
+    const std::vector <SourceRange> & ranges,
+    const std::vector <std::string> & files)
+{
+    TextBuffer text;
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        const SourceRange & range = ranges [i];
+        const std::string & file = files [range.file];
+        char * p = text.reserve(4 + 1 + 4 + 1 + 20 + 1 + file.size() + 1);
+        p = puthex4(p, range.start);
+        * p++ = ' ';
+        p = puthex4(p, range.end);
+        * p++ = ' ';
+        p = putdecimal(p, range.numline);
+        * p++ = ' ';
+        p = std::copy(file.begin(), file.end(), p);
+        * p++ = '\n';
+        text.commit(p);
+    }
+    text.write(out);
+}
+
+void writesourceindex(ByteBuffer & out,
+    const std::vector <SourceRange> & ranges,
+    const std::vector <std::string> & files)
+{
+    out.append(reinterpret_cast <const byte *> (indexmagic), 4);
+    putlong(out, indexversion);
+    putlong(out, ranges.size() );
+    putlong(out, files.size() );
+
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        const SourceRange & range = ranges [i];
+        out.putword(range.start);
+        out.putword(range.end);
+        putlong(out, range.numline);
+        putlong(out, range.file);
+    }
+
+    size_t offset = indexheadsize + ranges.size() * indexrangesize +
+        files.size() * 4;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        putlong(out, offset);
+        offset += files [i].size() + 1;
+    }
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        out.append(files [i] );
+        out.put(0);
+    }
+}
+
+// End
@@ -0,0 +1,84 @@
+#ifndef INCLUDE_SOURCEMAP_H
+#define INCLUDE_SOURCEMAP_H
+
+// sourcemap.h
+
+// Source line of each byte of code generated in the last pass,
+// written with the --srcmap and --srcindex options for use by
+// debuggers.
+
+#include "pasmotypes.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+class SourceMap
+{
+public:
+    SourceMap();
+    void clear();
+    // Called for each byte generated, in order.
+    void add(address addr, size_t line)
+    {
+        if (! runs.empty() && runs.back().line == line &&
+                runs.back().end + 1 == addr)
+            ++runs.back().end;
+        else
+            addrun(addr, line);
+    }
+
+    // Consecutive addresses generated from the same line, with the
+    // bytes overwritten assigned to the last line that wrote them.
+
+    struct Range
+    {
+        address start;
+        address end;
+        size_t line;
+    };
+    void getranges(std::vector <Range> & ranges) const;
+private:
+    void addrun(address addr, size_t line);
+    struct Run
+    {
+        size_t start;
+        size_t end;
+        size_t line;
+    };
+    std::vector <Run> runs;
+};
+
+// A range of addresses with its file, as index in the table of
+// files, and the line number in that file.
+
+struct SourceRange
+{
+    address start;
+    address end;
+    size_t file;
+    size_t numline;
+};
+
+// One line for each range: start and end address in hexadecimal,
+// line number and file name.
+
+void writesourcemap(std::ostream & out,
+    const std::vector <SourceRange> & ranges,
+    const std::vector <std::string> & files);
+
+// Binary form, all numbers little endian:
+//   header: "PSRC", version (32 bits), number of ranges and of files
+//   ranges sorted by address: start, end (16 bits each), line and
+//     file index (32 bits each)
+//   files: offset of each name (32 bits) from the start of the file
+//   names terminated by a zero byte.
+// The fixed size of the ranges allows binary search by address.
+
+void writesourceindex(ByteBuffer & out,
+    const std::vector <SourceRange> & ranges,
+    const std::vector <std::string> & files);
+
+#endif
+
+// End
@@ -2,9 +2,11 @@
 
 #include "spectrum.h"
 #include "asm.h"
+#include "lzpack.h"
 
 #include <sstream>
 #include <algorithm>
+#include <stdexcept>
 
 using std::fill;
 using std::copy;
@@ -51,7 +53,7 @@ void spectrum::Plus3Head::setstart(address start)
     plus3[19]= hibyte(start);
 }
 
-void spectrum::Plus3Head::write(std::ostream & out)
+void spectrum::Plus3Head::write(ByteBuffer & out)
 {
     // Checksum
     byte check = 0;
@@ -60,7 +62,7 @@ void spectrum::Plus3Head::write(std::ostream & out)
     plus3[127]= check;
 
     // Write the header.
-    out.write(reinterpret_cast <char *>(plus3), headsize);
+    out.append(plus3, headsize);
 }
 
 //**************************************************************
@@ -72,9 +74,12 @@ namespace
 
 const std::string tokNumPrefix (1, '\x0E');
 const std::string tokEndLine   (1, '\x0D');
+const std::string tokPEEK      (1, '\xBE');
+const std::string tokOUT       (1, '\xDF');
 const std::string tokCODE      (1, '\xAF');
 const std::string tokUSR       (1, '\xC0');
 const std::string tokLOAD      (1, '\xEF');
+const std::string tokREM       (1, '\xEA');
 const std::string tokPOKE      (1, '\xF4');
 const std::string tokRANDOMIZE (1, '\xF9');
 const std::string tokCLEAR     (1, '\xFD');
@@ -120,13 +125,19 @@ std::string basicline(address linenum, const std::string & line)
 
 } // namespace
 
-std::string spectrum::basicloader(const Asm & as)
+namespace
+{
+
+// Loader of the code and of the banks that follow it, paged at
+// C000H writing to the port 7FFDH as in the 48K Basic of the 128K.
+
+std::string loader(address clear, bool hasusr, address usr,
+    const std::vector <Asm::BankCode> & banks)
 {
-    const address minused = as.getminused();
     std::string basic;
 
     // Line: 10 CLEAR before_min_used
-    std::string line = tokCLEAR + number(minused - 1);
+    std::string line = tokCLEAR + number(clear);
     basic+= basicline(10, line);
 
     // Line: 20 POKE 23610, 255
@@ -138,14 +149,295 @@ std::string spectrum::basicloader(const Asm & as)
     line = tokLOAD + "\"\"" + tokCODE;
     basic+= basicline(30, line);
 
-    if (as.hasentrypoint())
+    if (! banks.empty() )
+    {
+        for (size_t i = 0; i < banks.size(); ++i)
+        {
+            // Line: 31... OUT 32765, 16 + bank: LOAD "" CODE
+            const byte bank = banks [i].bank;
+            line = tokOUT + number(32765) + ',' + number(16 + bank) +
+                ':' + tokLOAD + "\"\"" + tokCODE;
+            basic+= basicline(static_cast <address> (31 + i), line);
+        }
+
+        // Line: 39 OUT 32765, 16
+        line = tokOUT + number(32765) + ',' + number(16);
+        basic+= basicline(39, line);
+    }
+
+    if (hasusr)
+    {
+        // Line: 40 RANDOMIZE USR entry_point
+        line = tokRANDOMIZE + tokUSR + number(usr);
+        basic+= basicline(40, line);
+    }
+
+    return basic;
+}
+
+} // namespace
+
+std::string spectrum::basicloader(address clear, bool hasusr, address usr)
+{
+    return loader(clear, hasusr, usr, std::vector <Asm::BankCode> () );
+}
+
+void spectrum::checkbanks(const Asm & as)
+{
+    const std::vector <Asm::BankCode> banks = as.getbanks();
+    for (size_t i = 0; i < banks.size(); ++i)
+    {
+        const Asm::BankCode & bank = banks [i];
+        if (bank.bank > 7)
+            throw std::runtime_error("Bank " + std::to_string(bank.bank) +
+                " does not exist in the Spectrum 128K");
+        if (bank.start < 0xC000)
+            throw std::runtime_error("The banks of the Spectrum 128K are "
+                "paged at C000H");
+    }
+}
+
+std::string spectrum::basicloader(const Asm & as)
+{
+    checkbanks(as);
+    return loader(as.getminused() - 1,
+        as.hasentrypoint(), as.getentrypoint(), as.getbanks() );
+}
+
+std::string spectrum::basicloader(address clear, bool hasusr, address usr,
+    const std::vector <byte> & turbo)
+{
+    std::string basic;
+
+    // Line: 1 REM turbo_loader
+    // Must be the first line, its address is taken from PROG.
+    std::string line = tokREM + std::string(turbo.begin(), turbo.end() );
+    basic+= basicline(1, line);
+
+    // Line: 10 CLEAR before_min_used
+    line = tokCLEAR + number(clear);
+    basic+= basicline(10, line);
+
+    // Line: 20 POKE 23610, 255
+    line = tokPOKE + number(23610) + ',' + number(255);
+    basic+= basicline(20, line);
+
+    // Line: 30 RANDOMIZE USR (PEEK 23635 + 256 * PEEK 23636 + 5)
+    line = tokRANDOMIZE + tokUSR + '(' +
+        tokPEEK + number(23635) + '+' + number(256) + '*' +
+        tokPEEK + number(23636) + '+' + number(5) + ')';
+    basic+= basicline(30, line);
+
+    if (hasusr)
     {
         // Line: 40 RANDOMIZE USR entry_point
-        line = tokRANDOMIZE + tokUSR + number(as.getentrypoint());
+        line = tokRANDOMIZE + tokUSR + number(usr);
         basic+= basicline(40, line);
     }
 
     return basic;
 }
 
+std::vector <byte> spectrum::turboloader(address dest, address size,
+    const tzx::Timing & timing)
+{
+    // The routine must be relocatable, it runs from the REM line.
+    // Flag and checksum are loaded before and after the code,
+    // the bytes there are saved in the stack and restored later.
+    // Each iteration of the edge loops takes 45 T states, the
+    // thresholds discount the time spent out of them.
+
+    const size_t loop = 45;
+    const address before = dest - 1;
+    const address after = dest + size;
+    const address len = size + 2;
+    const byte pilotmin = static_cast <byte>
+        ( ( (timing.pilot + timing.sync1) / 2 - 49) / loop);
+    const byte threshold = static_cast <byte>
+        ( (timing.zero + timing.one - 60) / loop);
+
+    const byte code [] = {
+        0xF3,                       // DI
+        0x3A, lobyte(before), hibyte(before), // LD A,(dest-1)
+        0xF5,                       // PUSH AF
+        0x3A, lobyte(after), hibyte(after),   // LD A,(dest+size)
+        0xF5,                       // PUSH AF
+        0xDD, 0x21, lobyte(before), hibyte(before), // LD IX,dest-1
+        0x11, lobyte(len), hibyte(len),       // LD DE,size+2
+        0xDB, 0xFE,                 // IN A,(FEh)
+        0xE6, 0x40,                 // AND 40h
+        0x4F,                       // LD C,A
+        // pilot: 256 pulses longer than pilotmin.
+        0x26, 0x00,                 // LD H,0
+        // ppulse:
+        0x06, 0x00,                 // LD B,0
+        // pedge:
+        0x04,                       // INC B
+        0x28, 0xF9,                 // JR Z,pilot
+        0xDB, 0xFE,                 // IN A,(FEh)
+        0xA9,                       // XOR C
+        0xE6, 0x40,                 // AND 40h
+        0x28, 0xF6,                 // JR Z,pedge
+        0xA9,                       // XOR C
+        0x4F,                       // LD C,A
+        0x78,                       // LD A,B
+        0xFE, pilotmin,             // CP pilotmin
+        0x38, 0xEB,                 // JR C,pilot
+        0x24,                       // INC H
+        0x20, 0xEA,                 // JR NZ,ppulse
+        // sync: wait for a short pulse.
+        0x06, 0x00,                 // LD B,0
+        // sedge:
+        0x04,                       // INC B
+        0x28, 0xE3,                 // JR Z,pilot
+        0xDB, 0xFE,                 // IN A,(FEh)
+        0xA9,                       // XOR C
+        0xE6, 0x40,                 // AND 40h
+        0x28, 0xF6,                 // JR Z,sedge
+        0xA9,                       // XOR C
+        0x4F,                       // LD C,A
+        0x78,                       // LD A,B
+        0xFE, pilotmin,             // CP pilotmin
+        0x30, 0xED,                 // JR NC,sync
+        // sync2: skip second sync pulse.
+        0xDB, 0xFE,                 // IN A,(FEh)
+        0xA9,                       // XOR C
+        0xE6, 0x40,                 // AND 40h
+        0x28, 0xF9,                 // JR Z,sync2
+        0xA9,                       // XOR C
+        0x4F,                       // LD C,A
+        0x26, 0x00,                 // LD H,0
+        // nextbyte:
+        0x2E, 0x01,                 // LD L,1
+        // nextbit: two pulses per bit.
+        0x06, 0x00,                 // LD B,0
+        // edge1:
+        0x04,                       // INC B
+        0x28, 0x3E,                 // JR Z,fail
+        0xDB, 0xFE,                 // IN A,(FEh)
+        0xA9,                       // XOR C
+        0xE6, 0x40,                 // AND 40h
+        0x28, 0xF6,                 // JR Z,edge1
+        0xA9,                       // XOR C
+        0x4F,                       // LD C,A
+        // edge2:
+        0x04,                       // INC B
+        0x28, 0x32,                 // JR Z,fail
+        0xDB, 0xFE,                 // IN A,(FEh)
+        0xA9,                       // XOR C
+        0xE6, 0x40,                 // AND 40h
+        0x28, 0xF6,                 // JR Z,edge2
+        0xA9,                       // XOR C
+        0x4F,                       // LD C,A
+        0x78,                       // LD A,B
+        0xFE, threshold,            // CP threshold
+        0x3F,                       // CCF
+        0xCB, 0x15,                 // RL L
+        0x30, 0xDE,                 // JR NC,nextbit
+        0x7C,                       // LD A,H
+        0xAD,                       // XOR L
+        0x67,                       // LD H,A
+        0xDD, 0x75, 0x00,           // LD (IX+0),L
+        0xDD, 0x23,                 // INC IX
+        0x1B,                       // DEC DE
+        0x7A,                       // LD A,D
+        0xB3,                       // OR E
+        0x20, 0xCF,                 // JR NZ,nextbyte
+        // Check flag and checksum.
+        0x3A, lobyte(before), hibyte(before), // LD A,(dest-1)
+        0x3C,                       // INC A
+        0xB4,                       // OR H
+        // finish:
+        0x6F,                       // LD L,A
+        0xF1,                       // POP AF
+        0x32, lobyte(after), hibyte(after),   // LD (dest+size),A
+        0xF1,                       // POP AF
+        0x32, lobyte(before), hibyte(before), // LD (dest-1),A
+        0xFB,                       // EI
+        0x7D,                       // LD A,L
+        0xB7,                       // OR A
+        0xC8,                       // RET Z
+        0xCF, 0x1A,                 // RST 8: R Tape loading error
+        // fail:
+        0x3E, 0x01,                 // LD A,1
+        0x18, 0xED,                 // JR finish
+    };
+    return std::vector <byte> (code, code + sizeof(code) );
+}
+
+//**************************************************************
+
+spectrum::CompressedCode::CompressedCode(const Asm & as)
+{
+    // Lowest address usable without overwriting the basic loader.
+    const size_t lowest = 24000;
+
+    const address minused = as.getminused();
+    originalsize = as.getcodesize();
+    const size_t maxused = minused + originalsize - 1;
+
+    const std::vector <byte> packed =
+        lzpack::pack(as.getmem() + minused, originalsize);
+    packedsize = static_cast <address> (packed.size() );
+    const size_t stubsize = lzpack::decompressor(0, 0,
+        as.hasentrypoint(), as.getentrypoint() ).size();
+    const size_t total = stubsize + packed.size();
+
+    // Place it at the top of memory, or else just before the code.
+    if (maxused + 1 + total <= 0x10000)
+    {
+        start = static_cast <address> (0x10000 - total);
+        clear = minused - 1;
+    }
+    else if (minused >= lowest + total)
+    {
+        start = static_cast <address> (minused - total);
+        clear = start - 1;
+    }
+    else
+        throw std::runtime_error("No room in memory for compressed code");
+
+    image = lzpack::decompressor(
+        static_cast <address> (start + stubsize), minused,
+        as.hasentrypoint(), as.getentrypoint() );
+    image.insert(image.end(), packed.begin(), packed.end() );
+}
+
+address spectrum::CompressedCode::getstart() const
+{
+    return start;
+}
+
+address spectrum::CompressedCode::getsize() const
+{
+    return static_cast <address> (image.size() );
+}
+
+const byte * spectrum::CompressedCode::getdata() const
+{
+    return & image [0];
+}
+
+address spectrum::CompressedCode::getclear() const
+{
+    return clear;
+}
+
+address spectrum::CompressedCode::getoriginalsize() const
+{
+    return originalsize;
+}
+
+address spectrum::CompressedCode::getpackedsize() const
+{
+    return packedsize;
+}
+
+std::string spectrum::basicloader(const CompressedCode & code)
+{
+    // The decompressor is at the start of the block and jumps
+    // to the entry point when finished.
+    return basicloader(code.getclear(), true, code.getstart() );
+}
+
 // End
@@ -4,8 +4,10 @@
 // spectrum.h
 
 #include "pasmotypes.h"
+#include "tzx.h"
 
 #include <string>
+#include <vector>
 
 class Asm;
 
@@ -18,7 +20,7 @@ public:
     Plus3Head();
     void setsize(address size);
     void setstart(address start);
-    void write(std::ostream & out);
+    void write(ByteBuffer & out);
 private:
     static const size_t headsize= 128;
     byte plus3[headsize];
@@ -42,8 +44,51 @@ std::string linelength(address n);
 std::string basicline(address linenum, const std::string & line);
 #endif
 
+// Check that the banks used exist in the Spectrum 128K and that
+// their code is in the page at C000H. Throws runtime_error if not.
+
+void checkbanks(const Asm & as);
+
+// Loader of the code and, in the 128K, of the banks used.
+
 std::string basicloader(const Asm & as);
 
+std::string basicloader(address clear, bool hasusr, address usr);
+
+// Basic loader with a turbo loader routine in a REM line, that
+// is called before executing the code.
+
+std::string basicloader(address clear, bool hasusr, address usr,
+    const std::vector <byte> & turbo);
+
+// Turbo loader routine for a block loaded at dest with the timing given.
+
+std::vector <byte> turboloader(address dest, address size,
+    const tzx::Timing & timing);
+
+// Compressed code block with the decompressor routine in front of it,
+// placed in memory where it does not overlap the decompressed code.
+
+class CompressedCode
+{
+public:
+    CompressedCode(const Asm & as);
+    address getstart() const;
+    address getsize() const;
+    const byte * getdata() const;
+    address getclear() const;
+    address getoriginalsize() const;
+    address getpackedsize() const;
+private:
+    address start;
+    address clear;
+    address originalsize;
+    address packedsize;
+    std::vector <byte> image;
+};
+
+std::string basicloader(const CompressedCode & code);
+
 } // namespace spectrum
 
 #endif
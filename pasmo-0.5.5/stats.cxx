@@ -0,0 +1,262 @@
+// stats.cxx
+
+#include "stats.h"
+
+#include <iomanip>
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define HAVE_GETRUSAGE 1
+#endif
+
+namespace
+{
+
+// The names can have paths of files, with any character in them.
+
+std::string jsonstring(const std::string & str)
+{
+    static const char hexdigit [] = "0123456789abcdef";
+    std::string result(1, '"');
+    for (std::string::size_type i = 0; i < str.size(); ++i)
+    {
+        const unsigned char c = str [i];
+        switch (c)
+        {
+        case '"':
+        case '\\':
+            result += '\\';
+            result += c;
+            break;
+        case '\n':
+            result += "\\n";
+            break;
+        case '\r':
+            result += "\\r";
+            break;
+        case '\t':
+            result += "\\t";
+            break;
+        default:
+            if (c < 0x20)
+            {
+                result += "\\u00";
+                result += hexdigit [c >> 4];
+                result += hexdigit [c & 0x0F];
+            }
+            else
+                result += c;
+        }
+    }
+    result += '"';
+    return result;
+}
+
+} // namespace
+
+Stats::Stats() :
+    origin(std::chrono::steady_clock::now() ),
+    nopenphases(0)
+{ }
+
+double Stats::elapsed() const
+{
+    const std::chrono::duration <double> d =
+        std::chrono::steady_clock::now() - origin;
+    return d.count();
+}
+
+void Stats::begin(const std::string & name,
+    const std::string & file, size_t line, bool span)
+{
+    Phase phase;
+    phase.name = name;
+    phase.file = file;
+    phase.line = line;
+    phase.level = nopenphases;
+    phase.span = span;
+    phase.start = elapsed();
+    phase.wall = 0;
+    phase.cpu = 0;
+    phases.push_back(phase);
+    if (! span)
+        ++nopenphases;
+
+    Open op;
+    op.index = phases.size() - 1;
+    op.wallstart = std::chrono::steady_clock::now();
+    op.cpustart = std::clock();
+    open.push_back(op);
+}
+
+void Stats::beginphase(const std::string & name,
+    const std::string & file, size_t line)
+{
+    begin(name, file, line, false);
+}
+
+void Stats::beginspan(const std::string & name,
+    const std::string & file, size_t line)
+{
+    begin(name, file, line, true);
+}
+
+void Stats::endphase()
+{
+    if (open.empty() )
+        return;
+    const Open & op = open.back();
+    Phase & phase = phases [op.index];
+    const std::chrono::duration <double> wall =
+        std::chrono::steady_clock::now() - op.wallstart;
+    phase.wall = wall.count();
+    phase.cpu = double(std::clock() - op.cpustart) / CLOCKS_PER_SEC;
+    if (! phase.span)
+        --nopenphases;
+    open.pop_back();
+}
+
+void Stats::cancelphase()
+{
+    if (open.empty() )
+        return;
+    const size_t index = open.back().index;
+    if (! phases [index].span)
+        --nopenphases;
+    // The phases opened after this one are nested in it,
+    // and already closed.
+    phases.erase(phases.begin() + index, phases.end() );
+    open.pop_back();
+}
+
+double Stats::phasetime(const std::string & name) const
+{
+    double result = 0;
+    for (size_t i = 0; i < phases.size(); ++i)
+        if (phases [i].name == name)
+            result += phases [i].wall;
+    return result;
+}
+
+void Stats::setcounter(const std::string & name, size_t value)
+{
+    for (size_t i = 0; i < counters.size(); ++i)
+        if (counters [i].first == name)
+        {
+            counters [i].second = value;
+            return;
+        }
+    counters.push_back(std::make_pair(name, value) );
+}
+
+void Stats::clear()
+{
+    phases.clear();
+    open.clear();
+    counters.clear();
+    nopenphases = 0;
+    origin = std::chrono::steady_clock::now();
+}
+
+void Stats::write(std::ostream & out) const
+{
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(6) <<
+        std::left << std::setw(24) << "Phase" <<
+        std::right << std::setw(12) << "Wall (s)" <<
+        std::setw(12) << "CPU (s)" << '\n';
+    for (size_t i = 0; i < phases.size(); ++i)
+    {
+        const Phase & phase = phases [i];
+        if (phase.span)
+            continue;
+        oss << std::left << std::setw(24) <<
+            (std::string(2 * phase.level, ' ') + phase.name) <<
+            std::right << std::setw(12) << phase.wall <<
+            std::setw(12) << phase.cpu << '\n';
+    }
+    for (size_t i = 0; i < counters.size(); ++i)
+        oss << std::left << std::setw(24) << counters [i].first <<
+            std::right << std::setw(12) << counters [i].second << '\n';
+    out << oss.str();
+}
+
+void Stats::writejson(std::ostream & out) const
+{
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(6) <<
+        "{\n  \"phases\": [";
+    bool first = true;
+    for (size_t i = 0; i < phases.size(); ++i)
+    {
+        const Phase & phase = phases [i];
+        if (phase.span)
+            continue;
+        oss << (first ? "\n" : ",\n") <<
+            "    { \"name\": " << jsonstring(phase.name) <<
+            ", \"level\": " << phase.level <<
+            ", \"wall\": " << phase.wall <<
+            ", \"cpu\": " << phase.cpu << " }";
+        first = false;
+    }
+    oss << "\n  ],\n  \"counters\": {";
+    for (size_t i = 0; i < counters.size(); ++i)
+        oss << (i == 0 ? "\n" : ",\n") <<
+            "    " << jsonstring(counters [i].first) << ": " <<
+            counters [i].second;
+    oss << "\n  }\n}\n";
+    out << oss.str();
+}
+
+void Stats::writetrace(std::ostream & out) const
+{
+    // Chrome trace event format, complete events with
+    // times in microseconds.
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3) <<
+        "{\n\"displayTimeUnit\": \"ms\",\n\"traceEvents\": [";
+    for (size_t i = 0; i < phases.size(); ++i)
+    {
+        const Phase & phase = phases [i];
+        oss << (i == 0 ? "\n" : ",\n") <<
+            "{\"name\": " << jsonstring(phase.name) <<
+            ", \"cat\": " << (phase.span ? "\"span\"" : "\"phase\"") <<
+            ", \"ph\": \"X\", \"pid\": 1, \"tid\": 1" <<
+            ", \"ts\": " << phase.start * 1e6 <<
+            ", \"dur\": " << phase.wall * 1e6;
+        if (! phase.file.empty() )
+        {
+            oss << ", \"args\": {\"file\": " << jsonstring(phase.file);
+            if (phase.line != 0)
+                oss << ", \"line\": " << phase.line;
+            oss << '}';
+        }
+        oss << '}';
+    }
+    oss << "\n]\n}\n";
+    out << oss.str();
+}
+
+size_t peakmemory()
+{
+    #if HAVE_GETRUSAGE
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, & usage) != 0)
+        return 0;
+    #ifdef __APPLE__
+    // In bytes in Mac OS X.
+    return usage.ru_maxrss / 1024;
+    #else
+    return usage.ru_maxrss;
+    #endif
+
+    #else
+
+    return 0;
+
+    #endif
+}
+
+// End
@@ -0,0 +1,76 @@
+#ifndef INCLUDE_STATS_H
+#define INCLUDE_STATS_H
+
+// stats.h
+
+// Time spent in each phase of the assembly and other counters,
+// shown with the --stats option.
+// Spans are finer grained phases, such as includes and macro
+// expansions, only written in the trace of the --trace option.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+
+#include <stdlib.h>
+
+class Stats
+{
+public:
+    Stats();
+    void beginphase(const std::string & name,
+        const std::string & file = std::string(), size_t line = 0);
+    void beginspan(const std::string & name,
+        const std::string & file, size_t line);
+    void endphase();
+    // Close the last phase or span discarding it.
+    void cancelphase();
+    // Wall time of all the phases with that name.
+    double phasetime(const std::string & name) const;
+    void setcounter(const std::string & name, size_t value);
+    // Discard the phases and counters, starting the time again.
+    void clear();
+    void write(std::ostream & out) const;
+    void writejson(std::ostream & out) const;
+    void writetrace(std::ostream & out) const;
+private:
+    struct Phase
+    {
+        std::string name;
+        std::string file;
+        size_t line;
+        size_t level;
+        bool span;
+        double start;
+        double wall;
+        double cpu;
+    };
+    std::vector <Phase> phases;
+
+    void begin(const std::string & name,
+        const std::string & file, size_t line, bool span);
+    double elapsed() const;
+
+    std::chrono::steady_clock::time_point origin;
+    size_t nopenphases;
+
+    struct Open
+    {
+        size_t index;
+        std::chrono::steady_clock::time_point wallstart;
+        std::clock_t cpustart;
+    };
+    std::vector <Open> open;
+
+    std::vector <std::pair <std::string, size_t> > counters;
+};
+
+// Peak resident memory of the process in KB, 0 if not known.
+
+size_t peakmemory();
+
+#endif
+
+// End
@@ -6,6 +6,29 @@
 
 using std::fill;
 
+namespace
+{
+
+// Flag byte, content and checksum of both, computed while writing.
+
+void putcontent(ByteBuffer & out, byte flag, const byte * data, size_t size)
+{
+    out.resetcheck(0);
+    out.put(flag);
+    out.append(data, size);
+    out.put(out.getcheck() );
+}
+
+// The same preceded by its length.
+
+void writeblock(ByteBuffer & out, byte flag, const byte * data, size_t size)
+{
+    out.putword(static_cast <address> (size + 2) );
+    putcontent(out, flag, data, size);
+}
+
+} // namespace
+
 //**************************************************************
 
 tap::CodeHeader::CodeHeader(address init, address size,
@@ -35,17 +58,11 @@ tap::CodeHeader::CodeHeader(address init, address size,
     // Parameter 2: 32768 in a code block.
     block [18] = 0x00;
     block [19] = 0x80;
-
-    // Checksum
-    byte check = block [2]; // Flag byte included.
-    for (int i = 3; i < 20; ++i)
-        check^= block [i];
-    block [20] = check;
 }
 
-void tap::CodeHeader::write(std::ostream & out) const
+void tap::CodeHeader::write(ByteBuffer & out) const
 {
-    out.write(reinterpret_cast <const char *>(block), sizeof(block) );
+    writeblock(out, block [2], block + 3, sizeof(block) - 3);
 }
 
 //**************************************************************
@@ -54,22 +71,16 @@ tap::CodeBlock::CodeBlock(address sizen, const byte * datan) :
     datasize(sizen),
     data(datan)
 {
-    const address blocksize = datasize + 2; // Code + flag + checksum.
-    head [0] = lobyte(blocksize);
-    head [1] = hibyte(blocksize);
-    head [2] = 0xFF; // Flag: data block.
-
-    // Compute the checksum.
-    check = 0xFF; // Flag byte included.
-    for (int i = 0; i < datasize; ++i)
-        check^= data [i];
 }
 
-void tap::CodeBlock::write(std::ostream & out) const
+void tap::CodeBlock::write(ByteBuffer & out) const
+{
+    writeblock(out, 0xFF, data, datasize); // Flag: data block.
+}
+
+void tap::CodeBlock::writecontent(ByteBuffer & out) const
 {
-    out.write(reinterpret_cast <const char *>(head), sizeof(head) );
-    out.write(reinterpret_cast <const char *>(data), datasize);
-    out.write(reinterpret_cast <const char *>(& check), 1);
+    putcontent(out, 0xFF, data, datasize);
 }
 
 //**************************************************************
@@ -92,39 +103,24 @@ tap::BasicHeader::BasicHeader(const std::string & basic)
     // Start of variable area: at the end.
     block [18] = block [14];
     block [19] = block [15];
-    // Checksum
-    byte check = block [2]; // Flag byte incl.
-    for (int i = 3; i < 20; ++i)
-        check^= block [i];
-    block [20] = check;
 }
 
-void tap::BasicHeader::write(std::ostream & out) const
+void tap::BasicHeader::write(ByteBuffer & out) const
 {
-    out.write(reinterpret_cast <const char *>(block), sizeof(block) );
+    writeblock(out, block [2], block + 3, sizeof(block) - 3);
 }
 
 //**************************************************************
 
 tap::BasicBlock::BasicBlock(const std::string & basicn) :
-    basic(basicn),
-    basicsize(static_cast <address>(basic.size() ) )
+    basic(basicn)
 {
-    const address blocksize = basicsize + 2; // Code + flag + checksum.
-    block [0] = blocksize & 0xFF;
-    block [1] = blocksize >> 8;
-    block [2] = 0xFF; // Flag: data block.
-    // Compute the checksum.
-    check = 0xFF; // Flag byte included.
-    for (int i = 0; i < basicsize; ++i)
-        check^= static_cast <unsigned char>(basic [i]);
 }
 
-void tap::BasicBlock::write(std::ostream & out) const
+void tap::BasicBlock::write(ByteBuffer & out) const
 {
-    out.write(reinterpret_cast <const char *>(block), sizeof(block) );
-    out.write(basic.data(), basicsize);
-    out.write(reinterpret_cast <const char *>(& check), 1);
+    writeblock(out, 0xFF, reinterpret_cast <const byte *> (basic.data() ),
+        static_cast <address> (basic.size() ) );
 }
 
 // End
@@ -14,42 +14,40 @@ class CodeHeader
 {
 public:
     CodeHeader(address init, address size, const std::string & filename);
-    void write(std::ostream & out) const;
+    void write(ByteBuffer & out) const;
 private:
-    byte block [21];
+    // Without the checksum, computed when writing.
+    byte block [20];
 };
 
 class CodeBlock
 {
 public:
     CodeBlock(address sizen, const byte * datan);
-    void write(std::ostream & out) const;
+    void write(ByteBuffer & out) const;
+    // Without the length, for tzx turbo blocks.
+    void writecontent(ByteBuffer & out) const;
 private:
     address datasize;
     const byte * const data;
-    byte head [3];
-    byte check;
 };
 
 class BasicHeader
 {
 public:
     BasicHeader(const std::string & basic);
-    void write(std::ostream & out) const;
+    void write(ByteBuffer & out) const;
 private:
-    byte block [21];
+    byte block [20];
 };
 
 class BasicBlock
 {
 public:
     BasicBlock(const std::string & basicn);
-    void write(std::ostream & out) const;
+    void write(ByteBuffer & out) const;
 private:
     const std::string & basic;
-    address basicsize;
-    byte block [3];
-    byte check;
 };
 
 } // namespace tap
@@ -3,9 +3,13 @@
 #include "token.h"
 #include "asm.h"
 #include "asmerror.h"
+#include "stats.h"
 
 #include "test_protocol.h"
 
+#include <fstream>
+#include <sstream>
+
 using namespace Pasmo::Test;
 
 void throws_asmerror(const char * msg, void (*fn) (void))
@@ -360,11 +364,255 @@ void autolocal()
     parseline_throws(as, "MACRO _autolocalvar", "autolocal name as MACRO");
 }
 
+void writesource(const char * filename, const std::string & text)
+{
+    std::ofstream out(filename);
+    out << text;
+}
+
+// Source with 'extra' inserted in the middle and 'value' near the end.
+
+std::string incsource(const std::string & extra, int value)
+{
+    std::ostringstream oss;
+    oss << "\tORG 8000H\nCOUNT DEFL 0\n"
+        "ADDIT MACRO N\nCOUNT DEFL COUNT + N\n\tDEFB N\n\tENDM\n";
+    for (int i = 0; i < 300; ++i)
+    {
+        if (i == 150)
+            oss << extra << "\tINCLUDE incremental_inc.asm\n";
+        oss << "L" << i << ":\tJP L" << (i * 7) % 300 <<
+            "\n\tADDIT " << i % 10 << "\n\tDEFW COUNT\n";
+    }
+    oss << "\tLD A," << value << "\n\tEND L0\n";
+    return oss.str();
+}
+
+std::string binresult(Asm & as)
+{
+    std::ostringstream oss;
+    as.writebincode(oss);
+    as.dumpsymbol(oss);
+    return oss.str();
+}
+
+bool sameasfull(Asm & as)
+{
+    Asm full;
+    full.loadfile("incremental_test.asm");
+    full.processfile();
+    return binresult(as) == binresult(full);
+}
+
+void incremental()
+{
+    writesource("incremental_inc.asm", "INC1:\tLD HL,INC1\n");
+    writesource("incremental_test.asm", incsource("", 1) );
+    Asm as;
+    as.incremental(20);
+    as.loadfile("incremental_test.asm");
+    as.processfile();
+    ok(sameasfull(as), "Incremental first assembly");
+
+    writesource("incremental_test.asm", incsource("", 2) );
+    as.reloadfile("incremental_test.asm");
+    as.processfile();
+    ok(as.getresumeline(1) > 800 && as.getresumeline(2) > 800,
+        "Incremental resumes both passes near the change");
+    ok(sameasfull(as), "Incremental change at the end");
+
+    writesource("incremental_test.asm", incsource("\tNOP\n", 2) );
+    as.reloadfile("incremental_test.asm");
+    as.processfile();
+    ok(as.getresumeline(1) > 400 && as.getresumeline(2) == 0,
+        "Incremental full pass 2 when symbols change");
+    ok(sameasfull(as), "Incremental change that moves labels");
+
+    writesource("incremental_inc.asm", "INC1:\tLD DE,INC1\n");
+    as.reloadfile("incremental_test.asm");
+    as.processfile();
+    ok(as.getresumeline(2) > 400, "Incremental change in included file");
+    ok(sameasfull(as), "Incremental included file result");
+}
+
+// Sources read from memory.
+
+bool memoryfile(const std::string & filename, std::string & content)
+{
+    if (filename == "main.asm")
+        content = "\tORG 100H\n\tINCLUDE sub.asm\n\tINCBIN data.bin\n"
+            "UNUSED:\tNOP\n";
+    else if (filename == "lib/sub.asm")
+        content = "\tLD A,1\n\t.WARNING Included\n";
+    else if (filename == "data.bin")
+        content = std::string("\x12\x34", 2);
+    else if (filename == "bad.asm")
+        content = "\tNOP\n\tLD A,NOWHERE\n";
+    else if (filename == "top.asm")
+        content = "\tORG 0FFFEH\n\tLD A,1\nLONGLABELNAME:\tEND\n";
+    else if (filename == "banked.asm")
+        content = "\tORG 8000H\n\tLD A,.BANK DATA\n"
+            "\t.BANK 3\n\tORG 0C010H\nDATA:\tDB 1,2\n"
+            "\t.BANK\n\tORG 8002H\n\tRET\n";
+    else if (filename == "reloc.asm")
+        content = "\tLD HL,DATA\n\tDEFS 3\nDATA:\tDEFW 0\n\tDEFW DATA\n";
+    else
+        return false;
+    return true;
+}
+
+void library()
+{
+    Asm as;
+    as.setfileprovider(memoryfile);
+    as.addincludedir("lib");
+    as.collectdiagnostics();
+    ok(as.assemble("main.asm"), "Assemble from memory");
+
+    std::vector <byte> buffer;
+    as.emit(& Asm::emitobject, buffer);
+    const byte expected [] = { 0x3E, 0x01, 0x12, 0x34, 0x00 };
+    ok(buffer == std::vector <byte> (expected, expected + sizeof(expected) ),
+        "Emit to buffer");
+
+    const std::vector <AsmDiagnostic> & diags = as.getdiagnostics();
+    // .WARNING is shown in both passes, but recorded only once.
+    ok(diags.size() == 2 && diags [0].kind == AsmDiagnostic::Warning &&
+        diags [0].file == "sub.asm" && diags [0].line == 2 &&
+        diags [0].message == "Included" &&
+        diags [1].file == "main.asm" && diags [1].line == 4,
+        "Warnings returned as diagnostics");
+
+    Asm bad;
+    bad.setfileprovider(memoryfile);
+    bad.collectdiagnostics();
+    ok(! bad.assemble("bad.asm") && bad.getdiagnostics().size() == 1 &&
+        bad.getdiagnostics() [0].kind == AsmDiagnostic::Error &&
+        bad.getdiagnostics() [0].line == 2,
+        "Errors returned as diagnostics");
+
+    Asm missing;
+    missing.setfileprovider(memoryfile);
+    missing.collectdiagnostics();
+    ok(! missing.assemble("missing.asm") &&
+        missing.getdiagnostics().size() == 1,
+        "Missing file returned as diagnostic");
+}
+
+// Text emitters with the code at the end of the memory.
+
+void textoutput()
+{
+    Asm as;
+    as.setfileprovider(memoryfile);
+    as.assemble("top.asm");
+
+    std::ostringstream hex;
+    as.emithex(hex);
+    ok(hex.str() == ":02FFFE003E01C2\r\n:00000001FF\r\n",
+        "Intel HEX up to FFFFH");
+
+    std::ostringstream symbols;
+    as.dumpsymbol(symbols);
+    ok(symbols.str() == "LONGLABELNAME\tEQU 00000H\n",
+        "Symbol table");
+}
+
+// Code in banks.
+
+void banks()
+{
+    Asm as;
+    as.setfileprovider(memoryfile);
+    as.assemble("banked.asm");
+
+    ok(as.getminused() == 0x8000 && as.getcodesize() == 3 &&
+        as.peekbyte(0x8001) == 3 && as.peekbyte(0x8002) == 0xC9,
+        "Main memory with banks");
+
+    const std::vector <Asm::BankCode> code = as.getbanks();
+    ok(code.size() == 1 && code [0].bank == 3 &&
+        code [0].start == 0xC010 && code [0].size == 2 &&
+        code [0].data [0] == 1 && code [0].data [1] == 2,
+        "Code generated in a bank");
+
+    std::ostringstream symbols;
+    as.setsymbolformat(Asm::SymbolNocash);
+    as.dumpsymbol(symbols);
+    ok(symbols.str() == "03:C010 DATA\n", "Bank of the labels");
+
+    Asm out;
+    parseline(out, ".BANK 1");
+    parseline_throws(out, "NOP", "Code out of the page of the bank");
+
+    Asm twopages;
+    parseline(twopages, ".PAGE 4000H");
+    parseline(twopages, ".BANK 1");
+    parseline(twopages, "ORG 4000H");
+    parseline(twopages, "DB 1");
+    parseline(twopages, ".PAGE 0C000H");
+    parseline(twopages, "ORG 0FFFFH");
+    parseline_throws(twopages, "DB 2", "Bank used in two pages");
+
+    assembleline_throws(".BANK 256", "Invalid bank number");
+    assembleline_throws(".PAGE 1000H", "Invalid page address");
+    assembleline(".PAGE 4000H", ".PAGE directive");
+}
+
+// Memory shared by pages between assemblies, and its use to find
+// the relocations.
+
+void memimage()
+{
+    MemImage mem;
+    mem.set(0x1234, 7);
+    MemImage copy;
+    copy.share(mem, 0);
+    copy.set(0x1234, 7);
+    const bool same = copy.getcopied() == 0 && copy [0x1235] == 0;
+    copy.set(0x1235, 8);
+    ok(same && copy.getcopied() == 1 && mem [0x1235] == 0 &&
+        copy [0x1234] == 7 && copy.data() [0x1235] == 8,
+        "Page copied when it changes");
+
+    MemImage moved;
+    moved.share(mem, 0x100);
+    const bool empty = moved [0x1334] == 0;
+    moved.set(0x1334, 7);
+    ok(empty && moved [0x1334] == 7 && moved.getcopied() == 0,
+        "Page shared at other address");
+
+    // The uninitialized DEFS must be the same in both assemblies.
+    Asm as;
+    as.setfileprovider(memoryfile);
+    as.assemble("reloc.asm");
+    std::vector <byte> prl;
+    as.emit(& Asm::emitprl, prl);
+    ok(prl.size() == 256 + 10 + 2 &&
+        prl [256 + 10] == 0x20 && prl [256 + 11] == 0x40,
+        "PRL relocation bitmap");
+}
+
+// Names of the trace with characters that must be escaped in JSON.
+
+void tracenames()
+{
+    Stats stats;
+    stats.beginspan("in\tclude\n\x01", "a\"b\\c.asm", 1);
+    stats.endphase();
+    std::ostringstream trace;
+    stats.writetrace(trace);
+    const std::string str = trace.str();
+    ok(str.find("\"in\\tclude\\n\\u0001\"") != std::string::npos &&
+        str.find("\"a\\\"b\\\\c.asm\"") != std::string::npos,
+        "Names escaped in the trace");
+}
+
 //**************************************************************
 
 int main()
 {
-    plan(140);
+    plan(166);
 
     {
     Asm as;
@@ -489,6 +737,12 @@ int main()
     expressions();
     defined_var();
     autolocal();
+    incremental();
+    library();
+    textoutput();
+    banks();
+    memimage();
+    tracenames();
 }
 
 // End
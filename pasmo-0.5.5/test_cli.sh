@@ -4,6 +4,7 @@ BIN="asmtested.bin"
 SYM="asmtested.sym"
 
 PASMO=./pasmo
+LINK=./pasmo-link
 
 count=0
 
@@ -36,7 +37,19 @@ assemble_failed ()
     ok $((! $?)) "Assemble failed $prog"
 }
 
-echo '1..42'
+# Bytes of a file in hex, from an offset.
+peek ()
+{
+    od -An -tx1 -v -j $2 -N $3 $1 | tr -d ' \n'
+}
+
+# All the bytes of a file in hex.
+hexfile ()
+{
+    od -An -tx1 -v $1 | tr -d ' \n'
+}
+
+echo '1..102'
 
 ${PASMO} all.asm $BIN
 cmp -s $BIN all.check
@@ -105,6 +118,14 @@ ok $? 'Assembled autolocal_test.asm'
 ${PASMO} -I testaux include_test.asm $BIN
 ok $? 'Assembled include_test.asm'
 
+${PASMO} -I testaux repinc_test.asm $BIN &&
+test $(wc -c < $BIN) -eq 9
+ok $? 'Assembled repinc_test.asm'
+
+${PASMO} -I testaux --equ FAIL repinc_test.asm $BIN 2>&1 |
+grep -q 'on line 5 of file repinc_inner.asm'
+ok $? 'Error line in repeated include'
+
 ${PASMO} include_bad_test.asm $BIN
 ok $((! $?)) 'Assemble failed include_bad_test.asm'
 
@@ -166,4 +187,315 @@ ${PASMO} incbin_test.asm $BIN
 cmp -s $BIN all.check
 ok $? 'Assembled incbin_test.asm'
 
+assemble_failed relax_test.asm
+
+${PASMO} --relax relax_test.asm $BIN
+cmp -s $BIN relax.check
+ok $? 'Assembled relax_test.asm with --relax'
+
+${PASMO} --tapbas --compress black.asm black.tap
+ok $? 'Generate compressed tapbas'
+
+${PASMO} --tzxbas --compress black.asm black.tzx
+ok $? 'Generate compressed tzxbas'
+
+${PASMO} --tzxbas --speed turbo black.asm black.tzx
+ok $? 'Generate turbo tzxbas'
+
+${PASMO} --tzx --speed turbo black.asm black.tzx
+ok $((! $?)) 'Speed not supported in tzx without loader'
+
+${PASMO} --tapbas --speed fast black.asm black.tap
+ok $((! $?)) 'Speed not supported in tapbas'
+
+${PASMO} --cdt --speed standard black.asm black.cdt
+ok $? 'Generate standard speed cdt'
+
+${PASMO} --cdt --speed turbo black.asm black.cdt
+ok $((! $?)) 'Turbo speed not supported in cdt'
+
+${PASMO} --cdt --speed standard black.asm black.cdt &&
+cp black.cdt asmkeep.cdt &&
+! ${PASMO} --cdt --speed turbo black.asm black.cdt 2> /dev/null &&
+cmp -s black.cdt asmkeep.cdt
+ok $? 'Failed generation keeps the previous object file'
+
+${PASMO} --sna hellospec.asm asmtested.sna &&
+test $(wc -c < asmtested.sna) -eq 49179
+ok $? 'Generate sna snapshot'
+
+${PASMO} --z80snap --snapbase asmtested.sna hellospec.asm asmtested.z80 &&
+${PASMO} --sna --snapbase asmtested.z80 hellospec.asm asmbase.sna &&
+cmp -s asmtested.sna asmbase.sna
+ok $? 'Snapshots used as base keep their contents'
+
+printf '\tORG 100H\n\tRET\n' > asmsnap.asm
+${PASMO} --sna asmsnap.asm asmtested.sna 2> /dev/null
+ok $((! $?)) 'Code in ROM can not be placed in a snapshot'
+
+# In the 48K .sna SP is at offset 23, the RAM starts at offset 27 and
+# the program counter is pushed at SP. The .z80 has SP at offset 8
+# and the program counter at offset 32.
+printf '\tORG 8000H\n\tDI\n\tRET\n' > asmsnap.asm
+${PASMO} --sna asmsnap.asm asmtested.sna &&
+test $(peek asmtested.sna 23 2) = fb7f &&
+test $(peek asmtested.sna $((27 + 0x3FFB)) 2) = 0080 &&
+test $(peek asmtested.sna $((27 + 0x4000)) 2) = f3c9
+ok $? 'Stack below the code in sna snapshot'
+
+${PASMO} --sna asmsnap.asm asmbase.sna &&
+printf '\tORG 7F00H\n\tDS 100H\n' > asmsnap.asm &&
+! ${PASMO} --sna --snapbase asmbase.sna asmsnap.asm asmtested.sna 2> /dev/null
+ok $? 'Code over the stack of the base snapshot'
+
+printf '\tORG 5D00H\n\tDI\n\tDS 0FF60H-$,0AAH\n' > asmsnap.asm
+${PASMO} --sna asmsnap.asm asmtested.sna &&
+test $(peek asmtested.sna 23 2) = 60ff &&
+test $(peek asmtested.sna $((27 + 0xBF60)) 2) = 005d &&
+test $(peek asmtested.sna $((27 + 0x1D00)) 2) = f3aa &&
+test $(peek asmtested.sna $((27 + 0xBF5E)) 2) = aaaa &&
+${PASMO} --z80snap asmsnap.asm asmtested.z80 &&
+test $(peek asmtested.z80 8 2) = 62ff &&
+test $(peek asmtested.z80 32 2) = 005d
+ok $? 'Stack after the code that reaches the default stack'
+
+printf '\tORG 5D00H\n\tDS 0FFFEH-$\n' > asmsnap.asm
+${PASMO} --sna asmsnap.asm asmtested.sna 2> /dev/null
+ok $((! $?)) 'No room for the stack after the code'
+
+printf '\tORG 8000H\n\tLD A,.BANK data\n\tRET\n\t.BANK 1\n\tORG 0C000H\ndata\tDEFB 1,2\n' > asmbank.asm
+${PASMO} --tap asmbank.asm asmtested.tap &&
+test $(wc -c < asmtested.tap) -eq 55 &&
+test $(peek asmtested.tap 14 4) = 03000080 &&
+test $(peek asmtested.tap 42 4) = 020000c0 &&
+test $(peek asmtested.tap 49 5) = 0400ff0102
+ok $? 'Tap blocks with banks'
+
+# OUT 32765,17 before loading the bank 1 and OUT 32765,16 after it.
+${PASMO} --tapbas asmbank.asm asmtested.tap &&
+hexfile asmtested.tap |
+grep 'df33323736350e0000fd7f002c31370e0000110000' |
+grep -q 'df33323736350e0000fd7f002c31360e0000100000'
+ok $? 'Basic loader pages in the banks'
+
+# After the 48K RAM, the program counter, the port 7FFD and the
+# banks 1, 3, 4, 6 and 7.
+${PASMO} --sna asmbank.asm asmtested.sna &&
+test $(wc -c < asmtested.sna) -eq 131103 &&
+test $(peek asmtested.sna $((27 + 0x4000)) 3) = 3e01c9 &&
+test $(peek asmtested.sna 49179 3) = 008010 &&
+test $(peek asmtested.sna 49183 3) = 010200
+ok $? '128K snapshot with banks'
+
+# OUT &7F00,&C5 before loading the bank 5 and OUT &7F00,&C0 after it.
+printf '\tORG 4000H\n\tLD A,.BANK data\n\tRET\n\t.BANK 5\n\t.PAGE 4000H\n\tORG 4000H\ndata\tDEFB 1,2\n' > asmbank.asm
+${PASMO} --cdtbas asmbank.asm asmtested.cdt &&
+hexfile asmtested.cdt |
+grep 'b91c007f2c1cc500' |
+grep -q 'b91c007f2c1cc000'
+ok $? 'CPC loader pages in the banks'
+
+${PASMO} asmbank.asm $BIN 2> /dev/null
+ok $((! $?)) 'Banks can not be generated in raw binary'
+
+printf '\t.PAGE 4000H\n\t.BANK 3\n\tORG 4000H\n\tDEFB 1\n' > asmbank.asm
+! ${PASMO} --tap asmbank.asm asmtested.tap 2> /dev/null &&
+! ${PASMO} --tapbas asmbank.asm asmtested.tap 2> /dev/null &&
+! ${PASMO} --tzx asmbank.asm black.tzx 2> /dev/null &&
+! ${PASMO} --sna asmbank.asm asmtested.sna 2> /dev/null
+ok $? 'Spectrum banks must be paged at C000H'
+
+printf '\t.BANK 1\n\tORG 0C000H\n\tDEFB 1,2\n\tORG 0C001H\n\tDEFB 3\n' > asmbank.asm
+${PASMO} --tap asmbank.asm asmtested.tap 2>&1 |
+grep -q 'Code at C001 of bank 1 overwrites 1 previously' &&
+printf '\t.REGION bankarea, 0C000H, 0C000H\n' >> asmbank.asm &&
+! ${PASMO} --tap asmbank.asm asmtested.tap 2> /dev/null
+ok $? 'Overwrites and regions checked in banks'
+
+printf '\tORG 8000H\nstart\tLD A,1\n\tRET\n' > asmsrc.asm
+${PASMO} --srcmap asmtested.srcmap --srcindex asmtested.srcidx \
+	asmsrc.asm $BIN &&
+grep -q '^8000 8001 2 asmsrc.asm$' asmtested.srcmap &&
+grep -q '^8002 8002 3 asmsrc.asm$' asmtested.srcmap &&
+test "$(head -c 4 asmtested.srcidx)" = PSRC &&
+test $(wc -c < asmtested.srcidx) -eq 55
+ok $? 'Source map and source index'
+
+${PASMO} --symformat sjasm asmsrc.asm $BIN $SYM &&
+grep -qi '^start: EQU 0x00008000$' $SYM &&
+${PASMO} --symformat nocash asmsrc.asm $BIN $SYM &&
+grep -qi '^00:8000 start$' $SYM
+ok $? 'Symbol table in debugger formats'
+
+${PASMO} --tzxbas --speed fastest black.asm black.tzx
+ok $((! $?)) 'Invalid speed profile'
+
+${PASMO} dce_test.asm $BIN
+test $(wc -c < $BIN) -eq 22
+ok $? 'Assembled dce_test.asm with unused code'
+
+${PASMO} --dropunused dce_test.asm $BIN
+test $(wc -c < $BIN) -eq 13
+ok $? 'Assembled dce_test.asm with --dropunused'
+
+printf '\tORG 8000H\n\tCALL foo\n\tRET\nfoo:\n\tPROC\n\tLD A,1\n\tRET\n\tENDP\nbar\tPROC\n\tRET\n\tENDP\n' > asmdce.asm
+${PASMO} asmdce.asm $BIN &&
+cp $BIN asmdce.bin &&
+${PASMO} --dropunused asmdce.asm $BIN &&
+test $(wc -c < $BIN) -eq 7 &&
+cmp -s -n 7 $BIN asmdce.bin
+ok $? 'Label before PROC keeps it with --dropunused'
+
+printf 'start:\tLD A,1\n\tPROC\n\tINC A\n\tENDP\n\tPROC\n\tRET\n\tENDP\n\tPROC\n\tRET\n\tENDP\n\tEND start\n' > asmdce.asm
+${PASMO} asmdce.asm $BIN &&
+cp $BIN asmdce.bin &&
+${PASMO} --dropunused asmdce.asm $BIN &&
+test $(wc -c < $BIN) -eq 4 &&
+cmp -s -n 4 $BIN asmdce.bin
+ok $? 'PROC entered from the code before it kept with --dropunused'
+
+${PASMO} --map asmtested.map map_test.asm $BIN &&
+cmp -s asmtested.map map.check
+ok $? 'Generate map'
+
+assemble_failed map_test.asm --equ OVERFLOW
+
+assemble_failed map_test.asm --equ INTRUDE
+
+assemble_failed map_test.asm --werror --equ OVERLAP
+
+${PASMO} --map
+ok $((! $?)) 'Option --map needs argument'
+
+${PASMO} -I testaux --list asmtested.lst include_test.asm $BIN &&
+grep -q '^0001 00  *included_in_test.asm:3 ' asmtested.lst
+ok $? 'Generate listing'
+
+${PASMO} --stats tmacro.asm $BIN 2>&1 | grep -q '^macro expansions'
+ok $? 'Show stats'
+
+${PASMO} --statsjson asmtested.json tmacro.asm $BIN &&
+grep -q '"name": "pass 2"' asmtested.json
+ok $? 'Generate stats json'
+
+${PASMO} --statsjson
+ok $((! $?)) 'Option --statsjson needs argument'
+
+${PASMO} -I testaux --trace asmtested.trace include_test.asm $BIN &&
+grep -q '"name": "include ' asmtested.trace
+ok $? 'Generate trace'
+
+${PASMO} --trace
+ok $((! $?)) 'Option --trace needs argument'
+
+# Wait up to 10 seconds for the file to have the size given.
+waitsize ()
+{
+    local i
+    for i in 1 2 3 4 5 6 7 8 9 10
+    do
+        if [ -f $1 ] && [ $(wc -c < $1) -eq $2 ]
+        then
+            return 0
+        fi
+        sleep 1
+    done
+    return 1
+}
+
+${PASMO} -I testaux -MD include_test.asm $BIN &&
+grep -q '^ testaux/included_in_test.asm$' asmtested.d
+ok $? 'Generate dependency file'
+
+${PASMO} -MF asmtested.dep -MP incbin_test.asm $BIN &&
+head -n 1 asmtested.dep | grep -q "^$BIN:" &&
+grep -q '^all.check:$' asmtested.dep
+ok $? 'Generate dependency file with phony targets'
+
+${PASMO} -MF
+ok $((! $?)) 'Option -MF needs argument'
+
+${PASMO} --obj link_main_test.asm asmtested_main.obj &&
+${PASMO} --obj link_lib_test.asm asmtested_lib.obj &&
+${LINK} --sym $SYM asmtested_link.bin --org 8000H \
+    asmtested_main.obj asmtested_lib.obj &&
+${PASMO} link_whole_test.asm asmtested_whole.bin &&
+cmp -s asmtested_link.bin asmtested_whole.bin &&
+grep -q '^MSG.*EQU 0801CH$' $SYM
+ok $? 'Linked relocatable objects'
+
+assemble_failed link_bad_test.asm --obj
+
+${LINK} asmtested_link.bin asmtested_main.obj
+ok $((! $?)) 'Link failed with undefined symbols'
+
+${PASMO} --maxerrors 0 maxerrors_test.asm $BIN 2> asmtested.err
+test $? -ne 0 &&
+grep -q '^5 errors$' asmtested.err &&
+! grep -q "'FOO'" asmtested.err
+ok $? 'All errors collected with --maxerrors'
+
+${PASMO} --maxerrors 2 maxerrors_test.asm $BIN 2>&1 |
+grep -q '^Too many errors'
+ok $? 'Assembly stopped at --maxerrors errors'
+
+${PASMO} --maxerrors 0 maxerrors_pass2_test.asm $BIN 2> asmtested.err
+test $? -ne 0 &&
+grep -q '^3 errors$' asmtested.err &&
+grep -q "'FAILING'" asmtested.err &&
+! grep -q 'Switching to 3 pass mode' asmtested.err
+ok $? 'Errors of pass 2 keep the size of the line'
+
+${PASMO} --maxerrors 0 bad.asm $BIN 2>&1 |
+grep -q '^1 error$'
+ok $? 'Single error counted with --maxerrors'
+
+printf '\tINCLUDE "asmcache_inc.asm"\n' > asmcache.asm
+printf '\tDEFB 1\n' > asmcache_inc.asm
+${PASMO} --cache asmcache asmcache.asm $BIN &&
+${PASMO} -v --cache asmcache asmcache.asm $BIN > asmcache.log 2>&1 &&
+! grep -q 'Entering pass' asmcache.log &&
+test $(wc -c < $BIN) -eq 1
+ok $? 'Outputs copied from the build cache'
+
+printf '\tDEFB 1, 2\n' > asmcache_inc.asm
+${PASMO} -v --cache asmcache asmcache.asm $BIN > asmcache.log 2>&1 &&
+grep -q 'Entering pass' asmcache.log &&
+test $(wc -c < $BIN) -eq 2
+ok $? 'Build cache entry invalid after an include changes'
+
+printf '\t.WARNING "cached"\n\tINCLUDE "asmcache_inc.asm"\n' > asmcache.asm
+${PASMO} --cache asmcache asmcache.asm $BIN 2> /dev/null &&
+${PASMO} -v --cache asmcache asmcache.asm $BIN > asmcache.log 2>&1 &&
+! grep -q 'Entering pass' asmcache.log &&
+grep -q '^WARNING: "cached"' asmcache.log
+ok $? 'Warnings shown again from the build cache'
+
+mkdir -p asmcache1 asmcache2
+rm -f asmcache1/asmshadow.asm
+printf '\tINCLUDE "asmshadow.asm"\n' > asmcache2/asmcache.asm
+printf '\tDEFB 1\n' > asmcache2/asmshadow.asm
+${PASMO} --cache asmcache -I asmcache1 -I asmcache2 \
+    asmcache2/asmcache.asm $BIN &&
+printf '\tDEFB 1, 2\n' > asmcache1/asmshadow.asm &&
+${PASMO} --cache asmcache -I asmcache1 -I asmcache2 \
+    asmcache2/asmcache.asm $BIN &&
+test $(wc -c < $BIN) -eq 2
+ok $? 'Build cache entry invalid when an include is shadowed'
+
+printf '\tDEFB 3\n' > asmcache_inc.asm
+${PASMO} --cache asmcache --cachesize 0 asmcache.asm $BIN &&
+test $(ls asmcache | wc -l) -eq 0
+ok $? 'Build cache entries evicted over the size limit'
+
+printf '\tDEFB 1\n' > asmwatch.asm
+${PASMO} --watch asmwatch.asm asmwatch.bin 2> asmwatch.log &
+watchpid=$!
+waitsize asmwatch.bin 1 &&
+printf '\tDEFB 1, 2\n' > asmwatch.asm &&
+waitsize asmwatch.bin 2
+watched=$?
+kill $watchpid
+ok $watched 'Watch mode assembles again after a change'
+
 # End
@@ -0,0 +1,115 @@
+// test_lzpack.cxx
+
+#include "lzpack.h"
+
+#include "test_protocol.h"
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+using namespace Pasmo::Test;
+
+//**************************************************************
+
+bool roundtrip(const std::vector <byte> & data)
+{
+    const std::vector <byte> packed =
+        lzpack::pack(data.empty() ? nullptr : & data [0], data.size() );
+    return lzpack::unpack(packed) == data;
+}
+
+void test_empty()
+{
+    const std::vector <byte> packed = lzpack::pack(nullptr, 0);
+    is(packed.size(), 1, "Empty data packs to end mark");
+    ok(lzpack::unpack(packed).empty(), "Empty data unpacks");
+}
+
+void test_literals()
+{
+    std::vector <byte> data;
+    for (size_t i = 0; i < 300; ++i)
+        data.push_back(static_cast <byte> (i * 7 + (i >> 3) ) );
+    ok(roundtrip(data), "Literal runs longer than a block");
+}
+
+void test_repeated()
+{
+    std::vector <byte> data(4000, 0xE5);
+    const std::vector <byte> packed = lzpack::pack(& data [0], data.size() );
+    ok(packed.size() < 200, "Repeated byte packs well");
+    ok(lzpack::unpack(packed) == data, "Repeated byte unpacks");
+
+    const std::string text("LD A,(HL) INC HL LD (DE),A INC DE ");
+    data.clear();
+    for (size_t i = 0; i < 50; ++i)
+        data.insert(data.end(), text.begin(), text.begin() + (i % text.size() ) );
+    ok(roundtrip(data), "Repeated text round trip");
+}
+
+void test_random()
+{
+    std::vector <byte> data;
+    unsigned long seed = 12345;
+    for (size_t i = 0; i < 65535; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        // Small alphabet, to have many short matches.
+        data.push_back(static_cast <byte> ( (seed >> 16) % 5) );
+    }
+    ok(roundtrip(data), "Full memory round trip");
+}
+
+void test_invalid()
+{
+    throws_runtime("Truncated data throws",
+        [] ()
+        {
+            std::vector <byte> packed(1, 5);
+            lzpack::unpack(packed);
+        }
+    );
+    throws_runtime("Invalid offset throws",
+        [] ()
+        {
+            std::vector <byte> packed;
+            packed.push_back(0x80);
+            packed.push_back(1);
+            packed.push_back(0);
+            packed.push_back(0);
+            lzpack::unpack(packed);
+        }
+    );
+}
+
+void test_decompressor()
+{
+    const std::vector <byte> withentry =
+        lzpack::decompressor(0x8000, 0x9000, true, 0x9000);
+    is(withentry.size(), 47, "Decompressor with entry point size");
+    is(withentry [0], 0x21, "Decompressor loads source");
+    is(makeword(withentry [1], withentry [2]), 0x8000,
+        "Decompressor source address");
+    is(makeword(withentry [4], withentry [5]), 0x9000,
+        "Decompressor destination address");
+    is(withentry [44], 0xC3, "Decompressor jumps to entry point");
+
+    const std::vector <byte> noentry =
+        lzpack::decompressor(0x8000, 0x9000, false, 0);
+    is(noentry.back(), 0xC9, "Decompressor without entry point returns");
+}
+
+int main()
+{
+    plan(15);
+
+    test_empty();
+    test_literals();
+    test_repeated();
+    test_random();
+    test_invalid();
+    test_decompressor();
+}
+
+// End
@@ -63,6 +63,21 @@ void test_tokenizer()
     Tokenizer tkn2(tkz);
 }
 
+void test_view()
+{
+    const Tokenizer line("LD A,B", false);
+    Tokenizer view(line.begin(), line.end(), false);
+    is(view.size(), 4, "view has the tokens of the range");
+    is(view.gettoken().type(), TypeLD, "view gets the first token");
+
+    Tokenizer copy(view);
+    is(copy.gettoken().type(), TypeLD, "copy of a view starts at the beginning");
+
+    view.push_back(Token(TypeComma, ","));
+    is(view.size(), 5, "push_back in a view copies the tokens");
+    is(line.size(), 4, "push_back in a view does not change the range");
+}
+
 void test_unget()
 {
     throws_logic("invalid ungettoken throws",
@@ -269,10 +284,11 @@ void test_parse_expr()
 
 int main()
 {
-    plan(50);
+    plan(55);
 
     test_token();
     test_tokenizer();
+    test_view();
     test_unget();
     test_include();
     test_chars();
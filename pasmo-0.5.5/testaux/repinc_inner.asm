@@ -0,0 +1,6 @@
+; Included by repinc_lib.asm
+
+	DEFB 3
+	IF $ > 6 AND DEFINED FAIL
+	.ERROR Third inclusion
+	ENDIF
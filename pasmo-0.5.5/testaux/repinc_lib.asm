@@ -0,0 +1,5 @@
+; Included several times by repinc_test.asm
+
+	DEFB 1
+	INCLUDE repinc_inner.asm
+	DEFB 2
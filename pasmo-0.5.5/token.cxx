@@ -209,6 +209,7 @@ const NameType nt [] =
     NT(ELSE),
     NT(ENDIF),
     NT(PUBLIC),
+    NT(EXTRN),
     NT(END),
     NT(LOCAL),
     NT(PROC),
@@ -222,8 +223,11 @@ const NameType nt [] =
 
     // Directives with .
     NT_ (8080),
+    NT_ (BANK),
     NT_ (ERROR),
+    NT_ (PAGE),
     NT_ (WARNING),
+    NT_ (REGION),
     NT_ (SHIFT),
     NT_ (Z80)
 };
@@ -441,36 +445,56 @@ void stripdollar(std::string & str)
 //*********************************************************
 
 Tokenizer::Tokenizer() :
-    current(tokenlist.begin() ),
+    isview(false),
     endpassed(0),
     nocase(false)
 {
+    bind();
 }
 
 Tokenizer::Tokenizer(bool nocase_n) :
-    current(tokenlist.begin() ),
+    isview(false),
     endpassed(0),
     nocase(nocase_n)
 {
+    bind();
 }
 
 Tokenizer::Tokenizer(TypeToken ttok, const std::string & sn) :
-    endpassed(0)
+    isview(false),
+    endpassed(0),
+    nocase(false)
 {
     tokenlist.push_back(Token(ttok, sn) );
-    current = tokenlist.begin();
+    bind();
 }
 
 Tokenizer::Tokenizer(const Tokenizer & tz) :
     tokenlist(tz.tokenlist),
-    current(tokenlist.begin() ),
+    isview(tz.isview),
+    first(tz.first),
+    last(tz.last),
     endpassed(0),
     nocase(tz.nocase)
+{
+    if (! isview)
+        bind();
+    current = first;
+}
+
+Tokenizer::Tokenizer(const Token * first_n, const Token * last_n,
+        bool nocase_n) :
+    isview(true),
+    first(first_n),
+    last(last_n),
+    current(first_n),
+    endpassed(0),
+    nocase(nocase_n)
 {
 }
 
 Tokenizer::Tokenizer(const std::string & line, bool nocase_n) :
-    current(tokenlist.begin() ),
+    isview(false),
     endpassed(0),
     nocase(nocase_n)
 {
@@ -507,7 +531,7 @@ Tokenizer::Tokenizer(const std::string & line, bool nocase_n) :
             break;
         }
     }
-    current = tokenlist.begin();
+    bind();
 }
 
 Tokenizer::~Tokenizer()
@@ -517,12 +541,27 @@ Tokenizer::~Tokenizer()
 Tokenizer & Tokenizer::operator = (const Tokenizer & tz)
 {
     tokenlist = tz.tokenlist;
-    current = tokenlist.begin();
+    isview = tz.isview;
+    if (isview)
+    {
+        first = tz.first;
+        last = tz.last;
+        current = first;
+    }
+    else
+        bind();
     endpassed = 0;
     nocase = tz.nocase;
     return * this;
 }
 
+void Tokenizer::bind()
+{
+    first = tokenlist.data();
+    last = first + tokenlist.size();
+    current = first;
+}
+
 bool Tokenizer::getnocase() const
 {
     return nocase;
@@ -530,38 +569,58 @@ bool Tokenizer::getnocase() const
 
 std::ostream & operator << (std::ostream & oss, const Tokenizer & tz)
 {
-    std::copy(tz.tokenlist.begin(), tz.tokenlist.end(),
+    std::copy(tz.first, tz.last,
         std::ostream_iterator <Token> (oss, " ") );
     return oss;
 }
 
 void Tokenizer::push_back(const Token & tok)
 {
+    if (isview)
+    {
+        tokenlist.assign(first, last);
+        isview = false;
+    }
     tokenlist.push_back(tok);
-    current = tokenlist.begin();
+    bind();
 }
 
 bool Tokenizer::empty() const
 {
-    return tokenlist.empty();
+    return first == last;
+}
+
+size_t Tokenizer::size() const
+{
+    return last - first;
+}
+
+const Token * Tokenizer::begin() const
+{
+    return first;
+}
+
+const Token * Tokenizer::end() const
+{
+    return last;
 }
 
 bool Tokenizer::endswithparen() const
 {
-    ASSERT(! tokenlist.empty() );
-    return tokenlist.back().type() == TypeClose;
+    ASSERT(! empty() );
+    return (last - 1)->type() == TypeClose;
 }
 
 
 void Tokenizer::reset()
 {
-    current = tokenlist.begin();
+    current = first;
     endpassed = 0;
 }
 
 Token Tokenizer::gettoken()
 {
-    if (current == tokenlist.end() )
+    if (current == last)
     {
         ++endpassed;
         return Token(TypeEndLine, "");
@@ -578,12 +637,12 @@ void Tokenizer::ungettoken()
 {
     if (endpassed > 0)
     {
-        ASSERT(current == tokenlist.end() );
+        ASSERT(current == last);
         --endpassed;
     }
     else
     {
-        if (current == tokenlist.begin() )
+        if (current == first)
             throw tokenizerunderflow();
         --current;
     }
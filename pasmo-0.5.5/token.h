@@ -4,7 +4,7 @@
 // token.h
 
 #include <string>
-#include <deque>
+#include <vector>
 
 #include "pasmotypes.h"
 
@@ -192,6 +192,7 @@ enum TypeToken
     TypeELSE,
     TypeENDIF,
     TypePUBLIC,
+    TypeEXTRN,
     TypeEND,
     TypeLOCAL,
     TypePROC,
@@ -205,8 +206,11 @@ enum TypeToken
 
     // Directives with .
     Type_8080,
+    Type_BANK,
     Type_ERROR,
+    Type_PAGE,
     Type_WARNING,
+    Type_REGION,
     Type_SHIFT,
     Type_Z80,
 
@@ -245,12 +249,18 @@ public:
     Tokenizer(TypeToken ttok, const std::string & sn);
     Tokenizer(const Tokenizer & tz);
     Tokenizer(const std::string & line, bool nocase_n);
+    // Tokenizer that uses the tokens in the range without copying
+    // them, they must be kept while it is used.
+    Tokenizer(const Token * first_n, const Token * last_n, bool nocase_n);
     ~Tokenizer();
     Tokenizer & operator = (const Tokenizer &);
 
     bool getnocase() const;
     void push_back(const Token & tok);
     bool empty() const;
+    size_t size() const;
+    const Token * begin() const;
+    const Token * end() const;
     bool endswithparen() const;
 
     void reset();
@@ -277,9 +287,16 @@ private:
     Token parseor(std::istream & iss);
     Token parsetoken(std::istream & iss);
 
-    typedef std::deque <Token> tokenlist_t;
+    void bind();
+
+    typedef std::vector <Token> tokenlist_t;
     tokenlist_t tokenlist;
-    tokenlist_t::iterator current;
+
+    // The tokens used, in tokenlist or in external storage.
+    bool isview;
+    const Token * first;
+    const Token * last;
+    const Token * current;
 
     size_t endpassed;
     bool nocase;
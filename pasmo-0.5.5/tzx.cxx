@@ -7,63 +7,234 @@
 
 #include "pasmotypes.h"
 
+#include <stdexcept>
+
 #include <assert.h>
 
 #define ASSERT assert
 
-void tzx::writefilehead(std::ostream & out)
+void tzx::writefilehead(ByteBuffer & out)
 {
     // TZX header.
-    static const char tzxhead []= {
+    static const byte tzxhead []= {
         'Z', 'X', 'T', 'a', 'p', 'e', '!', 0x1A, // TZX ID.
         1, 13, // TZX format version.
     };
-    out.write(tzxhead, sizeof(tzxhead) );
+    out.append(tzxhead, sizeof(tzxhead) );
 }
 
-void tzx::writestandardblockhead(std::ostream & out)
+void tzx::writestandardblockhead(ByteBuffer & out)
 {
-    out.put('\x10'); // Standard speed block.
+    out.put(0x10); // Standard speed block.
     address pause = 1000; // Pause after block in milisecs.
-    out.put(lobyte(pause) );
-    out.put(hibyte(pause) );
+    out.putword(pause);
 }
 
-void tzx::writeturboblockhead(std::ostream & out, size_t len)
+namespace
+{
+
+const char * const speednames [] = { "standard", "fast", "turbo", "max" };
+const size_t numspeeds = sizeof(speednames) / sizeof(speednames [0] );
+
+// The standard one is the speed of the Spectrum ROM loader, the
+// other ones need the turbo loader.
+
+const tzx::Timing spectrumtimings [numspeeds] = {
+    { 2168, 667, 735, 855, 1710, 3223, 1000 },
+    { 2168, 667, 735, 570, 1140, 2000, 1000 },
+    { 2168, 667, 735, 427,  855, 1500, 1000 },
+    { 2168, 667, 735, 285,  570, 1000, 1000 },
+};
+
+// Amstrad CPC firmware speeds: 1000 and 2000 baud.
+
+const tzx::Timing cpctimings [2] = {
+    { 0x0700, 0x0380, 0x0380, 0x0380, 0x0700, 0x1000, 0x0970 },
+    { 0x0380, 0x01C0, 0x01C0, 0x01C0, 0x0380, 0x1000, 0x0970 },
+};
+
+// Pilot length of header blocks in the standard speed.
+const address headerpilotlen = 8063;
+
+size_t speedindex(const std::string & speed)
+{
+    for (size_t i = 0; i < numspeeds; ++i)
+        if (speed == speednames [i] )
+            return i;
+    throw std::runtime_error("Invalid speed profile: " + speed);
+}
+
+} // namespace
+
+bool tzx::isspeed(const std::string & speed)
+{
+    for (size_t i = 0; i < numspeeds; ++i)
+        if (speed == speednames [i] )
+            return true;
+    return speed.empty();
+}
+
+bool tzx::isstandardspeed(const std::string & speed)
+{
+    return speed.empty() || speed == speednames [0];
+}
+
+const tzx::Timing & tzx::spectrumtiming(const std::string & speed)
+{
+    if (speed.empty() )
+        return spectrumtimings [0];
+    return spectrumtimings [speedindex(speed) ];
+}
+
+const tzx::Timing & tzx::cpctiming(const std::string & speed)
+{
+    if (speed.empty() )
+        return cpctimings [1];
+    const size_t n = speedindex(speed);
+    if (n > 1)
+        throw std::runtime_error("Speed profile " + speed +
+            " not supported in CPC");
+    return cpctimings [n];
+}
+
+void tzx::writeturboblockhead(ByteBuffer & out, size_t len,
+    const Timing & timing)
 {
     ASSERT(len <= 0xFFFFFF);
 
     out.put(0x11); // Block type.
 
-    putword(out, 0x0380); // Pilot pulse
-    putword(out, 0x01C0); // Sync first pulse
-    putword(out, 0x01C0); // Sync second pulse
-    putword(out, 0x01C0); // Zero bit pulse
-    putword(out, 0x0380); // One bit pulse
-    putword(out, 0x1000); // Pilot tone
-    out.put(0x08);        // Bits used in last byte
-    putword(out, 0x0970); // Pause after block
+    out.putword(timing.pilot);    // Pilot pulse
+    out.putword(timing.sync1);    // Sync first pulse
+    out.putword(timing.sync2);    // Sync second pulse
+    out.putword(timing.zero);     // Zero bit pulse
+    out.putword(timing.one);      // One bit pulse
+    out.putword(timing.pilotlen); // Pilot tone
+    out.put(0x08);                // Bits used in last byte
+    out.putword(timing.pause);    // Pause after block
     // Length of data
-    putword(out, len & 0xFFFF);
+    out.putword(len & 0xFFFF);
     out.put( (len >> 16) & 0xFF);
 }
 
-void tzx::write_tzx_code(const Asm & as, std::ostream & out)
+namespace
+{
+
+void writecode(const Asm & as, ByteBuffer & out,
+    address start, address size, const byte * data)
 {
     // Preapare data needed.
 
-    const address codesize = as.getcodesize();
-    const address minused = as.getminused();
-    const tap::CodeHeader block1(minused, codesize, as.getheadername());
-    const tap::CodeBlock block2(codesize, as.getmem() + minused);
+    const tap::CodeHeader block1(start, size, as.getheadername());
+    const tap::CodeBlock block2(size, data);
 
     // Write the data.
 
-    writestandardblockhead(out);
+    tzx::writestandardblockhead(out);
     block1.write(out);
 
-    writestandardblockhead(out);
+    tzx::writestandardblockhead(out);
     block2.write(out);
 }
 
+} // namespace
+
+void tzx::write_tzx_code(const Asm & as, ByteBuffer & out)
+{
+    const address minused = as.getminused();
+    writecode(as, out, minused, as.getcodesize(), as.getmem() + minused);
+
+    // The code of each bank follows in its own blocks.
+    const std::vector <Asm::BankCode> banks = as.getbanks();
+    for (size_t i = 0; i < banks.size(); ++i)
+        writecode(as, out, banks [i].start, banks [i].size, banks [i].data);
+}
+
+double tzx::blocktime(const Timing & timing, const byte * data, size_t size)
+{
+    const double clock = 3500000.0;
+
+    // Two pulses per bit.
+    size_t ones = 0;
+    for (size_t i = 0; i < size; ++i)
+        for (byte b = data [i]; b != 0; b >>= 1)
+            ones += b & 1;
+    const size_t bits = size * 8;
+
+    const double tstates = double(timing.pilot) * timing.pilotlen +
+        timing.sync1 + timing.sync2 +
+        2.0 * (double(ones) * timing.one + double(bits - ones) * timing.zero);
+    return tstates / clock + timing.pause / 1000.0;
+}
+
+double tzx::loadtime(const ByteBuffer & image)
+{
+    const byte * const data = image.data();
+    const size_t size = image.size();
+    double total = 0;
+    size_t pos = 10; // Skip the file header.
+    while (pos < size)
+    {
+        const byte type = data [pos];
+        if (type == 0x10 && pos + 5 <= size)
+        {
+            // Standard speed block.
+            Timing timing = spectrumtimings [0];
+            timing.pause = makeword(data [pos + 1], data [pos + 2] );
+            const size_t len = makeword(data [pos + 3], data [pos + 4] );
+            pos += 5;
+            if (pos + len > size)
+                break;
+            if (len > 0 && data [pos] < 0x80)
+                timing.pilotlen = headerpilotlen;
+            total += blocktime(timing, data + pos, len);
+            pos += len;
+        }
+        else if (type == 0x11 && pos + 19 <= size)
+        {
+            // Turbo speed block.
+            const byte * const head = data + pos + 1;
+            Timing timing;
+            timing.pilot = makeword(head [0], head [1] );
+            timing.sync1 = makeword(head [2], head [3] );
+            timing.sync2 = makeword(head [4], head [5] );
+            timing.zero = makeword(head [6], head [7] );
+            timing.one = makeword(head [8], head [9] );
+            timing.pilotlen = makeword(head [10], head [11] );
+            timing.pause = makeword(head [13], head [14] );
+            const size_t len = makeword(head [15], head [16] ) |
+                (size_t(head [17] ) << 16);
+            pos += 19;
+            if (pos + len > size)
+                break;
+            total += blocktime(timing, data + pos, len);
+            pos += len;
+        }
+        else
+            break;
+    }
+    return total;
+}
+
+double tzx::taploadtime(const ByteBuffer & image)
+{
+    const byte * const data = image.data();
+    const size_t size = image.size();
+    double total = 0;
+    size_t pos = 0;
+    while (pos + 2 <= size)
+    {
+        const size_t len = makeword(data [pos], data [pos + 1] );
+        pos += 2;
+        if (pos + len > size)
+            break;
+        Timing timing = spectrumtimings [0];
+        if (len > 0 && data [pos] < 0x80)
+            timing.pilotlen = headerpilotlen;
+        total += blocktime(timing, data + pos, len);
+        pos += len;
+    }
+    return total;
+}
+
 // End
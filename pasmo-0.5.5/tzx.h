@@ -3,7 +3,10 @@
 
 // tzx.h
 
+#include "pasmotypes.h"
+
 #include <iostream>
+#include <string>
 
 #include <stdlib.h>
 
@@ -12,13 +15,46 @@ class Asm;
 namespace tzx
 {
 
-void writefilehead(std::ostream & out);
+void writefilehead(ByteBuffer & out);
+
+void writestandardblockhead(ByteBuffer & out);
+
+// Pulse lengths of a tape block in T states of a 3.5 MHz Z80,
+// length of the pilot tone in pulses and pause after it in ms.
+
+struct Timing
+{
+    address pilot;
+    address sync1;
+    address sync2;
+    address zero;
+    address one;
+    address pilotlen;
+    address pause;
+};
+
+// Speed profiles: standard, fast, turbo and max. An empty name
+// selects the usual speed of the machine.
+
+bool isspeed(const std::string & speed);
+bool isstandardspeed(const std::string & speed);
+const Timing & spectrumtiming(const std::string & speed);
+const Timing & cpctiming(const std::string & speed);
+
+void writeturboblockhead(ByteBuffer & out, size_t len,
+    const Timing & timing);
+
+void write_tzx_code(const Asm & as, ByteBuffer & out);
+
+// Estimated time in seconds to load a block with the given data,
+// including the pause after it.
 
-void writestandardblockhead(std::ostream & out);
+double blocktime(const Timing & timing, const byte * data, size_t size);
 
-void writeturboblockhead(std::ostream & out, size_t len);
+// Estimated time to load a full tzx or tap image.
 
-void write_tzx_code(const Asm & as, std::ostream & out);
+double loadtime(const ByteBuffer & image);
+double taploadtime(const ByteBuffer & image);
 
 } // namespace tzx
 